@@ -1,15 +1,29 @@
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <deque>
+#include <functional>
+#include <set>
+#include <vector>
 
 #import "Foundation/Foundation.h"
 #include "gr/io/io.h"
 #include "gr/utils/geometry.h"
 #include "gr/utils/sampling.h"
+#include "gr/utils/scheduler.h"
 #include "gr/algorithms/match4pcsBase.h"
+#include "gr/algorithms/preparedCloud.h"
 #include "gr/algorithms/Functor4pcs.h"
 #include "gr/algorithms/FunctorSuper4pcs.h"
 #include "gr/algorithms/FunctorBrute4pcs.h"
+#include "gr/accelerators/depthImageIndex.h"
+#include "gr/accelerators/kdforest.h"
 #include <gr/algorithms/PointPairFilter.h>
 
 #include <Eigen/Dense>
@@ -35,77 +49,420 @@ IOManager ioManager;
 //     fprintf(stderr, "\t[ --sampled1 (output sampled cloud 1 -- debug+super4pcs only) ]\n");
 //     fprintf(stderr, "\t[ --sampled2 (output sampled cloud 2 -- debug+super4pcs only) ]\n");
 // }
-struct TransformVisitor {
+/// Progress of a registration. Written by the registration thread, and read
+/// from any thread without locking: the version is odd while a snapshot is
+/// being written, readers retry until they get a consistent snapshot.
+struct RegistrationProgress {
+    std::atomic<uint32_t> version {0};
+    std::atomic<float> fraction {0};
+    std::atomic<float> score {0};
+    std::atomic<float> mat[16];
+
+    RegistrationProgress() {
+        for (int i = 0; i < 16; i++)
+            mat[i].store((i % 5 == 0) ? 1.0f : 0.0f, std::memory_order_relaxed);
+    }
+
+    template <typename Derived>
+    void store(float f, float s, const Eigen::MatrixBase<Derived>& transformation) {
+        const uint32_t v = version.load(std::memory_order_relaxed);
+        version.store(v + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        fraction.store(f, std::memory_order_relaxed);
+        score.store(s, std::memory_order_relaxed);
+        for (int i = 0; i < 4; i++)
+            for (int j = 0; j < 4; j++)
+                mat[i*4+j].store(transformation(i,j), std::memory_order_relaxed);
+        version.store(v + 2, std::memory_order_release);
+    }
+
+    void load(float *outputFraction, float *outputScore, float *outputMat) const {
+        float f, s, m[16];
+        uint32_t v0, v1;
+        do {
+            v0 = version.load(std::memory_order_acquire);
+            f = fraction.load(std::memory_order_relaxed);
+            s = score.load(std::memory_order_relaxed);
+            for (int i = 0; i < 16; i++)
+                m[i] = mat[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            v1 = version.load(std::memory_order_relaxed);
+        } while ((v0 & 1) || v0 != v1);
+        if (outputFraction) *outputFraction = f;
+        if (outputScore) *outputScore = s;
+        if (outputMat) std::copy(m, m + 16, outputMat);
+    }
+};
+
+/// Publishes the best transformation found so far instead of printing it.
+/// The fraction is kept monotonic across the slices of a registration.
+struct ProgressVisitor {
+    RegistrationProgress *progress = nullptr;
+
     template <typename Derived>
     inline void operator()(
             float fraction,
             float best_LCP,
-            const Eigen::MatrixBase<Derived>& /*transformation*/) const {
-      if (fraction >= 0)
-        {
-          printf("done: %d%c best: %f                  \r",
-               static_cast<int>(fraction * 100), '%', best_LCP);
-          fflush(stdout);
-        }
+            const Eigen::MatrixBase<Derived>& transformation) const {
+        if (fraction >= 0)
+            progress->store((std::max)(fraction, progress->fraction.load(std::memory_order_relaxed)),
+                            best_LCP, transformation);
+    }
+    constexpr bool needsGlobalTransformation() const { return true; }
+};
+
+enum RegistrationState : int32_t {
+    RegistrationRunning   = 0,
+    RegistrationDone      = 1,
+    RegistrationCancelled = 2,
+};
+
+/// Opaque handle on a registration of set2 onto set1, run in time slices
+struct OpenGRRegistration {
+    using Scalar       = float;
+    using PointType    = gr::Point3D<Scalar>;
+    using MatcherType  = gr::Match4pcsBase<gr::FunctorSuper4PCS, PointType,
+                                           ProgressVisitor, gr::AdaptivePointFilter,
+                                           gr::AdaptivePointFilter::Options>;
+    using OptionType   = typename MatcherType::OptionsType;
+    using MatrixType   = Eigen::Matrix<Scalar, 4, 4>;
+    using CloudType    = gr::PreparedCloud<PointType>;
+
+    /// Input sets, prepared by the first slice unless given prepared
+    vector<PointType> set1, set2;
+    std::shared_ptr<const CloudType> cloud1, cloud2;
+    Utils::Logger logger {Utils::NoLog};
+    OptionType options;
+    std::unique_ptr<MatcherType> matcher;
+    MatrixType mat {MatrixType::Identity()};
+
+    RegistrationProgress progress;
+    ProgressVisitor visitor;
+    std::atomic<bool> cancelled {false};
+    std::atomic<int32_t> state {RegistrationRunning};
+
+    /// Total time budget, and time spent in the slices so far
+    std::chrono::milliseconds budget;
+    std::chrono::milliseconds elapsed {0};
+};
+
+/// Opaque handle on a point set sampled and indexed once, to be registered
+/// against several others
+struct OpenGRPreparedCloud {
+    std::shared_ptr<const OpenGRRegistration::CloudType> cloud;
+};
+
+static std::shared_ptr<const OpenGRRegistration::CloudType>
+prepareCloud(const vector<OpenGRRegistration::PointType>& points,
+             const OpenGRRegistration::OptionType& options)
+{
+    auto cloud = std::make_shared<OpenGRRegistration::CloudType>();
+    UniformDistSampler<OpenGRRegistration::PointType> sampler;
+    cloud->prepare(points, options, sampler);
+    return cloud;
+}
+
+/// Attributes interleaved after the position of each point, in this order
+enum PointAttributes : int32_t {
+    PointNormals = 1,
+    PointColors  = 2,
+};
+
+static int pointStride(int32_t attributes)
+{
+    return 3 + ((attributes & PointNormals) ? 3 : 0) + ((attributes & PointColors) ? 3 : 0);
+}
+
+static vector<OpenGRRegistration::PointType> readPoints(const float *data, int32_t numPoints,
+                                                        int32_t attributes = 0)
+{
+    using VectorType = OpenGRRegistration::PointType::VectorType;
+    const int stride = pointStride(attributes);
+    const int colors = (attributes & PointNormals) ? 6 : 3;
+    vector<OpenGRRegistration::PointType> points;
+    points.reserve(numPoints);
+    for (int i = 0; i < numPoints; i++) {
+        const float *p = data + i*stride;
+        points.emplace_back(p[0], p[1], p[2]);
+        if (attributes & PointNormals)
+            points.back().set_normal(VectorType(p[3], p[4], p[5]));
+        if (attributes & PointColors)
+            points.back().set_rgb(VectorType(p[colors], p[colors+1], p[colors+2]));
+    }
+    return points;
+}
+
+static OpenGRRegistration *newRegistration(int32_t maxMilliseconds)
+{
+    OpenGRRegistration *reg = new OpenGRRegistration();
+    reg->options.nb_exploration_threads = (std::max)(1u, std::thread::hardware_concurrency());
+    reg->options.adaptive_trials = true;
+    reg->options.verification_subset_size = 32;
+    reg->budget = std::chrono::milliseconds(maxMilliseconds > 0 ?
+                                            maxMilliseconds :
+                                            1000 * reg->options.max_time_seconds);
+    reg->visitor.progress = &reg->progress;
+    return reg;
+}
+
+/// Job of a dependency graph run by a TaskGroup. A job is submitted
+/// when the last of the jobs it depends on is done. The jobs are tasks of
+/// that group only, so the parallel loops nested in a job, which wait for
+/// their own groups, never run another job meanwhile (see TaskGroup::wait).
+struct GraphJob {
+    std::function<void()> work;
+    std::atomic<int> dependencies {0};
+    vector<GraphJob*> successors;
+
+    void dependsOn(GraphJob& job) {
+        dependencies++;
+        job.successors.push_back(this);
+    }
+};
+
+static void submitJob(Utils::TaskGroup& group, GraphJob *job)
+{
+    group.run([&group, job]{
+        job->work();
+        for (GraphJob *next : job->successors)
+            if (--next->dependencies == 0)
+                submitJob(group, next);
+    });
+}
+
+/// Builds the pairs of frames to register: each frame is paired with the
+/// next one, and with the maxNeighbors closest frames looking in a similar
+/// direction (less than 60 degrees apart), according to the initial poses.
+static vector<std::pair<int32_t, int32_t>>
+candidateFramePairs(int32_t numFrames, const float *posesData, int32_t maxNeighbors)
+{
+    const float kMinViewCos = 0.5f;
+
+    // ARKit cameras look towards -z
+    vector<Eigen::Vector3f> positions, directions;
+    for (int i = 0; i < numFrames; i++) {
+        const float *pose = posesData + 16*i;
+        positions.emplace_back(pose[3], pose[7], pose[11]);
+        directions.push_back(-Eigen::Vector3f(pose[2], pose[6], pose[10]).normalized());
+    }
+
+    std::set<std::pair<int32_t, int32_t>> pairs;
+    vector<std::pair<float, int32_t>> neighbors;
+    for (int32_t i = 0; i < numFrames; i++) {
+        if (i + 1 < numFrames)
+            pairs.emplace(i, i + 1);
+
+        neighbors.clear();
+        for (int32_t j = 0; j < numFrames; j++)
+            if (j != i && directions[i].dot(directions[j]) >= kMinViewCos)
+                neighbors.emplace_back((positions[i] - positions[j]).squaredNorm(), j);
+        const size_t k = (std::min)(neighbors.size(), size_t((std::max)(0, maxNeighbors)));
+        std::partial_sort(neighbors.begin(), neighbors.begin() + k, neighbors.end());
+        for (size_t n = 0; n < k; n++)
+            pairs.emplace((std::min)(i, neighbors[n].second), (std::max)(i, neighbors[n].second));
+    }
+    return vector<std::pair<int32_t, int32_t>>(pairs.begin(), pairs.end());
+}
+
+/// Bounded queue with a single producer and a single consumer, neither of
+/// them ever taking a lock. The capacity is rounded up to a power of two.
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) {
+        size_t n = 1;
+        while (n < capacity) n *= 2;
+        items.resize(n);
+    }
+
+    /// Called by the producer, returns false if the queue is full
+    bool tryPush(const T& item) {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == items.size())
+            return false;
+        items[t & (items.size() - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
     }
-    constexpr bool needsGlobalTransformation() const { return false; }
+
+    /// Called by the consumer, returns false if the queue is empty
+    bool tryPop(T& item) {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        item = items[h & (items.size() - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    vector<T> items;
+    std::atomic<size_t> head {0}, tail {0};
+};
+
+/// Refined pose of a frame, published by an online registration session
+struct SessionPose {
+    int32_t frame = -1;
+    int32_t keyframe = 0;
+    /// Overlap of the frame with the model, -1 if its registration failed
+    float score = 0;
+    /// World space correction of the frame (row major), mapping the points
+    /// placed by the prior pose onto the model
+    float mat[16] = {1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1};
 };
 
-template <
-    typename Matcher,
-    typename PointType,
-    typename Options,
-    typename Range,
-    template<typename> typename Sampler,
-    typename TransformVisitor>
-typename PointType::Scalar computeAlignment (
-    const Options& options,
-    const Utils::Logger& logger,
-    const Range& P,
-    const Range& Q,
-    Eigen::Ref<Eigen::Matrix<typename PointType::Scalar, 4, 4>> mat,
-    const Sampler<PointType>& sampler,
-    TransformVisitor& visitor
-    ) {
-  Matcher matcher (options, logger);
-  logger.Log<Utils::Verbose>( "Starting registration" );
-  typename PointType::Scalar score = matcher.ComputeTransformation(P, Q, mat, sampler, visitor);
-
-
-  logger.Log<Utils::Verbose>( "Score: ", score );
-  logger.Log<Utils::Verbose>( "(Homogeneous) Transformation from ",
-                              "Set2",
-                              " to ",
-                              "Set1",
-                              ": \n",
-                              mat);
-
-//   if(! outputSampled1.empty() ){
-//       logger.Log<Utils::Verbose>( "Exporting Sampled cloud 1 to ",
-//                                   outputSampled1.c_str(),
-//                                   " ..." );
-//       ioManager.WriteObject((char *)outputSampled1.c_str(),
-//                              matcher.getFirstSampled(),
-//                              vector<Eigen::Matrix2f>(),
-//                              vector<typename Point3D<float>::VectorType>(), // dummy
-//                              vector<tripple>(),
-//                              vector<string>());
-//       logger.Log<Utils::Verbose>( "Export DONE" );
-//   }
-//   if(! outputSampled2.empty() ){
-//       logger.Log<Utils::Verbose>( "Exporting Sampled cloud 2 to ",
-//                                   outputSampled2.c_str(),
-//                                   " ..." );
-//       ioManager.WriteObject((char *)outputSampled2.c_str(),
-//                              matcher.getSecondSampled(),
-//                              vector<Eigen::Matrix2f>(),
-//                              vector<typename Point3D<float>::VectorType>(), // dummy
-//                              vector<tripple>(),
-//                              vector<string>());
-//       logger.Log<Utils::Verbose>( "Export DONE" );
-//   }
-
-  return score;
+/// Opaque handle on an online registration: frames are registered one by one,
+/// as they are captured, against a model made of the keyframes registered
+/// so far. The frames are registered in order by a background thread.
+struct OpenGRSession {
+    using ModelType = gr::KdForest<float>;
+
+    struct Frame {
+        int32_t id;
+        Eigen::Matrix3Xf points, normals;
+        Eigen::Matrix4f pose;
+    };
+
+    ModelType model;
+    /// Refined camera to world poses of the keyframes
+    vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f>> keyframes;
+    /// Correction of the last registered frame, the initial guess of the next one
+    Eigen::Affine3f drift {Eigen::Affine3f::Identity()};
+    ICP::IcpWorkspace<float> icp;
+    float keyframeDistance;
+    float keyframeCos;
+    int32_t withNormals = -1;
+
+    std::mutex mutex;
+    std::condition_variable wake, idle;
+    std::deque<Frame> pending;
+    bool busy = false;
+    std::atomic<bool> stopping {false};
+    std::atomic<int32_t> error {0};
+
+    SpscQueue<SessionPose> poses;
+    std::thread worker;
+
+    OpenGRSession(float voxelSize, float distance, float degrees, size_t capacity)
+        : model(voxelSize), keyframeDistance(distance),
+          keyframeCos(float(std::cos(degrees * M_PI / 180.0))), poses(capacity) {}
+};
+
+/// Registers a frame against the model of the session, and adds it to the
+/// model if its refined pose is far enough from the poses of all the
+/// keyframes. ICP starts from the correction of the previous frame, and its
+/// result is kept only if enough points of the frame overlap the model. A
+/// rejected frame is not added, so that it cannot corrupt the model.
+static SessionPose registerSessionFrame(OpenGRSession& session, const OpenGRSession::Frame& frame)
+{
+    // ICP runs on a subset of the frame
+    const int kMaxIcpPoints = 4096;
+    const float kMinOverlap = 0.3f;
+
+    OpenGRSession::ModelType& model = session.model;
+    Eigen::Affine3f correction = session.drift;
+    SessionPose pose;
+    pose.frame = frame.id;
+    // The first frames build the model, the next ones must be registered
+    bool accepted = model.size() == 0;
+
+    if (model.size() > 0 && frame.points.cols() > 0) {
+        const Eigen::DenseIndex step = (frame.points.cols() + kMaxIcpPoints - 1) / kMaxIcpPoints;
+        Eigen::Matrix3Xf X (3, (frame.points.cols() + step - 1) / step);
+        for (Eigen::DenseIndex i = 0; i < X.cols(); i++)
+            X.col(i) = correction * frame.points.col(i * step);
+
+        ICP::Parameters par;
+        par.f = ICP::TRIMMED;
+        par.p = 0.8;
+        par.max_icp = 30;
+        Eigen::Affine3f refinement;
+        if (session.withNormals)
+            refinement = ICP::point_to_plane(X, model, model.points(), model.normals(), par, session.icp);
+        else
+            refinement = ICP::point_to_point(X, model, model.points(), par, session.icp);
+
+        // Overlap: fraction of the points within two voxels of the model
+        const float inlierSqDist = 4 * model.voxelSize() * model.voxelSize();
+        Eigen::DenseIndex inliers = 0;
+        for (Eigen::DenseIndex i = 0; i < X.cols(); i++)
+            if (model.closest(X.col(i), inlierSqDist).first != OpenGRSession::ModelType::invalidIndex())
+                inliers++;
+        pose.score = float(inliers) / float(X.cols());
+
+        if (pose.score >= kMinOverlap) {
+            correction = refinement * correction;
+            session.drift = correction;
+            accepted = true;
+        }
+    }
+
+    const Eigen::Matrix4f refinedPose = correction.matrix() * frame.pose;
+    bool redundant = false;
+    for (const Eigen::Matrix4f& keyframe : session.keyframes) {
+        const float cos = 0.5f * ((keyframe.topLeftCorner<3,3>().transpose() *
+                                   refinedPose.topLeftCorner<3,3>()).trace() - 1.0f);
+        if ((keyframe.topRightCorner<3,1>() - refinedPose.topRightCorner<3,1>()).norm() < session.keyframeDistance &&
+            cos > session.keyframeCos) {
+            redundant = true;
+            break;
+        }
+    }
+    if (accepted && ! redundant && frame.points.cols() > 0) {
+        const Eigen::Matrix3Xf points = correction * frame.points;
+        if (session.withNormals)
+            model.insert(points, Eigen::Matrix3Xf(correction.linear() * frame.normals));
+        else
+            model.insert(points);
+        session.keyframes.push_back(refinedPose);
+        pose.keyframe = 1;
+    }
+
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+            pose.mat[i*4+j] = correction.matrix()(i, j);
+    return pose;
+}
+
+/// Body of the background thread of a session
+static void runSession(OpenGRSession *session)
+{
+    for (;;) {
+        OpenGRSession::Frame frame;
+        {
+            std::unique_lock<std::mutex> lock (session->mutex);
+            session->wake.wait(lock, [session]{ return session->stopping || ! session->pending.empty(); });
+            if (session->stopping)
+                return;
+            frame = std::move(session->pending.front());
+            session->pending.pop_front();
+            session->busy = true;
+        }
+
+        SessionPose pose;
+        pose.frame = frame.id;
+        try {
+            pose = registerSessionFrame(*session, frame);
+        }
+        catch (const std::exception&) {
+            session->error = -3;
+            pose.score = -1;
+        }
+        catch (...) {
+            session->error = -4;
+            pose.score = -1;
+        }
+
+        // Waits for the consumer when the queue of poses is full
+        while (! session->poses.tryPush(pose) && ! session->stopping)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        {
+            std::lock_guard<std::mutex> lock (session->mutex);
+            session->busy = false;
+        }
+        session->idle.notify_all();
+    }
 }
 
 extern "C" {
@@ -117,122 +474,635 @@ void NativeJunk_SayHello() {
     NSLog (@"Hello, from NativeJunk 2!\n");
 }
 
+/// Registers set2 onto set1 by ICP, working directly on the buffers of the
+/// caller: set2 is transformed in place.
+/// @param outputMat Transformation applied to set2 (row major), or null.
 int32_t IterativeClosestPoint(const float *set1Data, int32_t set1NumPoints, float *set2Data, int32_t set2NumPoints, float *outputMat)
 {
-    Eigen::Matrix3Xd set1(3, set1NumPoints);
-    for (int i = 0; i < set1NumPoints; i++) {
-        set1(0, i) = set1Data[i * 3];
-        set1(1, i) = set1Data[i * 3 + 1];
-        set1(2, i) = set1Data[i * 3 + 2];
-    }
+    const Eigen::Map<const Eigen::Matrix3Xf> set1 (set1Data, 3, set1NumPoints);
     NSLog(@"Num points in set1: %ld", set1.cols());
-    Eigen::Matrix3Xd set2(3, set2NumPoints);
-    for (int i = 0; i < set2NumPoints; i++) {
-        set2(0, i) = set2Data[i * 3];
-        set2(1, i) = set2Data[i * 3 + 1];
-        set2(2, i) = set2Data[i * 3 + 2];
-    }
+    Eigen::Map<Eigen::Matrix3Xf> set2 (set2Data, 3, set2NumPoints);
     NSLog(@"Num points in set2: %ld", set2.cols());
-    ICP::point_to_point(set1, set2);
+    if (set1NumPoints <= 0 || set2NumPoints <= 0)
+        return -1;
+    const Eigen::Affine3f transformation = ICP::point_to_point(set2, set1);
+    if (outputMat)
+        for (int i = 0; i < 4; i++)
+            for (int j = 0; j < 4; j++)
+                outputMat[i*4+j] = transformation.matrix()(i, j);
     return 0;
 }
 
-int32_t OpenGRMain(const float *set1Data, int32_t set1NumPoints, float *set2Data, int32_t set2NumPoints, float *outputMat, float *outputScore) {
-  using namespace gr;
-  using Scalar = float;
-  // Point clouds are read as gr::Point3D, then converted to other types if necessary to
-  // emulate PointAdapter usage
-  vector<Point3D<Scalar> > set1, set2;
-  vector<Eigen::Matrix2f> tex_coords1, tex_coords2;
-  vector<typename Point3D<Scalar>::VectorType> normals1, normals2;
-  vector<tripple> tris1, tris2;
-  vector<std::string> mtls1, mtls2;
-
-  // Match and return the score (estimated overlap or the LCP).
-  typename Point3D<Scalar>::Scalar score = 0;
-
-  constexpr Utils::LogLevel loglvl = Utils::Verbose;
-
-  using TrVisitorType = typename std::conditional <loglvl==Utils::NoLog,
-                            DummyTransformVisitor,
-                            TransformVisitor>::type;
-  using PairFilter = gr::AdaptivePointFilter;
-
-  TrVisitorType visitor;
-  Utils::Logger logger(loglvl);
-
-  // prepare matcher ressourcesoutputSampled2
-  using MatrixType = Eigen::Matrix<typename Point3D<Scalar>::Scalar, 4, 4>;
-  MatrixType mat (MatrixType::Identity());
-
-  // Read the inputs.
-  for (int i = 0; i < set1NumPoints; i++) {
-      if (i < 10) {
-          NSLog(@"IN1: %f %f %f\n", set1Data[i*3], set1Data[i*3+1], set1Data[i*3+2]);
-      }
-    set1.push_back(Point3D<Scalar>(set1Data[i*3], set1Data[i*3+1], set1Data[i*3+2]));
-  }
-  for (int i = 0; i < set2NumPoints; i++) {
-      if (i < 10) {
-          NSLog(@"IN2: %f %f %f\n", set2Data[i*3], set2Data[i*3+1], set2Data[i*3+2]);
-      }
-    set2.push_back(Point3D<Scalar>(set2Data[i*3], set2Data[i*3+1], set2Data[i*3+2]));
-  }
+/// Same as IterativeClosestPoint, with the options of point to point ICP.
+/// @param pyramidLevels Number of levels of a coarse to fine ICP, including
+/// the full resolution, the finest downsampled level having voxels of about
+/// 1/128 of the extent of set1. <= 1 for a single full resolution level.
+/// @param andersonHistory Number of iterates used by Anderson acceleration,
+/// 0 to disable it.
+int32_t IterativeClosestPointWithOptions(const float *set1Data, int32_t set1NumPoints,
+                                         float *set2Data, int32_t set2NumPoints,
+                                         int32_t pyramidLevels, int32_t andersonHistory,
+                                         float *outputMat)
+{
+    const Eigen::Map<const Eigen::Matrix3Xf> set1 (set1Data, 3, set1NumPoints);
+    Eigen::Map<Eigen::Matrix3Xf> set2 (set2Data, 3, set2NumPoints);
+    if (set1NumPoints <= 0 || set2NumPoints <= 0 || andersonHistory < 0)
+        return -1;
+    ICP::Parameters par;
+    par.anderson = andersonHistory;
+    const double diagonal = (set1.rowwise().maxCoeff() - set1.rowwise().minCoeff()).norm();
+    const Eigen::Affine3f transformation = pyramidLevels > 1 && diagonal > 0 ?
+        ICP::point_to_point(set2, set1, ICP::pyramid_levels(diagonal / 128, pyramidLevels, par), par) :
+        ICP::point_to_point(set2, set1, par);
+    if (outputMat)
+        for (int i = 0; i < 4; i++)
+            for (int j = 0; j < 4; j++)
+                outputMat[i*4+j] = transformation.matrix()(i, j);
+    return 0;
+}
 
-  // clean only when we have pset to avoid wrong face to point indexation
-  if (tris1.size() == 0)
-    Utils::CleanInvalidNormals(set1, normals1);
-  if (tris2.size() == 0)
-    Utils::CleanInvalidNormals(set2, normals2);
+/// Registers points onto a depth image by projective ICP with point to plane.
+/// The points are transformed in place, without copying them.
+/// @param depthData Depth of the target pixels, row by row, <= 0 when unknown.
+/// @param intrinsics fx, fy, cx, cy of the target, in pixels of the depth image.
+/// @param pose Camera to world pose of the target, row major.
+/// @param window Half size of the searched window, in pixels.
+/// @param outputMat Applied transform, row major, or null.
+int32_t ProjectiveIterativeClosestPoint(const float *depthData, int32_t width, int32_t height,
+                                        const float *intrinsics, const float *pose, int32_t window,
+                                        float *pointsData, int32_t numPoints, float *outputMat)
+{
+    if (! depthData || width <= 0 || height <= 0 || ! intrinsics || ! pose || numPoints <= 0)
+        return -1;
+    Eigen::Map<Eigen::Matrix3Xf> points (pointsData, 3, numPoints);
+    const DepthImageIndex<float>::Intrinsics k { intrinsics[0], intrinsics[1], intrinsics[2], intrinsics[3] };
+    Eigen::Affine3f cameraToWorld;
+    cameraToWorld.matrix() = Eigen::Map<const Eigen::Matrix<float, 4, 4, Eigen::RowMajor>>(pose);
 
-  try {
-      using PointType    = gr::Point3D<Scalar>;
-      using MatcherType  = gr::Match4pcsBase<gr::FunctorSuper4PCS, PointType, 
-                                             TrVisitorType, gr::AdaptivePointFilter,
-                                             gr::AdaptivePointFilter::Options>;
-      using OptionType   = typename MatcherType::OptionsType;
+    ICP::Parameters par;
+    par.f = ICP::TRIMMED;
+    par.p = 0.8;
+    ICP::IcpWorkspace<float> ws;
+    const Eigen::Affine3f transformation =
+        ICP::projective_point_to_plane(points, depthData, width, height, k, cameraToWorld, par, ws, window);
+    if (outputMat)
+        for (int i = 0; i < 4; i++)
+            for (int j = 0; j < 4; j++)
+                outputMat[i*4+j] = transformation.matrix()(i, j);
+    return 0;
+}
 
-      UniformDistSampler<PointType> sampler;
+/// Creates a registration of set2 onto set1. The point sets are copied, no work
+/// is done until OpenGRRegistration_Step is called.
+/// @param maxMilliseconds Total time budget of the registration, <= 0 for the
+/// default budget of the matcher.
+OpenGRRegistration *OpenGRRegistration_Create(const float *set1Data, int32_t set1NumPoints,
+                                              const float *set2Data, int32_t set2NumPoints,
+                                              int32_t maxMilliseconds)
+{
+    OpenGRRegistration *reg = newRegistration(maxMilliseconds);
+    reg->set1 = readPoints(set1Data, set1NumPoints);
+    reg->set2 = readPoints(set2Data, set2NumPoints);
+    return reg;
+}
 
-      OptionType options;
+/// Same as OpenGRRegistration_Create, for points interleaved with their
+/// normals and/or colors: x y z [nx ny nz] [r g b] for each point.
+/// @param attributes PointNormals (1) | PointColors (2), or 0.
+OpenGRRegistration *OpenGRRegistration_CreateInterleaved(const float *set1Data, int32_t set1NumPoints,
+                                                         const float *set2Data, int32_t set2NumPoints,
+                                                         int32_t attributes, int32_t maxMilliseconds)
+{
+    OpenGRRegistration *reg = newRegistration(maxMilliseconds);
+    reg->set1 = readPoints(set1Data, set1NumPoints, attributes);
+    reg->set2 = readPoints(set2Data, set2NumPoints, attributes);
+    return reg;
+}
 
-      score = computeAlignment<MatcherType, PointType> (options, logger, set1, set2,
-                                                        mat, sampler, visitor);
-  }
-  catch (const std::exception& e) {
-      logger.Log<Utils::ErrorReport>( "[Error]: " , e.what() );
-      logger.Log<Utils::ErrorReport>( "Aborting with code -3 ..." );
-      return -3;
+/// Sets the thresholds pruning the candidate pairs of points against the
+/// pairs of the bases, ignored for the points without normals or colors.
+/// Must be called before the first slice.
+/// @param maxNormalDegrees Largest difference of the angles between the
+/// normals of the pairs, in degrees, <= 0 to ignore the normals.
+/// @param maxColorDistance Largest RGB distance between matched points,
+/// <= 0 to ignore the colors.
+/// @return 0, or -1 if the registration already started.
+int32_t OpenGRRegistration_SetPairFilter(OpenGRRegistration *reg, float maxNormalDegrees, float maxColorDistance)
+{
+    if (reg->matcher)
+        return -1;
+    reg->options.max_normal_difference = maxNormalDegrees;
+    reg->options.max_color_distance = maxColorDistance;
+    return 0;
+}
+
+/// Restricts the registration to the corrections of a guess, e.g. the
+/// relative camera poses of two frames: the candidate transformations must
+/// rotate set2 by less than maxDegrees relative to the guess, and move its
+/// centroid less than maxTranslation away from where the guess brings it.
+/// The bases and their pairs are only searched where the guess makes the
+/// sets overlap, which turns the global search into a local one. The guess
+/// is also the initial solution, and the overlap of the sets under the guess
+/// raises the overlap of the options when larger. Must be called before the
+/// first slice.
+/// @param guessMat Transformation (row major) bringing set2 onto set1.
+/// @return 0, -1 if the registration already started, or -2 if a bound is
+/// negative.
+int32_t OpenGRRegistration_SetPosePrior(OpenGRRegistration *reg, const float *guessMat,
+                                        float maxDegrees, float maxTranslation)
+{
+    if (reg->matcher)
+        return -1;
+    if (! (maxDegrees >= 0 && maxTranslation >= 0))
+        return -2;
+    reg->options.pose_prior = Eigen::Map<const Eigen::Matrix<float, 4, 4, Eigen::RowMajor>>(guessMat);
+    reg->options.pose_prior_max_angle = maxDegrees;
+    reg->options.pose_prior_max_translation = maxTranslation;
+    reg->options.estimate_overlap = true;
+    reg->mat = reg->options.pose_prior;
+    return 0;
+}
+
+/// Creates a registration of set2 onto set1 from prepared clouds, which can
+/// be destroyed before the registration.
+OpenGRRegistration *OpenGRRegistration_CreatePrepared(const OpenGRPreparedCloud *set1,
+                                                      const OpenGRPreparedCloud *set2,
+                                                      int32_t maxMilliseconds)
+{
+    OpenGRRegistration *reg = newRegistration(maxMilliseconds);
+    reg->cloud1 = set1->cloud;
+    reg->cloud2 = set2->cloud;
+    return reg;
+}
+
+/// Runs the registration for about the given number of milliseconds. Each
+/// exploration thread checks the deadline and the cancellation between two
+/// RANSAC trials, so a slice can overrun by the duration of one trial.
+/// Must not be called concurrently with itself or OpenGRRegistration_Destroy.
+/// @return RegistrationRunning (0) if more slices are needed,
+/// RegistrationDone (1), RegistrationCancelled (2), or a negative error code.
+int32_t OpenGRRegistration_Step(OpenGRRegistration *reg, int32_t milliseconds)
+{
+    using clock = std::chrono::steady_clock;
+
+    if (reg->state != RegistrationRunning)
+        return reg->state;
+
+    const clock::time_point t0 = clock::now();
+    const clock::time_point deadline = t0 + std::chrono::milliseconds(milliseconds);
+
+    try {
+        if (! reg->matcher) {
+            if (! reg->cloud1) {
+                reg->cloud1 = prepareCloud(reg->set1, reg->options);
+                reg->cloud2 = prepareCloud(reg->set2, reg->options);
+                vector<OpenGRRegistration::PointType>().swap(reg->set1);
+                vector<OpenGRRegistration::PointType>().swap(reg->set2);
+            }
+            reg->matcher.reset(new OpenGRRegistration::MatcherType(reg->options, reg->logger));
+            if (! reg->matcher->PrepareTransformation(*reg->cloud1, *reg->cloud2))
+                reg->state = RegistrationDone;
+            reg->progress.store(0, reg->matcher->getBestLCP(), reg->mat);
+        }
+
+        // The remaining trials run in one batch, the exploration threads
+        // stopping at the end of the slice, of the budget or on cancellation
+        const auto overBudget = [&] {
+            return reg->elapsed + std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - t0) >= reg->budget;
+        };
+        const std::function<bool()> interrupt = [&] {
+            return reg->cancelled || clock::now() >= deadline || overBudget();
+        };
+        while (reg->state == RegistrationRunning) {
+            if (reg->cancelled) {
+                reg->state = RegistrationCancelled;
+                break;
+            }
+            const int remaining = (std::max)(1, reg->matcher->getNumberOfTrials() - reg->matcher->getCurrentTrial());
+            if (reg->matcher->Perform_N_steps(remaining, reg->mat, reg->visitor, interrupt))
+                reg->state = RegistrationDone;
+            else if (reg->cancelled)
+                reg->state = RegistrationCancelled;
+            else if (overBudget())
+                reg->state = RegistrationDone;
+            else if (clock::now() >= deadline)
+                break;
+        }
+    }
+    catch (const std::exception&) {
+        reg->state = -3;
+    }
+    catch (...) {
+        reg->state = -4;
+    }
+
+    reg->elapsed += std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - t0);
+    if (reg->state == RegistrationDone)
+        reg->progress.store(1.0f, reg->matcher->getBestLCP(), reg->mat);
+    return reg->state;
+}
+
+/// Reads the best transformation (row major) and score found so far, and the
+/// progress in [0, 1]. Never blocks, and can be called from any thread, even
+/// while OpenGRRegistration_Step runs. Any output pointer can be null.
+/// @return the state of the registration, as returned by OpenGRRegistration_Step
+int32_t OpenGRRegistration_GetBest(const OpenGRRegistration *reg, float *outputMat, float *outputScore, float *outputProgress)
+{
+    reg->progress.load(outputProgress, outputScore, outputMat);
+    return reg->state;
+}
+
+/// Requests the registration to stop. Can be called from any thread, the
+/// running slice returns after the current trial.
+void OpenGRRegistration_Cancel(OpenGRRegistration *reg)
+{
+    reg->cancelled = true;
+}
+
+void OpenGRRegistration_Destroy(OpenGRRegistration *reg)
+{
+    delete reg;
+}
+
+/// Samples and indexes a point set once, so that it can be registered
+/// against several others, as set1 or set2, without preprocessing it again.
+OpenGRPreparedCloud *OpenGRPreparedCloud_Create(const float *data, int32_t numPoints)
+{
+    try {
+        OpenGRRegistration::OptionType options;
+        OpenGRPreparedCloud *prepared = new OpenGRPreparedCloud();
+        prepared->cloud = prepareCloud(readPoints(data, numPoints), options);
+        return prepared;
+    }
+    catch (...) {
+        return nullptr;
+    }
+}
+
+void OpenGRPreparedCloud_Destroy(OpenGRPreparedCloud *prepared)
+{
+    delete prepared;
+}
+
+/// Same as OpenGRMain for prepared clouds. The input sets are not modified.
+int32_t OpenGRPrepared(const OpenGRPreparedCloud *set1, const OpenGRPreparedCloud *set2, float *outputMat, float *outputScore)
+{
+  OpenGRRegistration *reg = OpenGRRegistration_CreatePrepared(set1, set2, 0);
+  int32_t state;
+  while ((state = OpenGRRegistration_Step(reg, 1000)) == RegistrationRunning) {}
+
+  OpenGRRegistration_GetBest(reg, outputMat, outputScore, nullptr);
+  OpenGRRegistration_Destroy(reg);
+  return state < 0 ? state : 0;
+}
+
+/// Registers N frames pairwise in one call. The candidate pairs of frames are
+/// chosen from the initial poses, and each pair is registered by Super4PCS
+/// followed by ICP, with an overlap estimated from the initial poses. The
+/// jobs (preparation of each frame, global registration and refinement of
+/// each pair) run on the work-stealing scheduler of the library, a job
+/// starting as soon as the jobs it depends on are done.
+/// @param pointsData Points of each frame, in world space.
+/// @param normalsData Normals of each frame, or null. When given, the
+/// refinement minimizes point to plane distances.
+/// @param colorsData Colors of each frame (3 floats per point), or null.
+/// @param posesData Initial camera to world pose of each frame, row major as
+/// the output matrices.
+/// @param maxNeighbors Number of neighbor frames registered with each frame,
+/// on top of the next frame.
+/// @param maxMilliseconds Time budget of the global registration of a pair,
+/// <= 0 for the default budget of the matcher.
+/// @param numThreads Number of threads running the jobs, including the
+/// parallel loops of the sampling, the matching and the ICP of each pair,
+/// <= 0 to share the threads of the library.
+/// @param maxPairs Capacity of the outputs, at most
+/// numFrames * (maxNeighbors + 1) pairs are registered.
+/// @param outputPairs Indices (first, second) of the frames of each pair.
+/// @param outputMats Transformation (row major) mapping the points of the
+/// second frame onto the first one, for each pair.
+/// @param outputScores LCP score of the global registration of each pair.
+/// @return the number of registered pairs, or a negative error code.
+int32_t OpenGRRegisterFrames(int32_t numFrames,
+                             const float *const *pointsData, const int32_t *numPoints,
+                             const float *const *normalsData, const float *const *colorsData,
+                             const float *posesData,
+                             int32_t maxNeighbors, int32_t maxMilliseconds, int32_t numThreads,
+                             int32_t maxPairs, int32_t *outputPairs, float *outputMats, float *outputScores)
+{
+    using PointType = OpenGRRegistration::PointType;
+    using CloudType = OpenGRRegistration::CloudType;
+
+    // ICP runs on a subset of the second frame of each pair
+    const int kMaxIcpPoints = 4096;
+
+    struct Frame {
+        std::shared_ptr<const CloudType> cloud;
+    };
+    struct Pair {
+        int32_t first, second;
+        OpenGRRegistration::MatrixType mat {OpenGRRegistration::MatrixType::Identity()};
+        float score = 0;
+    };
+
+    if (numFrames < 0 || (numFrames > 0 && (! pointsData || ! numPoints || ! posesData)))
+        return -1;
+
+    const auto candidates = candidateFramePairs(numFrames, posesData, maxNeighbors);
+    if (int64_t(candidates.size()) > maxPairs)
+        return -2;
+
+    vector<Frame> frames (numFrames);
+    vector<Pair> pairs;
+    for (const auto& c : candidates)
+        pairs.push_back(Pair{c.first, c.second});
+
+    std::atomic<int32_t> error {0};
+    auto guard = [&error](const std::function<void()>& f) {
+        try {
+            f();
+        }
+        catch (const std::exception&) {
+            error = -3;
+        }
+        catch (...) {
+            error = -4;
+        }
+    };
+
+    // Frames are prepared once, then used by all the pairs they belong to
+    std::deque<GraphJob> prepareJobs, matchJobs, refineJobs;
+    for (int32_t f = 0; f < numFrames; f++) {
+        prepareJobs.emplace_back();
+        prepareJobs.back().work = [&, f]{ guard([&]{
+            vector<PointType> points = readPoints(pointsData[f], numPoints[f]);
+            if (normalsData && normalsData[f])
+                for (int i = 0; i < numPoints[f]; i++)
+                    points[i].set_normal(Eigen::Map<const Eigen::Vector3f>(normalsData[f] + 3*i));
+            if (colorsData && colorsData[f])
+                for (int i = 0; i < numPoints[f]; i++)
+                    points[i].set_rgb(Eigen::Map<const Eigen::Vector3f>(colorsData[f] + 3*i));
+            frames[f].cloud = prepareCloud(points, OpenGRRegistration::OptionType());
+        }); };
+    }
+
+    for (Pair& pair : pairs) {
+        // Global registration, once both frames are prepared. The scheduler
+        // provides the parallelism, each registration explores on one thread.
+        // Its time budget only counts its own work, as the waits of its
+        // nested loops do not run the other jobs.
+        matchJobs.emplace_back();
+        GraphJob& match = matchJobs.back();
+        match.work = [&]{ guard([&]{
+            if (! frames[pair.first].cloud || ! frames[pair.second].cloud)
+                return;
+            OpenGRRegistration *reg = newRegistration(maxMilliseconds);
+            reg->options.nb_exploration_threads = 1;
+            // The frames are in world space, their overlap is estimated as is
+            reg->options.estimate_overlap = true;
+            reg->cloud1 = frames[pair.first].cloud;
+            reg->cloud2 = frames[pair.second].cloud;
+            int32_t state;
+            while ((state = OpenGRRegistration_Step(reg, 1000)) == RegistrationRunning) {}
+            if (state < 0)
+                error = state;
+            pair.mat = reg->mat;
+            pair.score = reg->progress.score;
+            OpenGRRegistration_Destroy(reg);
+        }); };
+        match.dependsOn(prepareJobs[pair.first]);
+        match.dependsOn(prepareJobs[pair.second]);
+
+        // Refinement, starting from the pose found by the global registration
+        refineJobs.emplace_back();
+        GraphJob& refine = refineJobs.back();
+        refine.work = [&]{ guard([&]{
+            if (numPoints[pair.first] <= 0 || numPoints[pair.second] <= 0)
+                return;
+            // The target is indexed in place, in the buffers of the caller
+            const Eigen::Map<const Eigen::Matrix3Xf> Y (pointsData[pair.first], 3, numPoints[pair.first]);
+            const Eigen::Map<const Eigen::Matrix3Xf> source (pointsData[pair.second], 3, numPoints[pair.second]);
+
+            const Eigen::DenseIndex step = (source.cols() + kMaxIcpPoints - 1) / kMaxIcpPoints;
+            const Eigen::Affine3f coarse (pair.mat);
+            Eigen::Matrix3Xf X (3, (source.cols() + step - 1) / step);
+            for (Eigen::DenseIndex i = 0; i < X.cols(); i++)
+                X.col(i) = coarse * source.col(i * step);
+
+            ICP::Parameters par;
+            par.f = ICP::TRIMMED;
+            par.p = 0.8;
+            par.max_icp = 50;
+            Eigen::Affine3f refinement;
+            if (normalsData && normalsData[pair.first]) {
+                const Eigen::Map<const Eigen::Matrix3Xf> N (normalsData[pair.first], 3, numPoints[pair.first]);
+                refinement = ICP::point_to_plane(X, Y, N, par);
+            }
+            else {
+                refinement = ICP::point_to_point(X, Y, par);
+            }
+            pair.mat = (refinement * coarse).matrix();
+        }); };
+        refine.dependsOn(match);
+    }
+
+    {
+        std::unique_ptr<Utils::Scheduler> scheduler;
+        if (numThreads > 0)
+            scheduler.reset(new Utils::Scheduler(unsigned(numThreads) - 1));
+        Utils::TaskGroup jobs (scheduler ? *scheduler : Utils::Scheduler::instance());
+        for (GraphJob& job : prepareJobs)
+            submitJob(jobs, &job);
+        jobs.wait();
+    }
+
+    if (error != 0)
+        return error;
+
+    for (size_t p = 0; p < pairs.size(); p++) {
+        outputPairs[2*p]   = pairs[p].first;
+        outputPairs[2*p+1] = pairs[p].second;
+        for (int i = 0; i < 4; i++)
+            for (int j = 0; j < 4; j++)
+                outputMats[16*p + i*4 + j] = pairs[p].mat(i, j);
+        outputScores[p] = pairs[p].score;
+    }
+    return int32_t(pairs.size());
+}
+
+int32_t OpenGRMain(const float *set1Data, int32_t set1NumPoints, float *set2Data, int32_t set2NumPoints, float *outputMat, float *outputScore) {
+  for (int i = 0; i < set1NumPoints && i < 10; i++) {
+      NSLog(@"IN1: %f %f %f\n", set1Data[i*3], set1Data[i*3+1], set1Data[i*3+2]);
   }
-  catch (...) {
-      logger.Log<Utils::ErrorReport>( "[Unknown Error]: Aborting with code -4 ..." );
-      return -4;
+  for (int i = 0; i < set2NumPoints && i < 10; i++) {
+      NSLog(@"IN2: %f %f %f\n", set2Data[i*3], set2Data[i*3+1], set2Data[i*3+2]);
   }
 
+  OpenGRRegistration *reg = OpenGRRegistration_Create(set1Data, set1NumPoints,
+                                                      set2Data, set2NumPoints, 0);
+  int32_t state;
+  while ((state = OpenGRRegistration_Step(reg, 1000)) == RegistrationRunning) {}
 
-    // Copy output matrix
-    for (int i = 0; i < 4; i++) {
-        for (int j = 0; j < 4; j++) {
-            outputMat[i*4+j] = mat(i,j);
-        }
+  float score = 0;
+  OpenGRRegistration_GetBest(reg, outputMat, &score, nullptr);
+  OpenGRRegistration_Destroy(reg);
+  if (state < 0)
+    return state;
+
+  // Transform set2 in place
+  for (int i = 0; i < set2NumPoints; i++) {
+    const float x = set2Data[i*3], y = set2Data[i*3+1], z = set2Data[i*3+2];
+    for (int r = 0; r < 3; r++) {
+      set2Data[i*3+r] = outputMat[r*4] * x + outputMat[r*4+1] * y + outputMat[r*4+2] * z + outputMat[r*4+3];
     }
+  }
 
-    Utils::TransformPointCloud(set2, mat);
-    // Copy set2 back to set2data
+  *outputScore = score;
+
+  return 0;
+}
+
+/// Same as OpenGRMain, for points interleaved with their normals and/or
+/// colors (\see OpenGRRegistration_CreateInterleaved), which prune the
+/// candidate pairs with the given thresholds (\see
+/// OpenGRRegistration_SetPairFilter). The positions and normals of set2 are
+/// transformed in place.
+int32_t OpenGRMainInterleaved(const float *set1Data, int32_t set1NumPoints,
+                              float *set2Data, int32_t set2NumPoints,
+                              int32_t attributes, float maxNormalDegrees, float maxColorDistance,
+                              float *outputMat, float *outputScore)
+{
+    OpenGRRegistration *reg = OpenGRRegistration_CreateInterleaved(set1Data, set1NumPoints,
+                                                                   set2Data, set2NumPoints,
+                                                                   attributes, 0);
+    OpenGRRegistration_SetPairFilter(reg, maxNormalDegrees, maxColorDistance);
+    int32_t state;
+    while ((state = OpenGRRegistration_Step(reg, 1000)) == RegistrationRunning) {}
+
+    float score = 0;
+    OpenGRRegistration_GetBest(reg, outputMat, &score, nullptr);
+    OpenGRRegistration_Destroy(reg);
+    if (state < 0)
+        return state;
+
+    const Eigen::Map<const Eigen::Matrix<float, 4, 4, Eigen::RowMajor>> mat (outputMat);
+    const Eigen::Affine3f transformation (mat);
+    const int stride = pointStride(attributes);
     for (int i = 0; i < set2NumPoints; i++) {
-        set2Data[i*3] = set2[i].x();
-        set2Data[i*3+1] = set2[i].y();
-        set2Data[i*3+2] = set2[i].z();
+        Eigen::Map<Eigen::Vector3f> p (set2Data + i*stride);
+        p = transformation * p;
+        if (attributes & PointNormals) {
+            Eigen::Map<Eigen::Vector3f> n (set2Data + i*stride + 3);
+            n = transformation.linear() * n;
+        }
     }
 
-    *outputScore = score;
+    if (outputScore)
+        *outputScore = score;
+    return 0;
+}
 
-  return 0;
+/// Starts an online registration session, registering the frames in the
+/// background as they are added.
+/// @param voxelSize Size of the voxels of the model: a keyframe only adds
+/// the points falling in empty voxels. Must be positive.
+/// @param keyframeDistance, keyframeDegrees A frame is added to the model
+/// if its refined camera position is farther than keyframeDistance or its
+/// orientation is rotated by more than keyframeDegrees from every keyframe.
+/// @param capacity Number of refined poses that can wait to be polled, the
+/// session pauses when it is reached.
+/// @return the session, or null if the parameters are invalid.
+OpenGRSession *OpenGRSession_Create(float voxelSize, float keyframeDistance, float keyframeDegrees, int32_t capacity)
+{
+    if (! (voxelSize > 0) || capacity <= 0)
+        return nullptr;
+    OpenGRSession *session = new OpenGRSession(voxelSize, keyframeDistance, keyframeDegrees, size_t(capacity));
+    session->worker = std::thread(runSession, session);
+    return session;
 }
 
+/// Queues a frame for registration, copying its data, and returns immediately.
+/// Frames are registered in the order they are added.
+/// @param frame Identifier of the frame, given back with its refined pose.
+/// @param pointsData Points of the frame, in world space according to pose.
+/// @param normalsData Normals of the frame in world space, or null. Either
+/// all the frames of a session have normals, or none.
+/// @param pose Camera to world pose of the frame, row major.
+/// @return 0, or a negative error code.
+int32_t OpenGRSession_AddFrame(OpenGRSession *session, int32_t frame,
+                               const float *pointsData, const float *normalsData, int32_t numPoints,
+                               const float *pose)
+{
+    if (numPoints < 0 || (numPoints > 0 && ! pointsData) || ! pose)
+        return -1;
+    if (session->error != 0)
+        return session->error;
 
+    OpenGRSession::Frame f;
+    f.id = frame;
+    f.points = Eigen::Map<const Eigen::Matrix3Xf>(pointsData, 3, numPoints);
+    if (normalsData)
+        f.normals = Eigen::Map<const Eigen::Matrix3Xf>(normalsData, 3, numPoints);
+    f.pose = Eigen::Map<const Eigen::Matrix<float, 4, 4, Eigen::RowMajor>>(pose);
 
+    {
+        std::lock_guard<std::mutex> lock (session->mutex);
+        const int32_t withNormals = normalsData ? 1 : 0;
+        if (session->withNormals < 0)
+            session->withNormals = withNormals;
+        else if (session->withNormals != withNormals)
+            return -1;
+        session->pending.push_back(std::move(f));
+    }
+    session->wake.notify_one();
+    return 0;
+}
 
+/// Pops the next refined pose, in the order the frames were added. Never
+/// blocks, and must be called from a single thread at a time.
+/// @param outputMat World space correction (row major) to apply after the
+/// pose of the frame, as for the output of OpenGRMain.
+/// @param outputScore Fraction of the points of the frame overlapping the
+/// model, 0 for the first frame, -1 if the registration of the frame failed
+/// (outputMat is then the identity).
+/// @param outputKeyframe Set to 1 if the frame was added to the model.
+/// @return 1 if a pose was popped, 0 if none is ready.
+int32_t OpenGRSession_PollPose(OpenGRSession *session, int32_t *outputFrame,
+                               float *outputMat, float *outputScore, int32_t *outputKeyframe)
+{
+    SessionPose pose;
+    if (! session->poses.tryPop(pose))
+        return 0;
+    if (outputFrame) *outputFrame = pose.frame;
+    if (outputMat) std::copy(pose.mat, pose.mat + 16, outputMat);
+    if (outputScore) *outputScore = pose.score;
+    if (outputKeyframe) *outputKeyframe = pose.keyframe;
+    return 1;
+}
 
+/// Waits until all the added frames are registered, for at most the given
+/// number of milliseconds. The poses must be polled meanwhile if more than
+/// the capacity of the session are pending.
+/// @return the number of frames still to register, or a negative error code.
+int32_t OpenGRSession_Wait(OpenGRSession *session, int32_t maxMilliseconds)
+{
+    std::unique_lock<std::mutex> lock (session->mutex);
+    session->idle.wait_for(lock, std::chrono::milliseconds((std::max)(0, maxMilliseconds)),
+                           [session]{ return session->pending.empty() && ! session->busy; });
+    if (session->error != 0)
+        return session->error;
+    return int32_t(session->pending.size()) + (session->busy ? 1 : 0);
+}
+
+/// Stops the session, dropping the frames not registered yet.
+void OpenGRSession_Destroy(OpenGRSession *session)
+{
+    {
+        std::lock_guard<std::mutex> lock (session->mutex);
+        session->stopping = true;
+    }
+    session->wake.notify_one();
+    session->worker.join();
+    delete session;
 }
 
+}
@@ -7,7 +7,8 @@
 ///   2) This code requires EIGEN and NANOFLANN.
 ///   3) If OPENMP is activated some part of the code will be parallelized.
 ///   4) This code is for now designed for 3D registration
-///   5) Two main input types are Eigen::Matrix3Xd or Eigen::Map<Eigen::Matrix3Xd>
+///   5) Two main input types are Eigen::Matrix3Xd or Eigen::Map<Eigen::Matrix3Xd>,
+///      RigidMotionEstimator and ICP also take float matrices and maps
 ///////////////////////////////////////////////////////////////////////////////
 ///   namespace nanoflann: NANOFLANN KD-tree adaptor for EIGEN
 ///   namespace RigidMotionEstimator: functions to compute the rigid motion
@@ -17,8 +18,16 @@
 #ifndef ICP_H
 #define ICP_H
 #include <nanoflann.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
+#include <vector>
 #include <Eigen/Dense>
 #include <iostream>
+#include "gr/accelerators/depthImageIndex.h"
+#include "gr/utils/scheduler.h"
 ///////////////////////////////////////////////////////////////////////////////
 namespace nanoflann {
     /// KD-tree adaptor for working with data directly stored in an Eigen Matrix, without duplicating the data storage.
@@ -77,13 +86,17 @@ namespace RigidMotionEstimator {
     /// @param Target (one 3D point per column)
     /// @param Confidence weights
     template <typename Derived1, typename Derived2, typename Derived3>
-    Eigen::Affine3d point_to_point(Eigen::MatrixBase<Derived1>& X,
-                                   Eigen::MatrixBase<Derived2>& Y,
-                                   const Eigen::MatrixBase<Derived3>& w) {
+    Eigen::Transform<typename Derived1::Scalar, 3, Eigen::Affine>
+    point_to_point(Eigen::MatrixBase<Derived1>& X,
+                   Eigen::MatrixBase<Derived2>& Y,
+                   const Eigen::MatrixBase<Derived3>& w) {
+        typedef typename Derived1::Scalar Scalar;
+        typedef Eigen::Matrix<Scalar, 3, 1> Vector3;
+        typedef Eigen::Matrix<Scalar, 3, 3> Matrix33;
         /// Normalize weight vector
-        Eigen::VectorXd w_normalized = w/w.sum();
+        Eigen::Matrix<Scalar, Eigen::Dynamic, 1> w_normalized = w.template cast<Scalar>()/Scalar(w.sum());
         /// De-mean
-        Eigen::Vector3d X_mean, Y_mean;
+        Vector3 X_mean, Y_mean;
         for(int i=0; i<3; ++i) {
             X_mean(i) = (X.row(i).array()*w_normalized.transpose().array()).sum();
             Y_mean(i) = (Y.row(i).array()*w_normalized.transpose().array()).sum();
@@ -91,96 +104,139 @@ namespace RigidMotionEstimator {
         X.colwise() -= X_mean;
         Y.colwise() -= Y_mean;
         /// Compute transformation
-        Eigen::Affine3d transformation;
-        Eigen::Matrix3d sigma = X * w_normalized.asDiagonal() * Y.transpose();
-        Eigen::JacobiSVD<Eigen::Matrix3d> svd(sigma, Eigen::ComputeFullU | Eigen::ComputeFullV);
+        Eigen::Transform<Scalar, 3, Eigen::Affine> transformation;
+        Matrix33 sigma = X * w_normalized.asDiagonal() * Y.transpose();
+        Eigen::JacobiSVD<Matrix33> svd(sigma, Eigen::ComputeFullU | Eigen::ComputeFullV);
         if(svd.matrixU().determinant()*svd.matrixV().determinant() < 0.0) {
-            Eigen::Vector3d S = Eigen::Vector3d::Ones(); S(2) = -1.0;
+            Vector3 S = Vector3::Ones(); S(2) = -1.0;
             transformation.linear().noalias() = svd.matrixV()*S.asDiagonal()*svd.matrixU().transpose();
         } else {
             transformation.linear().noalias() = svd.matrixV()*svd.matrixU().transpose();
         }
         transformation.translation().noalias() = Y_mean - transformation.linear()*X_mean;
-        /// Apply transformation
-        X = transformation*X;
         /// Re-apply mean
         X.colwise() += X_mean;
         Y.colwise() += Y_mean;
+        /// Apply transformation
+        X = transformation*X;
         /// Return transformation
         return transformation;
     }
     /// @param Source (one 3D point per column)
     /// @param Target (one 3D point per column)
     template <typename Derived1, typename Derived2>
-    inline Eigen::Affine3d point_to_point(Eigen::MatrixBase<Derived1>& X,
-                                          Eigen::MatrixBase<Derived2>& Y) {
-        return point_to_point(X, Y, Eigen::VectorXd::Ones(X.cols()));
+    inline Eigen::Transform<typename Derived1::Scalar, 3, Eigen::Affine>
+    point_to_point(Eigen::MatrixBase<Derived1>& X,
+                   Eigen::MatrixBase<Derived2>& Y) {
+        return point_to_point(X, Y, Eigen::Matrix<typename Derived1::Scalar, Eigen::Dynamic, 1>::Ones(X.cols()));
+    }
+    /// Normal equations of the linearized point to plane problem, in double.
+    /// The unknowns are the rotation angles around x, y, z and the translation.
+    struct PlaneEquations {
+        Eigen::Matrix<double, 6, 6, Eigen::DontAlign> LHS;
+        Eigen::Matrix<double, 6, 1, Eigen::DontAlign> RHS;
+        double sw;
+        static inline PlaneEquations Zero() {
+            PlaneEquations e;
+            e.LHS.setZero();
+            e.RHS.setZero();
+            e.sw = 0.0;
+            return e;
+        }
+        inline PlaneEquations operator+(const PlaneEquations& other) const {
+            PlaneEquations e;
+            e.LHS = LHS + other.LHS;
+            e.RHS = RHS + other.RHS;
+            e.sw = sw + other.sw;
+            return e;
+        }
+        /// Solves the equations, returns the rigid motion
+        inline Eigen::Affine3d motion() const {
+            const Eigen::Matrix<double, 6, 6> lhs = LHS;
+            const Eigen::Matrix<double, 6, 1> rhs = RHS;
+            Eigen::LDLT<Eigen::Matrix<double, 6, 6> > ldlt(lhs);
+            const Eigen::Matrix<double, 6, 1> dx = ldlt.solve(rhs);
+            Eigen::Affine3d transformation;
+            transformation = Eigen::AngleAxisd(dx(0), Eigen::Vector3d::UnitX()) *
+                             Eigen::AngleAxisd(dx(1), Eigen::Vector3d::UnitY()) *
+                             Eigen::AngleAxisd(dx(2), Eigen::Vector3d::UnitZ());
+            transformation.translation() = dx.tail<3>();
+            return transformation;
+        }
+    };
+    /// Accumulates the normal equations of the pairs [0, n) by a parallel
+    /// reduction, in a single pass over the pairs.
+    /// @param pair(i, x, nq, d) sets the point x, the normal nq and the signed
+    ///        distance d to the plane of the pair i, and returns its weight
+    /// Each chunk gathers the Jacobians [x^nq, nq] of blocks of pairs, so that
+    /// the rank updates are a vectorized 6 x Block x 6 product.
+    template <typename PairFunctor>
+    inline PlaneEquations plane_equations(Eigen::DenseIndex n, const PairFunctor& pair) {
+        enum { Block = 16 };
+        return gr::Utils::parallel_reduce(Eigen::DenseIndex(0), n, PlaneEquations::Zero(),
+            [&pair](Eigen::DenseIndex first, Eigen::DenseIndex last, PlaneEquations e) {
+                Eigen::Matrix<double, 6, Block> J, Jw;
+                Eigen::Matrix<double, Block, 1> d;
+                Eigen::Matrix<double, 6, 6> LHS = e.LHS;
+                Eigen::Matrix<double, 6, 1> RHS = e.RHS;
+                Eigen::Vector3d x, nq;
+                int k = 0;
+                for(Eigen::DenseIndex i=first; i<last; ++i) {
+                    const double w = pair(i, x, nq, d(k));
+                    if(w == 0.0) continue;
+                    J.col(k).template head<3>() = x.cross(nq);
+                    J.col(k).template tail<3>() = nq;
+                    Jw.col(k) = w*J.col(k);
+                    e.sw += w;
+                    if(++k == Block) {
+                        LHS.noalias() += Jw*J.transpose();
+                        RHS.noalias() += Jw*d;
+                        k = 0;
+                    }
+                }
+                if(k > 0) {
+                    LHS.noalias() += Jw.leftCols(k)*J.leftCols(k).transpose();
+                    RHS.noalias() += Jw.leftCols(k)*d.head(k);
+                }
+                e.LHS = LHS;
+                e.RHS = RHS;
+                return e;
+            },
+            [](const PlaneEquations& a, const PlaneEquations& b) { return a + b; },
+            Eigen::DenseIndex(1024));
     }
     /// @param Source (one 3D point per column)
     /// @param Target (one 3D point per column)
     /// @param Target normals (one 3D normal per column)
     /// @param Confidence weights
     /// @param Right hand side
+    /// The linear system is accumulated and solved in double for any Scalar
     template <typename Derived1, typename Derived2, typename Derived3, typename Derived4, typename Derived5>
-    Eigen::Affine3d point_to_plane(Eigen::MatrixBase<Derived1>& X,
-                                   Eigen::MatrixBase<Derived2>& Y,
-                                   Eigen::MatrixBase<Derived3>& N,
-                                   const Eigen::MatrixBase<Derived4>& w,
-                                   const Eigen::MatrixBase<Derived5>& u) {
-        typedef Eigen::Matrix<double, 6, 6> Matrix66;
-        typedef Eigen::Matrix<double, 6, 1> Vector6;
-        typedef Eigen::Block<Matrix66, 3, 3> Block33;
-        /// Normalize weight vector
-        Eigen::VectorXd w_normalized = w/w.sum();
-        /// De-mean
-        Eigen::Vector3d X_mean;
-        for(int i=0; i<3; ++i)
-            X_mean(i) = (X.row(i).array()*w_normalized.transpose().array()).sum();
-        X.colwise() -= X_mean;
-        Y.colwise() -= X_mean;
-        /// Prepare LHS and RHS
-        Matrix66 LHS = Matrix66::Zero();
-        Vector6 RHS = Vector6::Zero();
-        Block33 TL = LHS.topLeftCorner<3,3>();
-        Block33 TR = LHS.topRightCorner<3,3>();
-        Block33 BR = LHS.bottomRightCorner<3,3>();
-        Eigen::MatrixXd C = Eigen::MatrixXd::Zero(3,X.cols());
-        #pragma omp parallel
-        {
-            #pragma omp for
-            for(int i=0; i<X.cols(); i++) {
-                C.col(i) = X.col(i).cross(N.col(i));
-            }
-            #pragma omp sections nowait
-            {
-                #pragma omp section
-                for(int i=0; i<X.cols(); i++) TL.selfadjointView<Eigen::Upper>().rankUpdate(C.col(i), w(i));
-                #pragma omp section
-                for(int i=0; i<X.cols(); i++) TR += (C.col(i)*N.col(i).transpose())*w(i);
-                #pragma omp section
-                for(int i=0; i<X.cols(); i++) BR.selfadjointView<Eigen::Upper>().rankUpdate(N.col(i), w(i));
-                #pragma omp section
-                for(int i=0; i<C.cols(); i++) {
-                    double dist_to_plane = -((X.col(i) - Y.col(i)).dot(N.col(i)) - u(i))*w(i);
-                    RHS.head<3>() += C.col(i)*dist_to_plane;
-                    RHS.tail<3>() += N.col(i)*dist_to_plane;
-                }
-            }
-        }
-        LHS = LHS.selfadjointView<Eigen::Upper>();
+    Eigen::Transform<typename Derived1::Scalar, 3, Eigen::Affine>
+    point_to_plane(Eigen::MatrixBase<Derived1>& X,
+                   Eigen::MatrixBase<Derived2>& Y,
+                   Eigen::MatrixBase<Derived3>& N,
+                   const Eigen::MatrixBase<Derived4>& w,
+                   const Eigen::MatrixBase<Derived5>& u) {
+        typedef typename Derived1::Scalar Scalar;
+        /// Weighted mean
+        Eigen::Matrix<Scalar, 3, 1> X_mean = (X * w.template cast<Scalar>()) / Scalar(w.sum());
+        const Eigen::Vector3d mean = X_mean.template cast<double>();
+        /// Normal equations, around the mean
+        const PlaneEquations equations = plane_equations(X.cols(),
+            [&](Eigen::DenseIndex i, Eigen::Vector3d& x, Eigen::Vector3d& nq, double& d) {
+                x = X.col(i).template cast<double>() - mean;
+                nq = N.col(i).template cast<double>();
+                d = -(double((X.col(i) - Y.col(i)).dot(N.col(i))) - double(u(i)));
+                return double(w(i));
+            });
         /// Compute transformation
-        Eigen::Affine3d transformation;
-        Eigen::LDLT<Matrix66> ldlt(LHS);
-        RHS = ldlt.solve(RHS);
-        transformation  = Eigen::AngleAxisd(RHS(0), Eigen::Vector3d::UnitX()) *
-                          Eigen::AngleAxisd(RHS(1), Eigen::Vector3d::UnitY()) *
-                          Eigen::AngleAxisd(RHS(2), Eigen::Vector3d::UnitZ());
-        transformation.translation() = RHS.tail<3>();
+        const Eigen::Transform<Scalar, 3, Eigen::Affine> transformation =
+                (Eigen::Translation3d(mean) * equations.motion() * Eigen::Translation3d(-mean)).template cast<Scalar>();
         /// Apply transformation
-        X = transformation*X;
-        /// Re-apply mean
-        X.colwise() += X_mean;
-        Y.colwise() += X_mean;
+        gr::Utils::parallel_for(0, int(X.cols()), [&](int i) {
+            X.col(i) = transformation * X.col(i);
+        }, 1024);
         /// Return transformation
         return transformation;
     }
@@ -189,12 +245,79 @@ namespace RigidMotionEstimator {
     /// @param Target normals (one 3D normal per column)
     /// @param Confidence weights
     template <typename Derived1, typename Derived2, typename Derived3, typename Derived4>
-    inline Eigen::Affine3d point_to_plane(Eigen::MatrixBase<Derived1>& X,
-                                          Eigen::MatrixBase<Derived2>& Yp,
-                                          Eigen::MatrixBase<Derived3>& Yn,
-                                          const Eigen::MatrixBase<Derived4>& w) {
-        return point_to_plane(X, Yp, Yn, w, Eigen::VectorXd::Zero(X.cols()));
+    inline Eigen::Transform<typename Derived1::Scalar, 3, Eigen::Affine>
+    point_to_plane(Eigen::MatrixBase<Derived1>& X,
+                   Eigen::MatrixBase<Derived2>& Yp,
+                   Eigen::MatrixBase<Derived3>& Yn,
+                   const Eigen::MatrixBase<Derived4>& w) {
+        return point_to_plane(X, Yp, Yn, w, Eigen::Matrix<typename Derived1::Scalar, Eigen::Dynamic, 1>::Zero(X.cols()));
     }
+    /// Anderson acceleration of the fixed point iteration T <- G(T) of ICP,
+    /// on the poses of the source relative to its initial position.
+    /// The poses are parametrized by the Lie algebra of SO(3) x R^3 around
+    /// the initial centroid of the source: rotation vector and translation of
+    /// the centroid. The next pose extrapolates the last plain iterates
+    /// G(T), from a history of their differences.
+    template <typename Scalar>
+    class AndersonAcceleration {
+    public:
+        typedef Eigen::Transform<Scalar, 3, Eigen::Affine> AffineTransform;
+        typedef Eigen::Matrix<double, 6, 1> Vector6;
+        /// @param Size of the history
+        /// @param Initial centroid of the source
+        AndersonAcceleration(int m, const Eigen::Matrix<Scalar, 3, 1>& center) :
+            m(m), c(center.template cast<double>()), dG(6, m), dF(6, m) { reset(); }
+        /// Forgets the history
+        inline void reset() { count = 0; next = 0; }
+        /// Parameters of a pose
+        inline Vector6 log(const AffineTransform& T) const {
+            const Eigen::Matrix3d R = T.linear().template cast<double>();
+            const Eigen::AngleAxisd aa(R);
+            Vector6 x;
+            x.head<3>() = aa.angle()*aa.axis();
+            x.tail<3>() = R*c + T.translation().template cast<double>() - c;
+            return x;
+        }
+        /// Pose of parameters x
+        inline AffineTransform exp(const Vector6& x) const {
+            const double angle = x.head<3>().norm();
+            const Eigen::Matrix3d R = angle > 0.0 ?
+                Eigen::AngleAxisd(angle, x.head<3>()/angle).toRotationMatrix() :
+                Eigen::Matrix3d::Identity();
+            Eigen::Affine3d T = Eigen::Affine3d::Identity();
+            T.linear() = R;
+            T.translation() = x.tail<3>() + c - R*c;
+            return T.template cast<Scalar>();
+        }
+        /// Next pose, from the pose T and its image G(T).
+        /// @return Whether the pose is extrapolated, or G(T) after a reset
+        inline bool compute(const AffineTransform& T, const AffineTransform& GT, AffineTransform& result) {
+            const Vector6 g = log(GT);
+            const Vector6 f = g - log(T);
+            if(count++ == 0) {
+                prevG = g;
+                prevF = f;
+                result = GT;
+                return false;
+            }
+            dG.col(next) = g - prevG;
+            dF.col(next) = f - prevF;
+            next = (next + 1) % m;
+            prevG = g;
+            prevF = f;
+            const int k = (std::min)(count - 1, m);
+            const Eigen::VectorXd theta = dF.leftCols(k).jacobiSvd(Eigen::ComputeThinU | Eigen::ComputeThinV).solve(f);
+            result = exp(g - dG.leftCols(k)*theta);
+            return true;
+        }
+    private:
+        int m, count, next;
+        Eigen::Vector3d c;
+        Eigen::Matrix<double, 6, Eigen::Dynamic> dG, dF;
+        Vector6 prevG, prevF;
+    public:
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
 }
 ///////////////////////////////////////////////////////////////////////////////
 /// ICP implementation using ADMM/ALM/Penalty method
@@ -209,6 +332,7 @@ namespace SICP {
         int max_outer = 100;      /// max outer iteration
         int max_inner = 1;        /// max inner iteration. If max_inner=1 then ADMM else ALM
         double stop = 1e-5;       /// stopping criteria
+        int anderson = 0;         /// history of the Anderson acceleration, 0 to disable
         bool print_icpn = false;  /// (debug) print ICP iteration 
     };
     /// Shrinkage operator (Automatic loop unrolling using template)
@@ -223,26 +347,24 @@ namespace SICP {
     inline void shrink(Eigen::Matrix3Xd& Q, double mu, double p) {
         double Ba = std::pow((2.0/mu)*(1.0-p), 1.0/(2.0-p));
         double ha = Ba + (p/mu)*std::pow(Ba, p-1.0);
-        #pragma omp parallel for
-        for(int i=0; i<Q.cols(); ++i) {
+        gr::Utils::parallel_for(0, int(Q.cols()), [&](int i) {
             double n = Q.col(i).norm();
             double w = 0.0;
             if(n > ha) w = shrinkage<I>(mu, n, p, (Ba/n + 1.0)/2.0);
             Q.col(i) *= w;
-        }
+        }, 1024);
     }
     /// 1D Shrinkage for point-to-plane
     template<unsigned int I>
     inline void shrink(Eigen::VectorXd& y, double mu, double p) {
         double Ba = std::pow((2.0/mu)*(1.0-p), 1.0/(2.0-p));
         double ha = Ba + (p/mu)*std::pow(Ba, p-1.0);
-        #pragma omp parallel for
-        for(int i=0; i<y.rows(); ++i) {
+        gr::Utils::parallel_for(0, int(y.rows()), [&](int i) {
             double n = std::abs(y(i));
             double s = 0.0;
             if(n > ha) s = shrinkage<I>(mu, n, p, (Ba/n + 1.0)/2.0);
             y(i) *= s;
-        }
+        }, 1024);
     }
     /// Sparse ICP with point to point
     /// @param Source (one 3D point per column)
@@ -260,14 +382,47 @@ namespace SICP {
         Eigen::Matrix3Xd C = Eigen::Matrix3Xd::Zero(3, X.cols());
         Eigen::Matrix3Xd Xo1 = X;
         Eigen::Matrix3Xd Xo2 = X;
+        /// Motion of the source, and its Anderson acceleration
+        typedef Eigen::Transform<typename Derived1::Scalar, 3, Eigen::Affine> AffineTransform;
+        AffineTransform transformation = AffineTransform::Identity();
+        AffineTransform fallback = AffineTransform::Identity();
+        RigidMotionEstimator::AndersonAcceleration<typename Derived1::Scalar> anderson(
+            (std::max)(par.anderson, 1), Eigen::Matrix<typename Derived1::Scalar, 3, 1>(X.rowwise().mean()));
+        double accepted = std::numeric_limits<double>::infinity();
+        bool extrapolated = false;
+        const auto move = [&](const AffineTransform& motion) {
+            gr::Utils::parallel_for(0, int(X.cols()), [&](int i) {
+                X.col(i) = motion * X.col(i);
+            }, 1024);
+            transformation = motion * transformation;
+            Xo1 = X;
+            Xo2 = X;
+        };
+        /// Find closest point
+        const auto associate = [&]() {
+            gr::Utils::parallel_for(0, int(X.cols()), [&](int i) {
+                Q.col(i) = Y.col(kdtree.closest(X.col(i).data()));
+            }, 256);
+        };
+        const auto energy = [&]() {
+            return (X-Q).colwise().norm().array().pow(par.p).sum();
+        };
         /// ICP
         for(int icp=0; icp<par.max_icp; ++icp) {
             if(par.print_icpn) std::cout << "Iteration #" << icp << "/" << par.max_icp << std::endl;
-            /// Find closest point
-            #pragma omp parallel for
-            for(int i=0; i<X.cols(); ++i) {
-                Q.col(i) = Y.col(kdtree.closest(X.col(i).data()));
+            associate();
+            if(par.anderson > 0) {
+                double e = energy();
+                if(extrapolated && !(e < accepted)) {
+                    /// The energy increased, back to the plain iterate
+                    move(fallback * transformation.inverse(Eigen::Isometry));
+                    anderson.reset();
+                    associate();
+                    e = energy();
+                }
+                accepted = e;
             }
+            const AffineTransform icpStart = transformation;
             /// Computer rotation and translation
             double mu = par.mu;
             for(int outer=0; outer<par.max_outer; ++outer) {
@@ -278,7 +433,7 @@ namespace SICP {
                     shrink<3>(Z, mu, par.p);
                     /// Rotation and translation update
                     Eigen::Matrix3Xd U = Q+Z-C/mu;
-                    RigidMotionEstimator::point_to_point(X, U);
+                    transformation = RigidMotionEstimator::point_to_point(X, U) * transformation;
                     /// Stopping criteria
                     dual = (X-Xo1).colwise().norm().maxCoeff();
                     Xo1 = X;
@@ -297,6 +452,13 @@ namespace SICP {
             double stop = (X-Xo2).colwise().norm().maxCoeff();
             Xo2 = X;
             if(stop < par.stop) break;
+            /// Accelerated pose
+            if(par.anderson > 0) {
+                fallback = transformation;
+                AffineTransform next;
+                extrapolated = anderson.compute(icpStart, transformation, next);
+                move(next * transformation.inverse(Eigen::Isometry));
+            }
         }
     }
     /// Sparse ICP with point to plane
@@ -318,17 +480,49 @@ namespace SICP {
         Eigen::VectorXd C = Eigen::VectorXd::Zero(X.cols());
         Eigen::Matrix3Xd Xo1 = X;
         Eigen::Matrix3Xd Xo2 = X;
-        /// ICP
-        for(int icp=0; icp<par.max_icp; ++icp) {
-            if(par.print_icpn) std::cout << "Iteration #" << icp << "/" << par.max_icp << std::endl;
-            
-            /// Find closest point
-            #pragma omp parallel for
-            for(int i=0; i<X.cols(); ++i) {
+        /// Motion of the source, and its Anderson acceleration
+        typedef Eigen::Transform<typename Derived1::Scalar, 3, Eigen::Affine> AffineTransform;
+        AffineTransform transformation = AffineTransform::Identity();
+        AffineTransform fallback = AffineTransform::Identity();
+        RigidMotionEstimator::AndersonAcceleration<typename Derived1::Scalar> anderson(
+            (std::max)(par.anderson, 1), Eigen::Matrix<typename Derived1::Scalar, 3, 1>(X.rowwise().mean()));
+        double accepted = std::numeric_limits<double>::infinity();
+        bool extrapolated = false;
+        const auto move = [&](const AffineTransform& motion) {
+            gr::Utils::parallel_for(0, int(X.cols()), [&](int i) {
+                X.col(i) = motion * X.col(i);
+            }, 1024);
+            transformation = motion * transformation;
+            Xo1 = X;
+            Xo2 = X;
+        };
+        /// Find closest point
+        const auto associate = [&]() {
+            gr::Utils::parallel_for(0, int(X.cols()), [&](int i) {
                 int id = kdtree.closest(X.col(i).data());
                 Qp.col(i) = Y.col(id);
                 Qn.col(i) = N.col(id);
+            }, 256);
+        };
+        const auto energy = [&]() {
+            return (Qn.array()*(X-Qp).array()).colwise().sum().abs().pow(par.p).sum();
+        };
+        /// ICP
+        for(int icp=0; icp<par.max_icp; ++icp) {
+            if(par.print_icpn) std::cout << "Iteration #" << icp << "/" << par.max_icp << std::endl;
+            associate();
+            if(par.anderson > 0) {
+                double e = energy();
+                if(extrapolated && !(e < accepted)) {
+                    /// The energy increased, back to the plain iterate
+                    move(fallback * transformation.inverse(Eigen::Isometry));
+                    anderson.reset();
+                    associate();
+                    e = energy();
+                }
+                accepted = e;
             }
+            const AffineTransform icpStart = transformation;
             /// Computer rotation and translation
             double mu = par.mu;
             for(int outer=0; outer<par.max_outer; ++outer) {
@@ -339,14 +533,14 @@ namespace SICP {
                     shrink<3>(Z, mu, par.p);
                     /// Rotation and translation update
                     Eigen::VectorXd U = Z-C/mu;
-                    RigidMotionEstimator::point_to_plane(X, Qp, Qn, Eigen::VectorXd::Ones(X.cols()), U);
+                    transformation = RigidMotionEstimator::point_to_plane(X, Qp, Qn, Eigen::VectorXd::Ones(X.cols()), U) * transformation;
                     /// Stopping criteria
                     dual = (X-Xo1).colwise().norm().maxCoeff();
                     Xo1 = X;
                     if(dual < par.stop) break;
                 }
                 /// C update (lagrange multipliers)
-                Eigen::VectorXf P = (Qn.array()*(X-Qp).array()).colwise().sum().transpose()-Z.array();
+                Eigen::VectorXd P = (Qn.array()*(X-Qp).array()).colwise().sum().transpose()-Z.array();
                 if(!par.use_penalty) C.noalias() += mu*P;
                 /// mu update (penalty)
                 if(mu < par.max_mu) mu *= par.alpha;
@@ -358,6 +552,13 @@ namespace SICP {
             double stop = (X-Xo2).colwise().norm().maxCoeff();
             Xo2 = X;
             if(stop < par.stop) break;
+            /// Accelerated pose
+            if(par.anderson > 0) {
+                fallback = transformation;
+                AffineTransform next;
+                extrapolated = anderson.compute(icpStart, transformation, next);
+                move(next * transformation.inverse(Eigen::Isometry));
+            }
         }
     }
 }
@@ -378,13 +579,17 @@ namespace ICP {
                        p(0.1),
                        max_icp(100),
                        max_outer(100),
-                       stop(1e-5) {}
+                       stop(1e-5),
+                       max_distance(std::numeric_limits<double>::infinity()),
+                       anderson(0) {}
         /// Parameters
         Function f;     /// robust function type
         double p;       /// paramter of the robust function
         int max_icp;    /// max ICP iteration
         int max_outer;  /// max outer iteration
         double stop;    /// stopping criteria
+        double max_distance; /// pairs farther apart are left unmatched
+        int anderson;   /// history of the Anderson acceleration, 0 to disable
     };
     /// Weight functions
     /// @param Residuals
@@ -455,89 +660,599 @@ namespace ICP {
             default: uniform_weight(r); break;
         }
     }
-    /// Reweighted ICP with point to point
-    /// @param Source (one 3D point per column)
+    /// Weight of a residual, for the functions other than TRIMMED
+    /// @param Function type
+    /// @param Residual
+    /// @param Parameter
+    inline double robust_weight(Function f, double r, double p) {
+        switch(f) {
+            case PNORM: return p/(std::pow(r,2-p) + 1e-8);
+            case TUKEY: return r > p ? 0.0 : std::pow((1.0 - std::pow(r/p,2.0)), 2.0);
+            case FAIR: return 1.0/(1.0 + r/p);
+            case LOGISTIC: return (p/r)*std::tanh(r/p);
+            default: return 1.0;
+        }
+    }
+    /// Energy of a residual, whose robust_weight is the IRLS weight
+    /// @param Function type
+    /// @param Residual
+    /// @param Parameter
+    inline double robust_energy(Function f, double r, double p) {
+        switch(f) {
+            case PNORM: return std::pow(r,p);
+            case TUKEY: return r > p ? p*p/6.0 : p*p/6.0*(1.0 - std::pow(1.0 - std::pow(r/p,2.0), 3.0));
+            case FAIR: return p*p*(r/p - std::log(1.0 + r/p));
+            case LOGISTIC: return p*p*std::log(std::cosh(r/p));
+            default: return 0.5*r*r;
+        }
+    }
+    /// Buffers of the reweighted ICP, reused across its iterations, and across
+    /// calls when given to point_to_point or point_to_plane. They only grow.
+    template <typename Scalar>
+    class IcpWorkspace {
+    public:
+        typedef Eigen::Matrix<Scalar, 3, Eigen::Dynamic> Matrix3X;
+        /// Makes room for n source points
+        inline void reserve(Eigen::DenseIndex n, bool withNormals) {
+            if (Q.cols() < n) {
+                Q.resize(3, n);
+                W.resize(n);
+                R.resize(n);
+            }
+            if (withNormals && Qn.cols() < n)
+                Qn.resize(3, n);
+        }
+        /// Closest target points, and their normals
+        Matrix3X Q, Qn;
+        /// Residuals, and scratch buffer of the TRIMMED weights
+        Eigen::VectorXd W, R;
+    };
+    /// Upper bound of the displacement, by a rigid motion, of the points
+    /// within radius of center: |R-I| = sqrt(3 - trace(R)) for a rotation
+    template <typename Scalar>
+    inline double max_displacement(const Eigen::Transform<Scalar, 3, Eigen::Affine>& motion,
+                                   const Eigen::Matrix<Scalar, 3, 1>& center,
+                                   Scalar radius) {
+        const double trace = double(motion.linear().trace());
+        return std::sqrt((std::max)(0.0, 3.0 - trace)) * double(radius) +
+               double((motion*center - center).norm());
+    }
+    /// Threshold of the TRIMMED weights, keeping the n*p smallest residuals.
+    /// The residuals are computed in parallel and stored in the workspace.
+    /// @param residual(i), residual of the pair i
+    template <typename Scalar, typename ResidualFunctor>
+    inline double trimmed_threshold(Eigen::DenseIndex n, const Parameters& par, IcpWorkspace<Scalar>& ws,
+                                    const ResidualFunctor& residual) {
+        gr::Utils::parallel_for(Eigen::DenseIndex(0), n, [&](Eigen::DenseIndex i) {
+            const double r = residual(i);
+            ws.W(i) = std::isfinite(r) ? r : std::numeric_limits<double>::infinity();
+        }, Eigen::DenseIndex(1024));
+        const Eigen::DenseIndex nbV = Eigen::DenseIndex(n*par.p);
+        if(nbV <= 0) return -1.0;
+        ws.R.head(n) = ws.W.head(n);
+        std::nth_element(ws.R.data(), ws.R.data() + nbV - 1, ws.R.data() + n);
+        return ws.R(nbV - 1);
+    }
+    /// Weight of the pair i. Except for TRIMMED weights, which need all the
+    /// residuals first (\see trimmed_threshold), the residual is computed on
+    /// the fly, so that residuals, weights and accumulation take one pass.
+    /// Unmatched points have an infinite residual, and a null weight.
+    template <typename Scalar, typename ResidualFunctor>
+    inline double pair_weight(Eigen::DenseIndex i, const Parameters& par, const IcpWorkspace<Scalar>& ws,
+                              double threshold, const ResidualFunctor& residual) {
+        if(par.f == TRIMMED)
+            return ws.W(i) <= threshold && std::isfinite(ws.W(i)) ? 1.0 : 0.0;
+        const double r = residual(i);
+        return std::isfinite(r) ? robust_weight(par.f, r, par.p) : 0.0;
+    }
+    /// Energy of the matched pairs, that the reweighted iterations decrease.
+    /// TRIMMED weights keep the n*p smallest squared residuals.
+    /// @param residual(i), residual of the pair i
+    template <typename Scalar, typename ResidualFunctor>
+    inline double energy(Eigen::DenseIndex n, const Parameters& par, IcpWorkspace<Scalar>& ws,
+                         const ResidualFunctor& residual) {
+        if(par.f == TRIMMED) {
+            const double threshold = trimmed_threshold(n, par, ws, residual);
+            double e = 0.0;
+            for(Eigen::DenseIndex i=0; i<n; ++i)
+                if(ws.W(i) <= threshold && std::isfinite(ws.W(i))) e += 0.5*ws.W(i)*ws.W(i);
+            return e;
+        }
+        return gr::Utils::parallel_reduce(Eigen::DenseIndex(0), n, 0.0,
+            [&](Eigen::DenseIndex first, Eigen::DenseIndex last, double e) {
+                for(Eigen::DenseIndex i=first; i<last; ++i) {
+                    const double r = residual(i);
+                    if(std::isfinite(r)) e += robust_energy(par.f, r, par.p);
+                }
+                return e;
+            },
+            [](double a, double b) { return a + b; },
+            Eigen::DenseIndex(1024));
+    }
+    /// Marks the pair i as unmatched, with an infinite residual
+    template <typename Scalar>
+    inline void unmatched(Eigen::DenseIndex i, IcpWorkspace<Scalar>& ws) {
+        ws.Q.col(i).setConstant(std::numeric_limits<Scalar>::infinity());
+        if(ws.Qn.cols() > i) ws.Qn.col(i).setZero();
+    }
+    /// Weighted moments of point to point pairs, in double
+    struct PointMoments {
+        double sw;
+        Eigen::Matrix<double, 3, 1, Eigen::DontAlign> sx, sq;
+        Eigen::Matrix<double, 3, 3, Eigen::DontAlign> sxq;
+        static inline PointMoments Zero() {
+            PointMoments m;
+            m.sw = 0.0;
+            m.sx.setZero();
+            m.sq.setZero();
+            m.sxq.setZero();
+            return m;
+        }
+        inline PointMoments operator+(const PointMoments& other) const {
+            PointMoments m;
+            m.sw = sw + other.sw;
+            m.sx = sx + other.sx;
+            m.sq = sq + other.sq;
+            m.sxq = sxq + other.sxq;
+            return m;
+        }
+    };
+    /// Reweighted ICP with point to point, against an index of the target
+    /// @param Source (one 3D point per column), moved in place
+    /// @param Index of the target: index.closest(p) is the column of the
+    ///        target point closest to p, e.g. a gr::KdForest grown with the
+    ///        target, or a negative value when p has no correspondence, e.g.
+    ///        out of the view of a gr::DepthImageIndex
     /// @param Target (one 3D point per column)
     /// @param Parameters
-    void point_to_point(Eigen::Matrix3Xd& X,
-                        Eigen::Matrix3Xd& Y,
-                        Parameters par = Parameters()) {
-        /// Build kd-tree
-        nanoflann::KDTreeAdaptor<Eigen::Matrix3Xd, 3, nanoflann::metric_L2_Simple> kdtree(Y);
-        /// Buffers
-        Eigen::Matrix3Xd Q = Eigen::Matrix3Xd::Zero(3, X.cols());
-        Eigen::VectorXd W = Eigen::VectorXd::Zero(X.cols());
-        Eigen::Matrix3Xd Xo1 = X;
-        Eigen::Matrix3Xd Xo2 = X;
+    /// @param Workspace
+    /// @return Rigid motion applied to the source
+    /// Each outer iteration is a single pass over the source, which applies the
+    /// previous motion update, weights the residuals and accumulates the
+    /// moments of the pairs. The stopping criteria bound the displacement of
+    /// the points from the motion updates, as the points stay within the same
+    /// radius of their centroid.
+    template <typename Derived1, typename IndexType, typename Derived2>
+    Eigen::Transform<typename Derived1::Scalar, 3, Eigen::Affine>
+    point_to_point(Eigen::MatrixBase<Derived1>& X,
+                   const IndexType& kdtree,
+                   const Eigen::MatrixBase<Derived2>& Y,
+                   Parameters par,
+                   IcpWorkspace<typename Derived1::Scalar>& ws) {
+        typedef typename Derived1::Scalar Scalar;
+        typedef Eigen::Matrix<Scalar, 3, 1> Vector3;
+        typedef Eigen::Transform<Scalar, 3, Eigen::Affine> AffineTransform;
+        const Eigen::DenseIndex n = X.cols();
+        AffineTransform transformation = AffineTransform::Identity();
+        if(n == 0) return transformation;
+        ws.reserve(n, false);
+        /// Centroid and radius of the source, kept by the rigid motions
+        Vector3 center = X.rowwise().sum() / Scalar(n);
+        Scalar radius = 0;
+        for(Eigen::DenseIndex i=0; i<n; ++i)
+            radius = (std::max)(radius, (X.col(i) - center).squaredNorm());
+        radius = std::sqrt(radius);
+        const double sqMaxDistance = par.max_distance*par.max_distance;
+        /// Motion update not applied to X yet
+        AffineTransform pending = AffineTransform::Identity();
+        /// Find closest point, applying the pending update
+        const auto associate = [&]() {
+            gr::Utils::parallel_for(0, int(n), [&](int i) {
+                X.col(i) = pending * X.col(i);
+                const int id = int(kdtree.closest(X.col(i).data()));
+                if(id < 0 || double((Y.col(id) - X.col(i)).squaredNorm()) > sqMaxDistance) unmatched(i, ws);
+                else ws.Q.col(i) = Y.col(id);
+            }, 256);
+            pending = AffineTransform::Identity();
+        };
+        const auto distance = [&](Eigen::DenseIndex i) {
+            return double((X.col(i) - ws.Q.col(i)).norm());
+        };
+        /// Anderson acceleration, with the plain iterate and the energy of
+        /// the last accepted pose as safeguard
+        const Vector3 center0 = center;
+        RigidMotionEstimator::AndersonAcceleration<Scalar> anderson((std::max)(par.anderson, 1), center0);
+        AffineTransform fallback = AffineTransform::Identity();
+        double accepted = std::numeric_limits<double>::infinity();
+        bool extrapolated = false;
         /// ICP
         for(int icp=0; icp<par.max_icp; ++icp) {
-            /// Find closest point
-            #pragma omp parallel for
-            for(int i=0; i<X.cols(); ++i) {
-                Q.col(i) = Y.col(kdtree.closest(X.col(i).data()));
+            associate();
+            if(par.anderson > 0) {
+                double e = energy(n, par, ws, distance);
+                if(extrapolated && !(e < accepted)) {
+                    /// The energy increased, back to the plain iterate
+                    pending = fallback * transformation.inverse(Eigen::Isometry);
+                    transformation = fallback;
+                    center = transformation * center0;
+                    anderson.reset();
+                    associate();
+                    e = energy(n, par, ws, distance);
+                }
+                accepted = e;
             }
+            const AffineTransform icpStart = transformation;
+            AffineTransform icpMotion = AffineTransform::Identity();
+            const Vector3 icpCenter = center;
             /// Computer rotation and translation
             for(int outer=0; outer<par.max_outer; ++outer) {
-                /// Compute weights
-                W = (X-Q).colwise().norm();
-                robust_weight(par.f, W, par.p);
+                /// Weighted moments of the pairs around the centroid, by a
+                /// parallel reduction also applying the pending update
+                const AffineTransform apply = pending;
+                const auto residual = [&](Eigen::DenseIndex i) {
+                    X.col(i) = apply * X.col(i);
+                    return double((X.col(i) - ws.Q.col(i)).norm());
+                };
+                const double threshold = par.f == TRIMMED ? trimmed_threshold(n, par, ws, residual) : 0.0;
+                const PointMoments m = gr::Utils::parallel_reduce(Eigen::DenseIndex(0), n, PointMoments::Zero(),
+                    [&](Eigen::DenseIndex first, Eigen::DenseIndex last, PointMoments m) {
+                        Eigen::Vector3d sx = m.sx, sq = m.sq;
+                        Eigen::Matrix3d sxq = m.sxq;
+                        for(Eigen::DenseIndex i=first; i<last; ++i) {
+                            const double w = pair_weight(i, par, ws, threshold, residual);
+                            if(w == 0.0) continue;
+                            const Eigen::Vector3d x = (X.col(i) - center).template cast<double>();
+                            const Eigen::Vector3d q = (ws.Q.col(i) - center).template cast<double>();
+                            m.sw += w;
+                            sx += w*x;
+                            sq += w*q;
+                            sxq.noalias() += (w*x)*q.transpose();
+                        }
+                        m.sx = sx;
+                        m.sq = sq;
+                        m.sxq = sxq;
+                        return m;
+                    },
+                    [](const PointMoments& a, const PointMoments& b) { return a + b; },
+                    Eigen::DenseIndex(1024));
+                const double sw = m.sw;
+                if(!(sw > 0.0)) { pending = AffineTransform::Identity(); break; }
                 /// Rotation and translation update
-                RigidMotionEstimator::point_to_point(X, Q, W);
+                const Eigen::Vector3d x_mean = m.sx/sw, q_mean = m.sq/sw;
+                const Eigen::Matrix3d sigma = Eigen::Matrix3d(m.sxq) - sw*x_mean*q_mean.transpose();
+                Eigen::JacobiSVD<Eigen::Matrix3d> svd(sigma, Eigen::ComputeFullU | Eigen::ComputeFullV);
+                Eigen::Matrix3d rotation;
+                if(svd.matrixU().determinant()*svd.matrixV().determinant() < 0.0) {
+                    Eigen::Vector3d S = Eigen::Vector3d::Ones(); S(2) = -1.0;
+                    rotation.noalias() = svd.matrixV()*S.asDiagonal()*svd.matrixU().transpose();
+                } else {
+                    rotation.noalias() = svd.matrixV()*svd.matrixU().transpose();
+                }
+                const Eigen::Vector3d c = center.template cast<double>();
+                AffineTransform update;
+                update.linear() = rotation.cast<Scalar>();
+                update.translation() = (c + q_mean - rotation*(c + x_mean)).cast<Scalar>();
+                pending = update;
+                transformation = update * transformation;
+                icpMotion = update * icpMotion;
                 /// Stopping criteria
-                double stop1 = (X-Xo1).colwise().norm().maxCoeff();
-                Xo1 = X;
+                double stop1 = max_displacement(update, center, radius);
+                center = update * center;
                 if(stop1 < par.stop) break;
             }
             /// Stopping criteria
-            double stop2 = (X-Xo2).colwise().norm().maxCoeff();
-            Xo2 = X;
+            double stop2 = max_displacement(icpMotion, icpCenter, radius);
             if(stop2 < par.stop) break;
+            /// Accelerated pose
+            if(par.anderson > 0) {
+                fallback = transformation;
+                AffineTransform next;
+                extrapolated = anderson.compute(icpStart, transformation, next);
+                pending = next * transformation.inverse(Eigen::Isometry) * pending;
+                transformation = next;
+                center = transformation * center0;
+            }
         }
+        gr::Utils::parallel_for(0, int(n), [&](int i) {
+            X.col(i) = pending * X.col(i);
+        }, 1024);
+        return transformation;
     }
-    /// Reweighted ICP with point to plane
-    /// @param Source (one 3D point per column)
+    /// Reweighted ICP with point to point, against an index of the target
+    /// \see point_to_point
+    template <typename Derived1, typename IndexType, typename Derived2>
+    inline Eigen::Transform<typename Derived1::Scalar, 3, Eigen::Affine>
+    point_to_point(Eigen::MatrixBase<Derived1>& X,
+                   const IndexType& kdtree,
+                   const Eigen::MatrixBase<Derived2>& Y,
+                   Parameters par = Parameters()) {
+        IcpWorkspace<typename Derived1::Scalar> ws;
+        return point_to_point(X, kdtree, Y, par, ws);
+    }
+    /// Reweighted ICP with point to point
+    /// @param Source (one 3D point per column), moved in place
     /// @param Target (one 3D point per column)
-    /// @param Target normals (one 3D normal per column)
     /// @param Parameters
-    template <typename Derived1, typename Derived2, typename Derived3>
-    void point_to_plane(Eigen::MatrixBase<Derived1>& X,
-                        Eigen::MatrixBase<Derived2>& Y,
-                        Eigen::MatrixBase<Derived3>& N,
-                        Parameters par = Parameters()) {
+    /// @return Rigid motion applied to the source
+    template <typename Derived1, typename Derived2>
+    Eigen::Transform<typename Derived1::Scalar, 3, Eigen::Affine>
+    point_to_point(Eigen::MatrixBase<Derived1>& X,
+                   const Eigen::MatrixBase<Derived2>& Y,
+                   Parameters par = Parameters()) {
         /// Build kd-tree
         nanoflann::KDTreeAdaptor<Eigen::MatrixBase<Derived2>, 3, nanoflann::metric_L2_Simple> kdtree(Y);
-        /// Buffers
-        Eigen::Matrix3Xd Qp = Eigen::Matrix3Xd::Zero(3, X.cols());
-        Eigen::Matrix3Xd Qn = Eigen::Matrix3Xd::Zero(3, X.cols());
-        Eigen::VectorXd W = Eigen::VectorXd::Zero(X.cols());
-        Eigen::Matrix3Xd Xo1 = X;
-        Eigen::Matrix3Xd Xo2 = X;
+        return point_to_point(X, kdtree, Y, par);
+    }
+    /// Centroids of the points in each cubic voxel, in order of first visit
+    /// @param Points (one 3D point per column)
+    /// @param Voxel size
+    template <typename Derived>
+    Eigen::Matrix<typename Derived::Scalar, 3, Eigen::Dynamic>
+    voxel_downsample(const Eigen::MatrixBase<Derived>& X, double voxel) {
+        typedef typename Derived::Scalar Scalar;
+        /// Key of the voxel, on 21 bits per axis
+        const auto cell = [voxel](Scalar v) {
+            const int64_t c = int64_t(std::floor(double(v) / voxel)) + (int64_t(1) << 20);
+            return uint64_t((std::min)((std::max)(c, int64_t(0)), (int64_t(1) << 21) - 1));
+        };
+        std::unordered_map<uint64_t, Eigen::DenseIndex> voxels;
+        voxels.reserve(size_t(X.cols()));
+        Eigen::Matrix4Xd sums(4, X.cols());
+        Eigen::DenseIndex m = 0;
+        for(Eigen::DenseIndex i=0; i<X.cols(); ++i) {
+            const uint64_t key = cell(X(0,i)) | cell(X(1,i)) << 21 | cell(X(2,i)) << 42;
+            const auto it = voxels.insert(std::make_pair(key, m));
+            if(it.second) sums.col(m++).setZero();
+            sums.col(it.first->second).template head<3>() += X.col(i).template cast<double>();
+            sums(3, it.first->second) += 1.0;
+        }
+        Eigen::Matrix<Scalar, 3, Eigen::Dynamic> result(3, m);
+        for(Eigen::DenseIndex j=0; j<m; ++j)
+            result.col(j) = (sums.col(j).template head<3>() / sums(3,j)).template cast<Scalar>();
+        return result;
+    }
+    /// Level of a coarse to fine ICP
+    class PyramidLevel {
+    public:
+        PyramidLevel(double voxel, int max_icp, double stop, double max_distance) :
+            voxel(voxel), max_icp(max_icp), stop(stop), max_distance(max_distance) {}
+        double voxel;        /// voxel size of the downsampling, 0 for full resolution
+        int max_icp;         /// max ICP iteration
+        double stop;         /// stopping criteria
+        double max_distance; /// pairs farther apart are left unmatched
+    };
+    /// Levels of a coarse to fine ICP, from the coarsest to the full
+    /// resolution: the voxel size halves from one level to the next, the
+    /// coarsest level gets the iterations of the parameters, the others only
+    /// refine the previous level.
+    /// @param Voxel size of the finest downsampled level
+    /// @param Number of levels, including the full resolution
+    /// @param Parameters
+    inline std::vector<PyramidLevel> pyramid_levels(double voxel, int levels, const Parameters& par) {
+        std::vector<PyramidLevel> result;
+        for(int l=levels-2; l>=0; --l) {
+            const double v = voxel*double(1 << l);
+            const bool coarsest = l == levels-2;
+            result.push_back(PyramidLevel(v, coarsest ? par.max_icp : 10,
+                                          (std::max)(par.stop, 1e-3*v),
+                                          coarsest ? par.max_distance : 4.0*v));
+        }
+        result.push_back(PyramidLevel(0.0, levels > 1 ? 3 : par.max_icp, par.stop,
+                                      levels > 1 ? 2.0*voxel : par.max_distance));
+        return result;
+    }
+    /// Reweighted ICP with point to point, coarse to fine
+    /// @param Source (one 3D point per column), moved in place
+    /// @param Target (one 3D point per column)
+    /// @param Levels, from the coarsest, \see pyramid_levels
+    /// @param Parameters, for the robust function and max_outer
+    /// @return Rigid motion applied to the source
+    /// Both clouds are downsampled for each level but the last one, and the
+    /// motion found at a level is the initial guess of the next one, so that
+    /// most of the iterations run on a few thousand points. The target is
+    /// downsampled 4 times finer than the source, as point to point pairs
+    /// do not resolve motions smaller than the spacing of the target.
+    template <typename Derived1, typename Derived2>
+    Eigen::Transform<typename Derived1::Scalar, 3, Eigen::Affine>
+    point_to_point(Eigen::MatrixBase<Derived1>& X,
+                   const Eigen::MatrixBase<Derived2>& Y,
+                   const std::vector<PyramidLevel>& levels,
+                   Parameters par = Parameters()) {
+        typedef typename Derived1::Scalar Scalar;
+        typedef Eigen::Matrix<Scalar, 3, Eigen::Dynamic> Matrix3X;
+        typedef Eigen::Transform<Scalar, 3, Eigen::Affine> AffineTransform;
+        AffineTransform transformation = AffineTransform::Identity();
+        IcpWorkspace<Scalar> ws;
+        for(const PyramidLevel& level : levels) {
+            par.max_icp = level.max_icp;
+            par.stop = level.stop;
+            par.max_distance = level.max_distance;
+            if(level.voxel > 0.0) {
+                Matrix3X Xl = voxel_downsample(X, level.voxel);
+                const Matrix3X Yl = voxel_downsample(Y, level.voxel/4);
+                if(Xl.cols() == 0 || Yl.cols() == 0) continue;
+                Xl = transformation * Xl;
+                nanoflann::KDTreeAdaptor<Matrix3X, 3, nanoflann::metric_L2_Simple> kdtree(Yl);
+                transformation = point_to_point(Xl, kdtree, Yl, par, ws) * transformation;
+            } else {
+                gr::Utils::parallel_for(0, int(X.cols()), [&](int i) {
+                    X.col(i) = transformation * X.col(i);
+                }, 1024);
+                nanoflann::KDTreeAdaptor<Eigen::MatrixBase<Derived2>, 3, nanoflann::metric_L2_Simple> kdtree(Y);
+                return point_to_point(X, kdtree, Y, par, ws) * transformation;
+            }
+        }
+        /// No full resolution level
+        gr::Utils::parallel_for(0, int(X.cols()), [&](int i) {
+            X.col(i) = transformation * X.col(i);
+        }, 1024);
+        return transformation;
+    }
+    /// Reweighted ICP with point to plane, against an index of the target
+    /// @param Source (one 3D point per column), moved in place
+    /// @param Index of the target, see point_to_point
+    /// @param Target (one 3D point per column)
+    /// @param Target normals (one 3D normal per column)
+    /// @param Parameters
+    /// @param Workspace
+    /// @return Rigid motion applied to the source
+    /// As for point_to_point, each outer iteration is a single pass over the
+    /// source, accumulating the linearized system in double.
+    template <typename Derived1, typename IndexType, typename Derived2, typename Derived3>
+    Eigen::Transform<typename Derived1::Scalar, 3, Eigen::Affine>
+    point_to_plane(Eigen::MatrixBase<Derived1>& X,
+                   const IndexType& kdtree,
+                   const Eigen::MatrixBase<Derived2>& Y,
+                   const Eigen::MatrixBase<Derived3>& N,
+                   Parameters par,
+                   IcpWorkspace<typename Derived1::Scalar>& ws) {
+        typedef typename Derived1::Scalar Scalar;
+        typedef Eigen::Matrix<Scalar, 3, 1> Vector3;
+        typedef Eigen::Transform<Scalar, 3, Eigen::Affine> AffineTransform;
+        const Eigen::DenseIndex n = X.cols();
+        AffineTransform transformation = AffineTransform::Identity();
+        if(n == 0) return transformation;
+        ws.reserve(n, true);
+        /// Centroid and radius of the source, kept by the rigid motions
+        Vector3 center = X.rowwise().sum() / Scalar(n);
+        Scalar radius = 0;
+        for(Eigen::DenseIndex i=0; i<n; ++i)
+            radius = (std::max)(radius, (X.col(i) - center).squaredNorm());
+        radius = std::sqrt(radius);
+        const double sqMaxDistance = par.max_distance*par.max_distance;
+        /// Motion update not applied to X yet
+        AffineTransform pending = AffineTransform::Identity();
+        /// Find closest point, applying the pending update
+        const auto associate = [&]() {
+            gr::Utils::parallel_for(0, int(n), [&](int i) {
+                X.col(i) = pending * X.col(i);
+                const int id = int(kdtree.closest(X.col(i).data()));
+                if(id < 0 || double((Y.col(id) - X.col(i)).squaredNorm()) > sqMaxDistance) { unmatched(i, ws); return; }
+                ws.Q.col(i) = Y.col(id);
+                ws.Qn.col(i) = N.col(id);
+            }, 256);
+            pending = AffineTransform::Identity();
+        };
+        const auto distance = [&](Eigen::DenseIndex i) {
+            return std::abs(double(ws.Qn.col(i).dot(X.col(i) - ws.Q.col(i))));
+        };
+        /// Anderson acceleration, with the plain iterate and the energy of
+        /// the last accepted pose as safeguard
+        const Vector3 center0 = center;
+        RigidMotionEstimator::AndersonAcceleration<Scalar> anderson((std::max)(par.anderson, 1), center0);
+        AffineTransform fallback = AffineTransform::Identity();
+        double accepted = std::numeric_limits<double>::infinity();
+        bool extrapolated = false;
         /// ICP
         for(int icp=0; icp<par.max_icp; ++icp) {
-            /// Find closest point
-            #pragma omp parallel for
-            for(int i=0; i<X.cols(); ++i) {
-                int id = kdtree.closest(X.col(i).data());
-                Qp.col(i) = Y.col(id);
-                Qn.col(i) = N.col(id);
+            associate();
+            if(par.anderson > 0) {
+                double e = energy(n, par, ws, distance);
+                if(extrapolated && !(e < accepted)) {
+                    /// The energy increased, back to the plain iterate
+                    pending = fallback * transformation.inverse(Eigen::Isometry);
+                    transformation = fallback;
+                    center = transformation * center0;
+                    anderson.reset();
+                    associate();
+                    e = energy(n, par, ws, distance);
+                }
+                accepted = e;
             }
+            const AffineTransform icpStart = transformation;
+            AffineTransform icpMotion = AffineTransform::Identity();
+            const Vector3 icpCenter = center;
             /// Computer rotation and translation
             for(int outer=0; outer<par.max_outer; ++outer) {
-                /// Compute weights
-                W = (Qn.array()*(X-Qp).array()).colwise().sum().abs().transpose();
-                robust_weight(par.f, W, par.p);
+                /// Normal equations linearized around the centroid, by a
+                /// parallel reduction also applying the pending update
+                const AffineTransform apply = pending;
+                const auto residual = [&](Eigen::DenseIndex i) {
+                    X.col(i) = apply * X.col(i);
+                    return std::abs(double(ws.Qn.col(i).dot(X.col(i) - ws.Q.col(i))));
+                };
+                const double threshold = par.f == TRIMMED ? trimmed_threshold(n, par, ws, residual) : 0.0;
+                const Eigen::Vector3d c = center.template cast<double>();
+                const RigidMotionEstimator::PlaneEquations equations = RigidMotionEstimator::plane_equations(n,
+                    [&](Eigen::DenseIndex i, Eigen::Vector3d& x, Eigen::Vector3d& nq, double& d) {
+                        const double w = pair_weight(i, par, ws, threshold, residual);
+                        x = X.col(i).template cast<double>() - c;
+                        nq = ws.Qn.col(i).template cast<double>();
+                        d = -double(ws.Qn.col(i).dot(X.col(i) - ws.Q.col(i)));
+                        return w;
+                    });
+                if(!(equations.sw > 0.0)) { pending = AffineTransform::Identity(); break; }
                 /// Rotation and translation update
-                RigidMotionEstimator::point_to_plane(X, Qp, Qn, W);
+                const AffineTransform update = (Eigen::Translation3d(c) * equations.motion() * Eigen::Translation3d(-c)).template cast<Scalar>();
+                pending = update;
+                transformation = update * transformation;
+                icpMotion = update * icpMotion;
                 /// Stopping criteria
-                double stop1 = (X-Xo1).colwise().norm().maxCoeff();
-                Xo1 = X;
+                double stop1 = max_displacement(update, center, radius);
+                center = update * center;
                 if(stop1 < par.stop) break;
             }
             /// Stopping criteria
-            double stop2 = (X-Xo2).colwise().norm().maxCoeff() ;
-            Xo2 = X;
+            double stop2 = max_displacement(icpMotion, icpCenter, radius);
             if(stop2 < par.stop) break;
+            /// Accelerated pose
+            if(par.anderson > 0) {
+                fallback = transformation;
+                AffineTransform next;
+                extrapolated = anderson.compute(icpStart, transformation, next);
+                pending = next * transformation.inverse(Eigen::Isometry) * pending;
+                transformation = next;
+                center = transformation * center0;
+            }
         }
+        gr::Utils::parallel_for(0, int(n), [&](int i) {
+            X.col(i) = pending * X.col(i);
+        }, 1024);
+        return transformation;
+    }
+    /// Reweighted ICP with point to plane, against an index of the target
+    /// \see point_to_plane
+    template <typename Derived1, typename IndexType, typename Derived2, typename Derived3>
+    inline Eigen::Transform<typename Derived1::Scalar, 3, Eigen::Affine>
+    point_to_plane(Eigen::MatrixBase<Derived1>& X,
+                   const IndexType& kdtree,
+                   const Eigen::MatrixBase<Derived2>& Y,
+                   const Eigen::MatrixBase<Derived3>& N,
+                   Parameters par = Parameters()) {
+        IcpWorkspace<typename Derived1::Scalar> ws;
+        return point_to_plane(X, kdtree, Y, N, par, ws);
+    }
+    /// Reweighted ICP with point to plane
+    /// @param Source (one 3D point per column), moved in place
+    /// @param Target (one 3D point per column)
+    /// @param Target normals (one 3D normal per column)
+    /// @param Parameters
+    /// @return Rigid motion applied to the source
+    template <typename Derived1, typename Derived2, typename Derived3>
+    Eigen::Transform<typename Derived1::Scalar, 3, Eigen::Affine>
+    point_to_plane(Eigen::MatrixBase<Derived1>& X,
+                   const Eigen::MatrixBase<Derived2>& Y,
+                   const Eigen::MatrixBase<Derived3>& N,
+                   Parameters par = Parameters()) {
+        /// Build kd-tree
+        nanoflann::KDTreeAdaptor<Eigen::MatrixBase<Derived2>, 3, nanoflann::metric_L2_Simple> kdtree(Y);
+        return point_to_plane(X, kdtree, Y, N, par);
+    }
+    /// Reweighted ICP with point to plane, against an organized depth image
+    /// @param Source (one 3D point per column), moved in place
+    /// @param Depth of the target pixels, row by row
+    /// @param Width and height of the target image
+    /// @param Intrinsics of the target image
+    /// @param Camera to world pose of the target
+    /// @param Parameters
+    /// @param Workspace
+    /// @param Half size of the searched window, in pixels
+    /// @return Rigid motion applied to the source
+    /// The correspondences are found by projecting the source points into the
+    /// target image, with the normals derived from its depth (\see
+    /// gr::DepthImageIndex), instead of searching a kd-tree. Source points
+    /// out of the view of the target are left unmatched.
+    template <typename Derived1>
+    Eigen::Transform<typename Derived1::Scalar, 3, Eigen::Affine>
+    projective_point_to_plane(Eigen::MatrixBase<Derived1>& X,
+                              const typename Derived1::Scalar* depth, int width, int height,
+                              const typename gr::DepthImageIndex<typename Derived1::Scalar>::Intrinsics& intrinsics,
+                              const Eigen::Transform<typename Derived1::Scalar, 3, Eigen::Affine>& cameraToWorld,
+                              Parameters par,
+                              IcpWorkspace<typename Derived1::Scalar>& ws,
+                              int window = 2) {
+        const gr::DepthImageIndex<typename Derived1::Scalar> index(depth, width, height, intrinsics, cameraToWorld, window);
+        return point_to_plane(X, index, index.points(), index.normals(), par, ws);
     }
 }
 ///////////////////////////////////////////////////////////////////////////////
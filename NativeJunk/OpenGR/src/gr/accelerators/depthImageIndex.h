@@ -0,0 +1,222 @@
+// Copyright 2020 Nicolas Mellado
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// -------------------------------------------------------------------------- //
+//
+// This file is part of the OpenGR library
+//
+
+#pragma once
+
+#include "gr/utils/scheduler.h"
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace gr{
+
+/*!
+  \brief Projective point index of an organized depth image.
+
+  The pixels are back-projected once to world space, with a normal estimated
+  from their neighbours in the image. A query point is projected into the
+  image and its closest point is searched in a small window of pixels around
+  the projection, which makes the search constant time, reading a few
+  contiguous rows of the image.
+
+  The camera follows the convention of the capture: it looks down -z with y
+  up, the depth is the distance along the optical axis, and the pixel rows go
+  downwards, so that pixel (u, v) at depth d is the camera point
+  ((u - cx) * d / fx, -(v - cy) * d / fy, -d).
+
+  A pixel is valid if its depth is positive and finite and its normal could
+  be estimated. closest returns invalidIndex() for the points projecting
+  outside of the image, behind the camera or onto invalid pixels only, so that
+  they get no correspondence in ICP.
+  */
+template<typename _Scalar, typename _Index = int >
+class DepthImageIndex
+{
+public:
+    typedef _Scalar Scalar;
+    typedef _Index  Index;
+
+    typedef Eigen::Matrix<Scalar, 3, 1>               VectorType;
+    typedef Eigen::Matrix<Scalar, 3, Eigen::Dynamic>  MatrixType;
+    typedef Eigen::Transform<Scalar, 3, Eigen::Affine> TransformType;
+
+    //! Pinhole intrinsics, in pixels of the depth image
+    struct Intrinsics
+    {
+        Scalar fx, fy, cx, cy;
+    };
+
+    static constexpr Index invalidIndex() { return Index(-1); }
+
+    /*!
+     * \param depth Depth of the pixels, row by row, <= 0 or NaN when unknown
+     * \param cameraToWorld Pose of the camera
+     * \param window Half size of the searched window, in pixels
+     * \param maxDepthJump Largest depth difference between neighbouring
+     * pixels of a same surface, used to estimate the normals
+     */
+    DepthImageIndex(const Scalar* depth, Index width, Index height,
+                    const Intrinsics& intrinsics,
+                    const TransformType& cameraToWorld,
+                    Index window = 2,
+                    Scalar maxDepthJump = Scalar(0.1));
+
+    inline Index width()  const { return mWidth; }
+    inline Index height() const { return mHeight; }
+
+    //! World points of the pixels, one per column, NaN for invalid pixels
+    inline const MatrixType& points()  const { return mPoints; }
+
+    //! World normals of the pixels, one per column, zero for invalid pixels
+    inline const MatrixType& normals() const { return mNormals; }
+
+    inline bool isValid(Index pixel) const { return mValid[pixel] != 0; }
+
+    /*!
+     * \brief Finds the closest valid pixel to q within the window around its
+     * projection
+     * \return The pixel index and squared distance, invalidIndex() and
+     * sqdist when no valid pixel is in range
+     */
+    inline std::pair<Index, Scalar>
+    closest(const VectorType& q,
+            Scalar sqdist = (std::numeric_limits<Scalar>::max)()) const;
+
+    //! Index of the closest pixel to query[0:2], compatible with ICP
+    inline Index closest(const Scalar* query) const {
+        return closest(VectorType(query[0], query[1], query[2])).first;
+    }
+
+private:
+    inline Index pixel(Index u, Index v) const { return v * mWidth + u; }
+
+    Index mWidth, mHeight, mWindow;
+    Intrinsics mIntrinsics;
+    TransformType mWorldToCamera;
+    MatrixType mPoints, mNormals;
+    std::vector<unsigned char> mValid;
+};
+
+
+template<typename Scalar, typename Index>
+DepthImageIndex<Scalar, Index>::DepthImageIndex(const Scalar* depth,
+                                                Index width, Index height,
+                                                const Intrinsics& intrinsics,
+                                                const TransformType& cameraToWorld,
+                                                Index window,
+                                                Scalar maxDepthJump)
+    : mWidth((std::max)(width, Index(0))),
+      mHeight((std::max)(height, Index(0))),
+      mWindow((std::max)(window, Index(0))),
+      mIntrinsics(intrinsics),
+      mWorldToCamera(cameraToWorld.inverse(Eigen::Isometry)),
+      mPoints(3, mWidth * mHeight),
+      mNormals(3, mWidth * mHeight),
+      mValid(size_t(mWidth * mHeight), 0)
+{
+    const auto known = [depth](Index i) {
+        return depth[i] > Scalar(0) && std::isfinite(depth[i]);
+    };
+
+    // Back-projection
+    Utils::parallel_for(Index(0), mHeight, [&](Index v) {
+        for (Index u = 0; u < mWidth; ++u) {
+            const Index i = pixel(u, v);
+            if (! known(i)) {
+                mPoints.col(i).setConstant(std::numeric_limits<Scalar>::quiet_NaN());
+                continue;
+            }
+            const Scalar d = depth[i];
+            const VectorType c ((Scalar(u) - mIntrinsics.cx) * d / mIntrinsics.fx,
+                               -(Scalar(v) - mIntrinsics.cy) * d / mIntrinsics.fy,
+                               -d);
+            mPoints.col(i) = cameraToWorld * c;
+        }
+    }, Index(8));
+
+    // Normals, averaged over the two triangles of the pixel and its
+    // neighbours, skipping the depth discontinuities
+    Utils::parallel_for(Index(0), mHeight, [&](Index v) {
+        for (Index u = 0; u < mWidth; ++u) {
+            const Index i = pixel(u, v);
+            mNormals.col(i).setZero();
+            if (! known(i)) continue;
+            const auto near = [&](Index j) {
+                return known(j) && std::abs(depth[j] - depth[i]) < maxDepthJump;
+            };
+            VectorType sum = VectorType::Zero();
+            if (u + 1 < mWidth && v > 0 && near(i + 1) && near(i - mWidth))
+                sum += (mPoints.col(i + 1) - mPoints.col(i)).normalized().cross(
+                       (mPoints.col(i - mWidth) - mPoints.col(i)).normalized());
+            if (u > 0 && v + 1 < mHeight && near(i - 1) && near(i + mWidth))
+                sum += (mPoints.col(i - 1) - mPoints.col(i)).normalized().cross(
+                       (mPoints.col(i + mWidth) - mPoints.col(i)).normalized());
+            const Scalar norm = sum.norm();
+            if (norm > Scalar(1e-6)) {
+                mNormals.col(i) = sum / norm;
+                mValid[size_t(i)] = 1;
+            }
+        }
+    }, Index(8));
+}
+
+template<typename Scalar, typename Index>
+std::pair<Index, Scalar>
+DepthImageIndex<Scalar, Index>::closest(const VectorType& q, Scalar sqdist) const
+{
+    Index id = invalidIndex();
+    const VectorType c = mWorldToCamera * q;
+    if (! (c.z() < Scalar(0)))
+        return std::make_pair(id, sqdist);
+
+    // Projection, rounded to the closest pixel
+    const Scalar d = -c.z();
+    const Scalar x = mIntrinsics.cx + c.x() * mIntrinsics.fx / d;
+    const Scalar y = mIntrinsics.cy - c.y() * mIntrinsics.fy / d;
+    if (! (x > Scalar(-0.5) - mWindow && x < mWidth  + mWindow - Scalar(0.5) &&
+           y > Scalar(-0.5) - mWindow && y < mHeight + mWindow - Scalar(0.5)))
+        return std::make_pair(id, sqdist);
+    const Index u = Index(std::floor(x + Scalar(0.5)));
+    const Index v = Index(std::floor(y + Scalar(0.5)));
+
+    const Index u0 = (std::max)(u - mWindow, Index(0));
+    const Index u1 = (std::min)(u + mWindow, mWidth - 1);
+    const Index v0 = (std::max)(v - mWindow, Index(0));
+    const Index v1 = (std::min)(v + mWindow, mHeight - 1);
+    for (Index pv = v0; pv <= v1; ++pv) {
+        for (Index pu = u0; pu <= u1; ++pu) {
+            const Index i = pixel(pu, pv);
+            if (! mValid[size_t(i)]) continue;
+            const Scalar dist = (mPoints.col(i) - q).squaredNorm();
+            if (dist < sqdist) {
+                sqdist = dist;
+                id = i;
+            }
+        }
+    }
+    return std::make_pair(id, sqdist);
+}
+
+} //namespace gr
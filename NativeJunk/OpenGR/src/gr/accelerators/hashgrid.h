@@ -0,0 +1,357 @@
+// Copyright 2020 Nicolas Mellado
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// -------------------------------------------------------------------------- //
+//
+// This file is part of the OpenGR library
+//
+
+#pragma once
+
+#include "gr/utils/disablewarnings.h"
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>  //iota
+#include <vector>
+
+namespace gr{
+
+/*!
+  \brief 3D voxel hash grid, answering fixed-radius queries with reentrant
+  queries.
+
+  Space is divided in cubic cells of size cellSize, and the cells are hashed
+  in a table of buckets. The grid is built in linear time and a query for a
+  radius smaller than cellSize scans at most the 27 cells around the query
+  point, whatever the number of points. Hash collisions only bring extra
+  candidates, discarded by the distance test.
+
+  The query interface mirrors the one of KdTree, so that both can be used
+  interchangeably as template parameters, e.g. by the registration metrics.
+  */
+template<typename _Scalar, typename _Index = int >
+class HashGrid
+{
+public:
+    typedef _Scalar Scalar;
+    typedef _Index  Index;
+
+    static constexpr Index invalidIndex() { return -1; }
+
+    typedef Eigen::Matrix<Scalar,3,1> VectorType;
+    typedef Eigen::AlignedBox<_Scalar, 3> AxisAlignedBoxType;
+
+    typedef std::vector<VectorType>  PointList;
+    typedef std::vector<Index>       IndexList;
+
+    //! Range query, the stack size is only kept for compatibility with KdTree
+    template <int _stackSize = 64>
+    struct RangeQuery
+    {
+        VectorType queryPoint;
+        Scalar     sqdist;
+    };
+
+    //! Range query performed for a packet of query points at once
+    template <int _packetSize = 16, int _stackSize = 64>
+    struct PacketRangeQuery
+    {
+        enum { PacketSize = _packetSize };
+        typedef Eigen::Array<Scalar, _packetSize, 1> ScalarPacket;
+        typedef Eigen::Array<Index,  _packetSize, 1> IndexPacket;
+
+        //! Coordinates of the query points, stored as a structure of arrays
+        ScalarPacket x, y, z;
+        //! Number of valid query points, the remaining lanes are ignored
+        int          count;
+        Scalar       sqdist;
+    };
+
+public:
+    //! Create the grid using memory copy.
+    HashGrid(const PointList& points, Scalar cellSize);
+
+    //! Create a void grid
+    HashGrid(Scalar cellSize = Scalar(1), unsigned int size = 0);
+
+    //! Add a new vertex in the grid
+    template <class VectorDerived>
+    inline void add( const VectorDerived &p ){
+        mPoints.push_back(p);
+        mIndices.push_back(mIndices.size());
+        mAABB.extend(p);
+    }
+
+    inline void add(Scalar *position){
+        add(Eigen::Map< Eigen::Matrix<Scalar, 3, 1> >(position));
+    }
+
+    //! Finalize the creation of the grid
+    inline void finalize( );
+
+    inline const AxisAlignedBoxType& aabb() const  {return mAABB; }
+
+    inline Scalar cellSize() const { return mCellSize; }
+
+    /*!
+     * \brief Finds the closest element index within the range [0:sqrt(sqdist)]
+     * \param currentId Index of the querypoint if it belongs to the grid
+     */
+    template<int stackSize>
+    inline std::pair<Index, Scalar>
+    doQueryRestrictedClosestIndex(RangeQuery<stackSize> &query,
+                                  int currentId = -1) const;
+
+    /*!
+     * \brief Finds any element index within the range [0:sqrt(sqdist)]
+     *
+     * Cheaper than doQueryRestrictedClosestIndex when only the existence of
+     * a neighbor matters.
+     */
+    template<int stackSize>
+    inline Index
+    doQueryRestrictedAnyIndex(RangeQuery<stackSize> &query) const;
+
+    /*!
+     * \brief Finds, for each point of a packet, the closest element index
+     * within the range [0:sqrt(sqdist)]
+     * \param anyInRange Return any element in range instead of the closest
+     * \see KdTree::doQueryRestrictedClosestIndexPacket
+     */
+    template<int packetSize, int stackSize>
+    inline void
+    doQueryRestrictedClosestIndexPacket(
+            PacketRangeQuery<packetSize, stackSize> &query,
+            typename PacketRangeQuery<packetSize, stackSize>::IndexPacket  &ids,
+            typename PacketRangeQuery<packetSize, stackSize>::ScalarPacket &sqdists,
+            bool anyInRange = false) const;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+protected:
+    typedef Eigen::Matrix<int,3,1> CellType;
+
+    inline CellType cellOf(const VectorType& p) const {
+        return CellType( int(std::floor(p.x() * mInvCellSize)),
+                         int(std::floor(p.y() * mInvCellSize)),
+                         int(std::floor(p.z() * mInvCellSize)) );
+    }
+
+    inline unsigned int bucketOf(const CellType& c) const {
+        return ( (uint32_t(c.x()) * 73856093u) ^
+                 (uint32_t(c.y()) * 19349663u) ^
+                 (uint32_t(c.z()) * 83492791u) ) & mBucketMask;
+    }
+
+    /*!
+     * \brief Calls f(i) with the internal id of each point of the buckets
+     * overlapping the query ball, until f returns true.
+     */
+    template <typename Functor>
+    inline void _visitCandidates(const VectorType& queryPoint,
+                                 Scalar sqdist,
+                                 Functor f) const;
+
+protected:
+    PointList  mPoints;
+    IndexList  mIndices;
+    AxisAlignedBoxType mAABB;
+    //! Range of each bucket in mPoints, CSR layout
+    std::vector<unsigned int> mBucketStart;
+    unsigned int mBucketMask;
+
+    Scalar mCellSize;
+    Scalar mInvCellSize;
+};
+
+
+template<typename Scalar, typename Index>
+HashGrid<Scalar, Index>::HashGrid(const PointList& points, Scalar cellSize)
+    : mPoints(points),
+      mIndices(points.size()),
+      mBucketMask(0),
+      mCellSize(cellSize),
+      mInvCellSize(Scalar(1) / cellSize)
+{
+    mAABB.extend(points.cbegin(), points.cend());
+    std::iota (mIndices.begin(), mIndices.end(), 0);
+    finalize();
+}
+
+/*!
+  Second way to create the grid, in two time. You must call finalize()
+  before requesting for closest points.
+
+  \see finalize()
+  */
+template<typename Scalar, typename Index>
+HashGrid<Scalar, Index>::HashGrid(Scalar cellSize, unsigned int size)
+    : mBucketMask(0),
+      mCellSize(cellSize),
+      mInvCellSize(Scalar(1) / cellSize)
+{
+    mPoints.reserve(size);
+    mIndices.reserve(size);
+}
+
+/*!
+  Sort the points by bucket (counting sort), in linear time.
+  The number of buckets is the power of two above twice the number of points,
+  which keeps the collisions low.
+  */
+template<typename Scalar, typename Index>
+void
+HashGrid<Scalar, Index>::finalize()
+{
+    const size_t n = mPoints.size();
+
+    unsigned int nbBuckets = 1;
+    while (nbBuckets < 2*n) nbBuckets <<= 1;
+    mBucketMask = nbBuckets - 1;
+
+    std::vector<unsigned int> buckets (n);
+    mBucketStart.assign(nbBuckets + 1, 0);
+    for (size_t i = 0; i < n; ++i) {
+        buckets[i] = bucketOf(cellOf(mPoints[i]));
+        mBucketStart[buckets[i]+1]++;
+    }
+    for (unsigned int b = 0; b < nbBuckets; ++b)
+        mBucketStart[b+1] += mBucketStart[b];
+
+    PointList points (n);
+    IndexList indices (n);
+    std::vector<unsigned int> cursor (mBucketStart.begin(), mBucketStart.end()-1);
+    for (size_t i = 0; i < n; ++i) {
+        const unsigned int dst = cursor[buckets[i]]++;
+        points [dst] = mPoints[i];
+        indices[dst] = mIndices[i];
+    }
+    mPoints.swap(points);
+    mIndices.swap(indices);
+}
+
+/*!
+  The visited cells are the ones overlapping the bounding box of the query
+  ball, i.e. at most 3 cells per axis when the radius is smaller than the
+  cell size. When the ball covers more cells than there are buckets, all the
+  buckets are visited once instead.
+  */
+template<typename Scalar, typename Index>
+template <typename Functor>
+void
+HashGrid<Scalar, Index>::_visitCandidates(const VectorType& queryPoint,
+                                          Scalar sqdist,
+                                          Functor f) const
+{
+    if (mPoints.empty()) return;
+
+    const Scalar radius = std::sqrt(sqdist);
+    const CellType lo = cellOf(queryPoint - VectorType::Constant(radius));
+    const CellType hi = cellOf(queryPoint + VectorType::Constant(radius));
+    const CellType extent = hi - lo + CellType::Ones();
+
+    if (double(extent.x()) * double(extent.y()) * double(extent.z()) >= double(mBucketMask + 1)) {
+        for (unsigned int i = 0; i < mPoints.size(); ++i)
+            if (f(i)) return;
+        return;
+    }
+
+    CellType c;
+    for (c.x() = lo.x(); c.x() <= hi.x(); ++c.x())
+        for (c.y() = lo.y(); c.y() <= hi.y(); ++c.y())
+            for (c.z() = lo.z(); c.z() <= hi.z(); ++c.z()) {
+                const unsigned int b = bucketOf(c);
+                const unsigned int end = mBucketStart[b+1];
+                for (unsigned int i = mBucketStart[b]; i < end; ++i)
+                    if (f(i)) return;
+            }
+}
+
+template<typename Scalar, typename Index>
+template<int stackSize>
+std::pair<Index, Scalar>
+HashGrid<Scalar, Index>::doQueryRestrictedClosestIndex(
+        RangeQuery<stackSize>& query,
+        int currentId) const
+{
+    Index  cl_id   = invalidIndex();
+    Scalar cl_dist = query.sqdist;
+
+    _visitCandidates(query.queryPoint, query.sqdist, [&](unsigned int i){
+        const Scalar sqdist = (query.queryPoint - mPoints[i]).squaredNorm();
+        if (sqdist <= cl_dist && mIndices[i] != currentId){
+            cl_dist = sqdist;
+            cl_id   = mIndices[i];
+        }
+        return false;
+    });
+
+    return std::make_pair(cl_id, cl_dist);
+}
+
+template<typename Scalar, typename Index>
+template<int stackSize>
+Index
+HashGrid<Scalar, Index>::doQueryRestrictedAnyIndex(
+        RangeQuery<stackSize>& query) const
+{
+    Index id = invalidIndex();
+
+    _visitCandidates(query.queryPoint, query.sqdist, [&](unsigned int i){
+        if ((query.queryPoint - mPoints[i]).squaredNorm() <= query.sqdist) {
+            id = mIndices[i];
+            return true;
+        }
+        return false;
+    });
+
+    return id;
+}
+
+/*!
+  Queries are constant time, so the packet is processed point by point.
+  */
+template<typename Scalar, typename Index>
+template<int packetSize, int stackSize>
+void
+HashGrid<Scalar, Index>::doQueryRestrictedClosestIndexPacket(
+        PacketRangeQuery<packetSize, stackSize>& query,
+        typename PacketRangeQuery<packetSize, stackSize>::IndexPacket  &ids,
+        typename PacketRangeQuery<packetSize, stackSize>::ScalarPacket &sqdists,
+        bool anyInRange) const
+{
+    ids.setConstant(invalidIndex());
+    sqdists.setConstant(query.sqdist);
+
+    RangeQuery<stackSize> q;
+    q.sqdist = query.sqdist;
+
+    for (int k = 0; k < query.count; ++k) {
+        q.queryPoint = VectorType(query.x(k), query.y(k), query.z(k));
+        if (anyInRange) {
+            ids(k) = doQueryRestrictedAnyIndex(q);
+        } else {
+            const auto res = doQueryRestrictedClosestIndex(q);
+            ids(k)     = res.first;
+            sqdists(k) = res.second;
+        }
+    }
+}
+
+} //namespace gr
@@ -0,0 +1,219 @@
+// Copyright 2020 Nicolas Mellado
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// -------------------------------------------------------------------------- //
+//
+// This file is part of the OpenGR library
+//
+
+#pragma once
+
+#include "gr/utils/disablewarnings.h"
+#include "gr/accelerators/kdtree.h"
+
+#include <Eigen/Core>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace gr{
+
+/*!
+  \brief Growing 3D point index, made of a logarithmic forest of KdTree.
+
+  Points are inserted by batches. Each batch is indexed by a new tree, and
+  the trees covering the most recent points are merged as long as the
+  previous tree is not larger than the new one, so that the forest holds at
+  most log2(n) trees and each point is indexed O(log n) times overall.
+  Each tree covers a contiguous range of points.
+
+  When voxelSize is positive, a point is only inserted if no point was
+  inserted before in its cubic voxel, which bounds the size of a model
+  accumulating overlapping frames by its surface.
+
+  Queries are const and can be run concurrently, but not during insertions.
+  */
+template<typename _Scalar, typename _Index = int >
+class KdForest
+{
+public:
+    typedef _Scalar Scalar;
+    typedef _Index  Index;
+
+    typedef KdTree<Scalar, Index>               TreeType;
+    typedef typename TreeType::VectorType        VectorType;
+    typedef Eigen::Matrix<Scalar, 3, Eigen::Dynamic> MatrixType;
+
+    static constexpr Index invalidIndex() { return TreeType::invalidIndex(); }
+
+    inline explicit KdForest(Scalar voxelSize = Scalar(0))
+        : mVoxelSize(voxelSize) {}
+
+    //! Number of points in the index
+    inline Index size() const { return mSize; }
+
+    inline Scalar voxelSize() const { return mVoxelSize; }
+
+    //! Inserted points, one per column, in insertion order
+    inline typename MatrixType::ConstColsBlockXpr points() const
+    { return mPoints.leftCols(mSize); }
+
+    //! Normals of the inserted points, empty if no normal was given
+    inline typename MatrixType::ConstColsBlockXpr normals() const
+    { return mNormals.leftCols(mNormals.cols() == 0 ? 0 : mSize); }
+
+    //! Removes all the points
+    inline void clear() {
+        mSize = 0;
+        mTrees.clear();
+        mVoxels.clear();
+    }
+
+    /*!
+     * \brief Inserts the columns of points
+     * \return Number of inserted points, the other ones falling in occupied
+     * voxels
+     */
+    template <typename Derived>
+    inline Index insert(const Eigen::MatrixBase<Derived>& points) {
+        return insert(points, MatrixType());
+    }
+
+    /*!
+     * \brief Inserts the columns of points, with their normals
+     *
+     * Normals must be given for all the insertions or for none.
+     */
+    template <typename Derived1, typename Derived2>
+    Index insert(const Eigen::MatrixBase<Derived1>& points,
+                 const Eigen::MatrixBase<Derived2>& normals);
+
+    /*!
+     * \brief Finds the closest point within the range [0:sqrt(sqdist)]
+     * \return Its index and squared distance, invalidIndex() and sqdist
+     * when no point is in range
+     */
+    inline std::pair<Index, Scalar>
+    closest(const VectorType& q,
+            Scalar sqdist = (std::numeric_limits<Scalar>::max)()) const;
+
+    //! Index of the closest point to query[0:2], compatible with ICP
+    inline Index closest(const Scalar* query) const {
+        return closest(VectorType(query[0], query[1], query[2])).first;
+    }
+
+private:
+    struct Tree
+    {
+        std::unique_ptr<TreeType> tree;
+        Index first;
+        Index count;
+    };
+
+    //! Key of the voxel of p, on 21 bits per axis
+    inline uint64_t voxelKey(const VectorType& p) const {
+        const auto cell = [this](Scalar v) {
+            const int64_t c = int64_t(std::floor(v / mVoxelSize)) + (int64_t(1) << 20);
+            return uint64_t((std::min)((std::max)(c, int64_t(0)),
+                                       (int64_t(1) << 21) - 1));
+        };
+        return cell(p.x()) | cell(p.y()) << 21 | cell(p.z()) << 42;
+    }
+
+    //! Reserves room for n points in the matrices
+    inline void reserve(Index n, bool withNormals) {
+        if (n <= mPoints.cols()) return;
+        const Index capacity = (std::max)(n, Index(2 * mPoints.cols()));
+        mPoints.conservativeResize(3, capacity);
+        if (withNormals)
+            mNormals.conservativeResize(3, capacity);
+    }
+
+    //! Builds a tree over the points [first, first+count)
+    inline Tree buildTree(Index first, Index count) const {
+        Tree t { std::unique_ptr<TreeType>(new TreeType(count)), first, count };
+        for (Index i = first; i != first + count; ++i)
+            t.tree->add(mPoints.col(i));
+        t.tree->finalize();
+        return t;
+    }
+
+    Scalar mVoxelSize;
+    Index  mSize = 0;
+    MatrixType mPoints, mNormals;
+    std::vector<Tree> mTrees;
+    std::unordered_set<uint64_t> mVoxels;
+};
+
+
+template<typename Scalar, typename Index>
+template <typename Derived1, typename Derived2>
+Index
+KdForest<Scalar, Index>::insert(const Eigen::MatrixBase<Derived1>& points,
+                                const Eigen::MatrixBase<Derived2>& normals)
+{
+    const bool withNormals = normals.cols() != 0;
+    reserve(mSize + Index(points.cols()), withNormals);
+
+    const Index first = mSize;
+    for (Index i = 0; i != Index(points.cols()); ++i) {
+        const VectorType p = points.col(i).template cast<Scalar>();
+        if (mVoxelSize > Scalar(0) && ! mVoxels.insert(voxelKey(p)).second)
+            continue;
+        mPoints.col(mSize) = p;
+        if (withNormals)
+            mNormals.col(mSize) = normals.col(i).template cast<Scalar>();
+        ++mSize;
+    }
+    const Index count = mSize - first;
+    if (count == 0) return 0;
+
+    // Merge the most recent trees while they are not larger than the new one
+    Index mergedFirst = first;
+    while (! mTrees.empty() && mTrees.back().count <= mSize - mergedFirst) {
+        mergedFirst = mTrees.back().first;
+        mTrees.pop_back();
+    }
+    mTrees.push_back(buildTree(mergedFirst, mSize - mergedFirst));
+    return count;
+}
+
+template<typename Scalar, typename Index>
+std::pair<Index, Scalar>
+KdForest<Scalar, Index>::closest(const VectorType& q, Scalar sqdist) const
+{
+    typename TreeType::template RangeQuery<> query;
+    query.queryPoint = q;
+    query.sqdist     = sqdist;
+
+    // Trees are queried from the largest, the range shrinking as closer
+    // points are found
+    Index id = invalidIndex();
+    for (const Tree& t : mTrees) {
+        const std::pair<Index, Scalar> res = t.tree->doQueryRestrictedClosestIndex(query);
+        if (res.first != invalidIndex()) {
+            id = t.first + res.first;
+            query.sqdist = res.second;
+        }
+    }
+    return std::make_pair(id, query.sqdist);
+}
+
+} //namespace gr
@@ -47,6 +47,7 @@
 #pragma once
 
 #include "gr/utils/disablewarnings.h"
+#include "gr/utils/scheduler.h"
 
 #include <Eigen/Core>
 #include <Eigen/Geometry>
@@ -55,6 +56,9 @@
 #include <iostream>
 #include <vector>
 #include <numeric>  //iota
+#include <algorithm>
+#include <cmath>
+#include <utility>
 
 // max depth of the tree
 #define KD_MAX_DEPTH 32
@@ -93,6 +97,11 @@ public:
 
     static constexpr Index invalidIndex() { return -1; }
 
+    //! Number of levels of the tree built in parallel
+    static constexpr unsigned int kParallelBuildLevels = 8;
+    //! Minimum number of points of a subtree built by a separate task
+    static constexpr unsigned int kParallelBuildSize = 8192;
+
     typedef Eigen::Matrix<Scalar,3,1> VectorType;
     typedef Eigen::AlignedBox<_Scalar, 3> AxisAlignedBoxType;
 
@@ -119,6 +128,40 @@ public:
         QueryNode  nodeStack[_stackSize];
     };
 
+    //! Range query performed for a packet of query points at once
+    template <int _packetSize = 16, int _stackSize = 64>
+    struct PacketRangeQuery
+    {
+        enum { PacketSize = _packetSize };
+        typedef Eigen::Array<Scalar, _packetSize, 1> ScalarPacket;
+        typedef Eigen::Array<Index,  _packetSize, 1> IndexPacket;
+
+        //! element of the stack, with the squared distance of each query
+        //! point to the node
+        struct PacketNode
+        {
+            unsigned int nodeId;
+            ScalarPacket sq;
+        };
+
+        inline PacketRangeQuery()
+            : exclude(IndexPacket::Constant(invalidIndex())) {}
+
+        //! Coordinates of the query points, stored as a structure of arrays
+        ScalarPacket x, y, z;
+        //! Element ignored by each query point, e.g. the query point itself
+        //! when it belongs to the tree. invalidIndex() by default.
+        IndexPacket  exclude;
+        //! Number of valid query points, the remaining lanes are ignored
+        int          count;
+        Scalar       sqdist;
+        PacketNode   nodeStack[_stackSize];
+    };
+
+    //! Number of leaf points whose distances are evaluated at once
+    enum { LeafBlockSize = 8 };
+    typedef Eigen::Array<Scalar, LeafBlockSize, 1> LeafBlock;
+
     inline const NodeList&   _getNodes   (void) { return mNodes;   }
     inline const PointList&  _getPoints  (void) { return mPoints;  }
     inline const PointList&  _getIndices (void) { return mIndices;  }
@@ -164,7 +207,7 @@ public:
     doQueryDist(RangeQuery<stackSize>& query,
                 Container& result) const {
         _doQueryDistIndicesWithFunctor(query, [&result,this](unsigned int i){
-            result.push_back(mPoints[i]);
+            result.push_back(leafPoint(i));
         });
     }
 
@@ -176,7 +219,7 @@ public:
     doQueryDistIndices(RangeQuery<stackSize>& query,
                        IndexContainer& result) const {
         _doQueryDistIndicesWithFunctor(query, [&result,this](unsigned int i){
-            result.push_back(mIndices[i]);
+            result.push_back(mLeafIndices[i]);
         });
     }
 
@@ -188,7 +231,7 @@ public:
     doQueryDistProcessIndices(RangeQuery<stackSize> &query,
                               Functor f) const {
         _doQueryDistIndicesWithFunctor(query, [f,this](unsigned int i){
-            f(mIndices[i]);
+            f(mLeafIndices[i]);
         });
     }
 
@@ -201,25 +244,99 @@ public:
     doQueryRestrictedClosestIndex(RangeQuery<stackSize> &query,
                                   int currentId = -1) const;
 
+    /*!
+     * \brief Finds, for each point of a packet, the closest element index
+     * within the range [0:sqrt(sqdist)]
+     * \param ids Output indices, invalidIndex() when no element is in range
+     * \param sqdists Output squared distances, sqdist when no element is in range
+     * \param anyInRange Stop as soon as every query point has an element in
+     * range. The returned elements are then not guaranteed to be the closest.
+     */
+    template<int packetSize, int stackSize>
+    inline void
+    doQueryRestrictedClosestIndexPacket(
+            PacketRangeQuery<packetSize, stackSize> &query,
+            typename PacketRangeQuery<packetSize, stackSize>::IndexPacket  &ids,
+            typename PacketRangeQuery<packetSize, stackSize>::ScalarPacket &sqdists,
+            bool anyInRange = false) const;
+
+    /*!
+     * \brief Finds, for n query points, the closest element index within
+     * the range [0:sqrt(sqdist)]
+     *
+     * The query points are processed by packets of points falling in the
+     * same leaves, \see doQueryRestrictedClosestIndexPacket
+     * \param query query(i) returns the i-th query point
+     * \param output output(i, id, sqdist) is called with the result of the
+     * i-th query, id being invalidIndex() when no element is in range
+     * \param excludeSelf Ignore the element i for the i-th query, when the
+     * query points are the elements of the tree
+     */
+    template<typename QueryFunctor, typename OutputFunctor>
+    inline void
+    doQueryBatch(size_t n, Scalar sqdist,
+                 QueryFunctor query,
+                 OutputFunctor output,
+                 bool excludeSelf = false) const;
+
      EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
 protected:
+    //! Squared distances from q to the points of the leaf block of slot
+    inline LeafBlock blockSquaredDistances(unsigned int slot,
+                                           const VectorType& q) const {
+        const Scalar* c = mLeafCoords.data() + (slot / LeafBlockSize) * 3 * LeafBlockSize;
+        typedef Eigen::Map<const LeafBlock, Eigen::Aligned> BlockMap;
+        return (BlockMap(c)                   - q.x()).square() +
+               (BlockMap(c +   LeafBlockSize) - q.y()).square() +
+               (BlockMap(c + 2*LeafBlockSize) - q.z()).square();
+    }
+
+    //! Coordinates of the leaf point stored at slot
+    inline VectorType leafPoint(unsigned int slot) const {
+        const Scalar* c = mLeafCoords.data()
+                + (slot / LeafBlockSize) * 3 * LeafBlockSize + slot % LeafBlockSize;
+        return VectorType(c[0], c[LeafBlockSize], c[2*LeafBlockSize]);
+    }
+
+    //! Copies the leaf points in mLeafCoords and mLeafIndices
+    void layoutLeaves();
+
+    //! Node of the tree under construction, before its layout in mNodes
+    struct BuildNode
+    {
+        KdNode node;
+        //! Arena and position in the arena of the children of an inner node
+        unsigned int childArena[2];
+        unsigned int childId[2];
+    };
+    typedef std::vector<BuildNode> BuildArena;
 
     /*!
       Used to build the tree: split the subset [start..end[ according to dim
       and splitValue, and returns the index of the first element of the second
-      subset.
+      subset. The bounding boxes of the two subsets are computed on the fly.
       */
     inline
-    unsigned int split(int start, int end, unsigned int dim, Scalar splitValue);
-
-    void createTree(unsigned int nodeId,
-                    unsigned int start,
-                    unsigned int end,
-                    unsigned int level,
-                    unsigned int targetCellsize,
-                    unsigned int targetMaxDepth);
+    unsigned int split(unsigned int start, unsigned int end,
+                       unsigned int dim, Scalar splitValue,
+                       AxisAlignedBoxType& leftBox,
+                       AxisAlignedBoxType& rightBox);
 
+    /*!
+      Recursively builds the subtree of the points [start..end[, bounded by
+      aabb, in arenas[arenaId]. Returns the position of its root in the arena.
+      */
+    unsigned int createTree(std::vector<BuildArena>& arenas,
+                            unsigned int arenaId,
+                            unsigned int heapId,
+                            unsigned int start,
+                            unsigned int end,
+                            const AxisAlignedBoxType& aabb,
+                            unsigned int level,
+                            unsigned int targetCellsize,
+                            unsigned int targetMaxDepth,
+                            Utils::TaskGroup& tasks);
 
     /*!
      * \brief Performs distance query and pass the internal id to a functor
@@ -235,6 +352,15 @@ protected:
     AxisAlignedBoxType mAABB;
     NodeList   mNodes;
 
+    /*!
+      Points of the leaves, read by the queries: each leaf starts a new block
+      of LeafBlockSize points, stored as LeafBlockSize x, then y, then z
+      coordinates. Unused slots have NaN coordinates and invalidIndex().
+      The start of a leaf node is its first slot.
+      */
+    std::vector<Scalar, Eigen::aligned_allocator<Scalar> > mLeafCoords;
+    IndexList  mLeafIndices;
+
     unsigned int _nofPointsPerCell;
     unsigned int _maxDepth;
 };
@@ -277,23 +403,99 @@ KdTree<Scalar, Index>::KdTree(unsigned int size,
     mIndices.reserve(size);
 }
 
+/*!
+  The subtrees are built in parallel down to kParallelBuildLevels, each one in
+  its own arena, then the nodes are laid out in breadth-first order in mNodes:
+  the two children of a node are consecutive, and the top levels, visited by
+  all the queries, share a few cache lines.
+  */
 template<typename Scalar, typename Index>
 void
 KdTree<Scalar, Index>::finalize()
 {
     mNodes.clear();
-    mNodes.reserve(4*mPoints.size()/_nofPointsPerCell);
-    mNodes.emplace_back();
-    mNodes.back().leaf = 0;
+    mLeafCoords.clear();
+    mLeafIndices.clear();
+    if (mPoints.empty()) return;
+
 #ifdef DEBUG
     std::cout << "create tree" << std::endl;
 #endif
-    createTree(0, 0, mPoints.size(), 1, _nofPointsPerCell, _maxDepth);
+    // Arenas are indexed by the heap index of the root of their subtree
+    std::vector<BuildArena> arenas (size_t(2) << kParallelBuildLevels);
+    arenas[1].reserve(4*mPoints.size()/_nofPointsPerCell + 1);
+    unsigned int rootId;
+    {
+        Utils::TaskGroup tasks;
+        rootId = createTree(arenas, 1, 1, 0, mPoints.size(), mAABB,
+                            1, _nofPointsPerCell, _maxDepth, tasks);
+        tasks.wait();
+    }
+
+    // Breadth-first layout
+    size_t nbNodes = 0;
+    for (const auto& arena : arenas) nbNodes += arena.size();
+    mNodes.reserve(nbNodes);
+    std::vector<const BuildNode*> queue;
+    queue.reserve(nbNodes);
+    queue.push_back(&arenas[1][rootId]);
+    mNodes.push_back(queue.front()->node);
+    for (size_t q = 0; q != queue.size(); ++q) {
+        const BuildNode& b = *queue[q];
+        if (b.node.leaf) continue;
+        mNodes[q].firstChildId = mNodes.size();
+        for (int c = 0; c != 2; ++c) {
+            queue.push_back(&arenas[b.childArena[c]][b.childId[c]]);
+            mNodes.push_back(queue.back()->node);
+        }
+    }
+    layoutLeaves();
 #ifdef DEBUG
     std::cout << "create tree ... DONE (" << mPoints.size() << " points)" << std::endl;
 #endif
 }
 
+/*!
+  Leaves are copied in the order of their points, so that neighboring leaves
+  remain close in memory.
+  */
+template<typename Scalar, typename Index>
+void
+KdTree<Scalar, Index>::layoutLeaves()
+{
+    std::vector<unsigned int> leaves;
+    for (unsigned int n = 0; n != mNodes.size(); ++n)
+        if (mNodes[n].leaf) leaves.push_back(n);
+    std::sort(leaves.begin(), leaves.end(), [this](unsigned int a, unsigned int b){
+        return mNodes[a].start < mNodes[b].start;
+    });
+
+    size_t nbBlocks = 0;
+    for (const unsigned int n : leaves)
+        nbBlocks += (mNodes[n].size + LeafBlockSize - 1) / LeafBlockSize;
+
+    mLeafCoords.assign(nbBlocks * 3 * LeafBlockSize,
+                       std::numeric_limits<Scalar>::quiet_NaN());
+    mLeafIndices.assign(nbBlocks * LeafBlockSize, invalidIndex());
+
+    unsigned int slot = 0;
+    for (const unsigned int n : leaves) {
+        KdNode& node = mNodes[n];
+        for (unsigned int i = 0; i != node.size; ++i) {
+            const unsigned int s = slot + i;
+            Scalar* c = mLeafCoords.data()
+                    + (s / LeafBlockSize) * 3 * LeafBlockSize + s % LeafBlockSize;
+            const VectorType& p = mPoints[node.start + i];
+            c[0]               = p.x();
+            c[LeafBlockSize]   = p.y();
+            c[2*LeafBlockSize] = p.z();
+            mLeafIndices[s] = mIndices[node.start + i];
+        }
+        node.start = slot;
+        slot += (node.size + LeafBlockSize - 1) / LeafBlockSize * LeafBlockSize;
+    }
+}
+
 template<typename Scalar, typename Index>
 KdTree<Scalar, Index>::~KdTree()
 {
@@ -327,6 +529,8 @@ KdTree<Scalar, Index>::doQueryRestrictedClosestIndex(
     Index  cl_id   = invalidIndex();
     Scalar cl_dist = query.sqdist;
 
+    if (mNodes.empty()) return std::make_pair(cl_id, cl_dist);
+
     query.nodeStack[0].nodeId = 0;
     query.nodeStack[0].sq = Scalar(0);
     unsigned int count = 1;
@@ -343,12 +547,16 @@ KdTree<Scalar, Index>::doQueryRestrictedClosestIndex(
             if (node.leaf)
             {
                 --count; // pop
-                const int end = node.start+node.size;
-                for (int i=node.start ; i<end ; ++i){
-                    const Scalar sqdist = (query.queryPoint - mPoints[i]).squaredNorm();
-                    if (sqdist <= cl_dist && mIndices[i] != currentId){
-                        cl_dist = sqdist;
-                        cl_id   = mIndices[i];
+                const unsigned int end = node.start+node.size;
+                for (unsigned int b=node.start ; b<end ; b+=LeafBlockSize){
+                    const LeafBlock d = blockSquaredDistances(b, query.queryPoint);
+                    if (! (d <= cl_dist).any()) continue;
+                    // padding slots have NaN distances
+                    for (unsigned int k=0 ; k<LeafBlockSize ; ++k){
+                        if (d[k] <= cl_dist && mLeafIndices[b+k] != currentId){
+                            cl_dist = d[k];
+                            cl_id   = mLeafIndices[b+k];
+                        }
                     }
                 }
             }
@@ -383,6 +591,160 @@ KdTree<Scalar, Index>::doQueryRestrictedClosestIndex(
     return std::make_pair(cl_id, cl_dist);
 }
 
+/*!
+  Packet variant of doQueryRestrictedClosestIndex.
+
+  The tree is traversed once for the whole packet, tracking for each query
+  point the squared distance to the current node as in the single query: a
+  node is visited as long as one of the query points may have a closer
+  element in it, the closest child for the packet first, and the leaves are
+  scanned only for these query points. The traversal is thus shared by the
+  query points, which is efficient when they are spatially coherent.
+*/
+template<typename Scalar, typename Index>
+template<int packetSize, int stackSize>
+void
+KdTree<Scalar, Index>::doQueryRestrictedClosestIndexPacket(
+        PacketRangeQuery<packetSize, stackSize>& query,
+        typename PacketRangeQuery<packetSize, stackSize>::IndexPacket  &ids,
+        typename PacketRangeQuery<packetSize, stackSize>::ScalarPacket &sqdists,
+        bool anyInRange) const
+{
+    typedef typename PacketRangeQuery<packetSize, stackSize>::IndexPacket  IndexPacket;
+    typedef typename PacketRangeQuery<packetSize, stackSize>::ScalarPacket ScalarPacket;
+    typedef typename PacketRangeQuery<packetSize, stackSize>::PacketNode   PacketNode;
+
+    ids.setConstant(invalidIndex());
+    sqdists.setConstant(query.sqdist);
+
+    const int count = query.count;
+    if (count <= 0 || mNodes.empty()) return;
+
+    // Unused lanes are never active
+    ScalarPacket unused = ScalarPacket::Zero();
+    for (int k = count; k < packetSize; ++k) {
+        query.x(k) = query.x(0);
+        query.y(k) = query.y(0);
+        query.z(k) = query.z(0);
+        unused(k)  = std::numeric_limits<Scalar>::infinity();
+    }
+
+    query.nodeStack[0].nodeId = 0;
+    query.nodeStack[0].sq = unused;
+    unsigned int stack = 1;
+
+    while (stack)
+    {
+        PacketNode& qnode = query.nodeStack[--stack];
+        const auto active = qnode.sq < sqdists;
+        if (! active.any()) continue;
+
+        const KdNode& node = mNodes[qnode.nodeId];
+
+        if (node.leaf)
+        {
+            const unsigned int end = node.start+node.size;
+            for (int k = 0; k < count; ++k) {
+                if (! active(k)) continue;
+                const VectorType q (query.x(k), query.y(k), query.z(k));
+                Scalar cl_dist = sqdists(k);
+                Index  cl_id   = ids(k);
+                for (unsigned int b=node.start ; b<end ; b+=LeafBlockSize){
+                    const LeafBlock d = blockSquaredDistances(b, q);
+                    if (! (d <= cl_dist).any()) continue;
+                    for (unsigned int j=0 ; j<LeafBlockSize ; ++j){
+                        if (d[j] <= cl_dist && mLeafIndices[b+j] != query.exclude(k)){
+                            cl_dist = d[j];
+                            cl_id   = mLeafIndices[b+j];
+                        }
+                    }
+                }
+                sqdists(k) = cl_dist;
+                ids(k)     = cl_id;
+            }
+
+            if (anyInRange &&
+                    (ids.head(count) != IndexPacket::Constant(invalidIndex()).head(count)).all())
+                return;
+        }
+        else
+        {
+            const ScalarPacket& coord = node.dim == 0 ? query.x :
+                                        node.dim == 1 ? query.y : query.z;
+            const ScalarPacket off = coord - node.splitValue;
+            const ScalarPacket parentSq = qnode.sq;
+
+            // stack the farthest child for the packet, then the closest on top
+            const bool leftIsClosest = off.head(count).sum() < Scalar(0);
+            PacketNode& farthest = query.nodeStack[stack];
+            PacketNode& closest  = query.nodeStack[stack+1];
+            farthest.nodeId = leftIsClosest ? node.firstChildId+1 : node.firstChildId;
+            closest .nodeId = leftIsClosest ? node.firstChildId   : node.firstChildId+1;
+
+            // squared distance to the left child for the query points on the
+            // right of the split, and conversely
+            const ScalarPacket sqLeft  = parentSq.max((off > Scalar(0)).select(off.square(), Scalar(0)));
+            const ScalarPacket sqRight = parentSq.max((off < Scalar(0)).select(off.square(), Scalar(0)));
+            farthest.sq = leftIsClosest ? sqRight : sqLeft;
+            closest .sq = leftIsClosest ? sqLeft  : sqRight;
+            stack += 2;
+        }
+    }
+}
+
+/*!
+  The query points are grouped by the leaf of the tree containing them, so
+  that the points of a packet are close in space and visit the same leaves.
+  */
+template<typename Scalar, typename Index>
+template<typename QueryFunctor, typename OutputFunctor>
+void
+KdTree<Scalar, Index>::doQueryBatch(size_t n, Scalar sqdist,
+                                    QueryFunctor queryPoint,
+                                    OutputFunctor output,
+                                    bool excludeSelf) const
+{
+    typedef PacketRangeQuery<> PacketQuery;
+
+    if (mNodes.empty()) {
+        for (size_t i = 0; i != n; ++i) output(i, invalidIndex(), sqdist);
+        return;
+    }
+
+    // Sort the query points by the first slot of their leaf
+    std::vector< std::pair<unsigned int, size_t> > order (n);
+    for (size_t i = 0; i != n; ++i) {
+        const VectorType p = queryPoint(i);
+        const KdNode* node = &mNodes[0];
+        while (! node->leaf)
+            node = &mNodes[node->firstChildId + (p[node->dim] < node->splitValue ? 0 : 1)];
+        order[i] = std::make_pair(node->start, i);
+    }
+    std::sort(order.begin(), order.end());
+
+    PacketQuery query;
+    typename PacketQuery::IndexPacket  ids;
+    typename PacketQuery::ScalarPacket sqdists;
+    query.sqdist = sqdist;
+
+    for (size_t first = 0; first < n; first += PacketQuery::PacketSize) {
+        query.count = int((std::min)(size_t(PacketQuery::PacketSize), n - first));
+        for (int k = 0; k != query.count; ++k) {
+            const size_t i = order[first + k].second;
+            const VectorType p = queryPoint(i);
+            query.x(k) = p.x();
+            query.y(k) = p.y();
+            query.z(k) = p.z();
+            query.exclude(k) = excludeSelf ? Index(i) : invalidIndex();
+        }
+
+        doQueryRestrictedClosestIndexPacket(query, ids, sqdists);
+
+        for (int k = 0; k != query.count; ++k)
+            output(order[first + k].second, ids(k), sqdists(k));
+    }
+}
+
 /*!
   \see doQueryRestrictedClosestIndex For more information about the algorithm.
 
@@ -397,6 +759,8 @@ KdTree<Scalar, Index>::_doQueryDistIndicesWithFunctor(
         RangeQuery<stackSize>& query,
         Functor f) const
 {
+    if (mNodes.empty()) return;
+
     query.nodeStack[0].nodeId = 0;
     query.nodeStack[0].sq = Scalar(0);
     unsigned int count = 1;
@@ -411,11 +775,14 @@ KdTree<Scalar, Index>::_doQueryDistIndicesWithFunctor(
             if (node.leaf)
             {
                 --count; // pop
-                unsigned int end = node.start+node.size;
-                for (unsigned int i=node.start ; i<end ; ++i)
-                    if ( (query.queryPoint - mPoints[i]).squaredNorm() < query.sqdist){
-                        f(i);
-                    }
+                const unsigned int end = node.start+node.size;
+                for (unsigned int b=node.start ; b<end ; b+=LeafBlockSize){
+                    const LeafBlock d = blockSquaredDistances(b, query.queryPoint);
+                    if (! (d < query.sqdist).any()) continue;
+                    for (unsigned int k=0 ; k<LeafBlockSize ; ++k)
+                        if (d[k] < query.sqdist)
+                            f(b+k);
+                }
             }
             else
             {
@@ -445,21 +812,26 @@ KdTree<Scalar, Index>::_doQueryDistIndicesWithFunctor(
 }
 
 template<typename Scalar, typename Index>
-unsigned int KdTree<Scalar, Index>::split(int start, int end, unsigned int dim, Scalar splitValue)
+unsigned int KdTree<Scalar, Index>::split(unsigned int start, unsigned int end,
+                                          unsigned int dim, Scalar splitValue,
+                                          AxisAlignedBoxType& leftBox,
+                                          AxisAlignedBoxType& rightBox)
 {
-    int l(start), r(end-1);
-    for ( ; l<r ; ++l, --r)
+    // [start..l[ is below splitValue, [r..end[ above
+    unsigned int l(start), r(end);
+    while (l < r)
     {
-        while (l < end && mPoints[l][dim] < splitValue)
-            l++;
-        while (r >= start && mPoints[r][dim] >= splitValue)
-            r--;
-        if (l > r)
-            break;
-        std::swap(mPoints[l],mPoints[r]);
-        std::swap(mIndices[l],mIndices[r]);
+        if (mPoints[l][dim] < splitValue) {
+            leftBox.extend(mPoints[l]);
+            ++l;
+        } else {
+            --r;
+            std::swap(mPoints[l],mPoints[r]);
+            std::swap(mIndices[l],mIndices[r]);
+            rightBox.extend(mPoints[r]);
+        }
     }
-    return (mPoints[l][dim] < splitValue ? l+1 : l);
+    return l;
 }
 
 /*!
@@ -469,8 +841,8 @@ unsigned int KdTree<Scalar, Index>::split(int start, int end, unsigned int dim,
 
    The heuristic is the following:
     - if the number of points in the node is lower than targetCellsize then make a leaf
-    - else compute the AABB of the points of the node and split it at the middle of
-      the largest AABB dimension.
+    - else split the AABB of the points of the node at the middle of its largest
+      dimension. The AABBs of the two children are computed while partitioning.
 
    This strategy might look not optimal because it does not explicitly prune empty space,
    unlike more advanced SAH-like techniques used for RT. On the other hand it leads to a shorter tree,
@@ -481,89 +853,92 @@ unsigned int KdTree<Scalar, Index>::split(int start, int end, unsigned int dim,
    Actually, storing at each node the exact AABB (we therefore have a binary BVH) allows
    to prune only about 10% of the leaves, but the overhead of this pruning (ball/ABBB intersection)
    is more expensive than the gain it provides and the memory consumption is x4 higher !
+
+   The subtrees of the kParallelBuildLevels first levels holding more than
+   kParallelBuildSize points are built by separate tasks, in the arena of
+   their heap index.
 */
 template<typename Scalar, typename Index>
-void KdTree<Scalar, Index>::createTree(unsigned int nodeId, unsigned int start, unsigned int end, unsigned int level, unsigned int targetCellSize, unsigned int targetMaxDepth)
+unsigned int KdTree<Scalar, Index>::createTree(std::vector<BuildArena>& arenas,
+                                               unsigned int arenaId,
+                                               unsigned int heapId,
+                                               unsigned int start,
+                                               unsigned int end,
+                                               const AxisAlignedBoxType& aabb,
+                                               unsigned int level,
+                                               unsigned int targetCellSize,
+                                               unsigned int targetMaxDepth,
+                                               Utils::TaskGroup& tasks)
 {
+    BuildArena& arena = arenas[arenaId];
+    const unsigned int nodeId = arena.size();
+    arena.emplace_back();
 
-    KdNode& node = mNodes[nodeId];
-    AxisAlignedBoxType aabb;
-    //aabb.Set(mPoints[start]);
-    for (unsigned int i=start ; i<end ; ++i)
-        aabb.extend(mPoints[i]);
+    if (end-start <= targetCellSize || level>targetMaxDepth)
+    {
+        KdNode& node = arena[nodeId].node;
+        node.leaf = 1;
+        node.start = start;
+        node.size = end-start;
+        return nodeId;
+    }
 
     VectorType diag =  aabb.diagonal();
     typename VectorType::Index dim;
 
 #ifdef DEBUG
-
-//    std::cout << "createTree("
-//              << nodeId << ", "
-//              << start << ", "
-//              << end << ", "
-//              << level << ")"
-//              << std::endl;
-
     if (std::isnan(diag.maxCoeff(&dim))){
         std::cerr << "NaN values discovered in the tree, abort" << std::endl;
-        return;
+        dim = 0;
     }
 #else
     diag.maxCoeff(&dim);
 #endif
 
-
-#undef DEBUG
-    node.dim = dim;
-    node.splitValue = aabb.center()(dim);
-
-    unsigned int midId = split(start, end, dim, node.splitValue);
-
-    node.firstChildId = mNodes.size();
+    const Scalar splitValue = aabb.center()(dim);
+    AxisAlignedBoxType childBox[2];
+    const unsigned int midId = split(start, end, dim, splitValue,
+                                     childBox[0], childBox[1]);
+    const unsigned int childStart[2] = { start, midId };
+    const unsigned int childEnd  [2] = { midId, end   };
 
     {
-        KdNode n;
-        n.size = 0;
-        mNodes.push_back(n);
-        mNodes.push_back(n);
+        KdNode& node = arena[nodeId].node;
+        node.splitValue = splitValue;
+        node.dim  = dim;
+        node.leaf = 0;
     }
-    //mNodes << Node() << Node();
-    //mNodes.resize(mNodes.size()+2);
 
+    for (int c = 0; c != 2; ++c)
     {
-        // left child
-        unsigned int childId = mNodes[nodeId].firstChildId;
-        KdNode& child = mNodes[childId];
-        if (midId-start <= targetCellSize || level>=targetMaxDepth)
+        const unsigned int childHeapId = 2*heapId + c;
+        if (level < kParallelBuildLevels &&
+                childEnd[c]-childStart[c] > kParallelBuildSize)
         {
-            child.leaf = 1;
-            child.start = start;
-            child.size = midId-start;
+            // The child task owns the arena of its heap index, where its
+            // root is the first node
+            arena[nodeId].childArena[c] = childHeapId;
+            arena[nodeId].childId[c] = 0;
+            tasks.run([this, &arenas, &tasks, c, childHeapId,
+                      childStart, childEnd, childBox, level,
+                      targetCellSize, targetMaxDepth](){
+                arenas[childHeapId].reserve(
+                            4*(childEnd[c]-childStart[c])/targetCellSize + 1);
+                createTree(arenas, childHeapId, childHeapId,
+                           childStart[c], childEnd[c], childBox[c],
+                           level+1, targetCellSize, targetMaxDepth, tasks);
+            });
         }
         else
         {
-            child.leaf = 0;
-            createTree(childId, start, midId, level+1, targetCellSize, targetMaxDepth);
-        }
-    }
-
-    {
-        // right child
-        unsigned int childId = mNodes[nodeId].firstChildId+1;
-        KdNode& child = mNodes[childId];
-        if (end-midId <= targetCellSize || level>=targetMaxDepth)
-        {
-            child.leaf = 1;
-            child.start = midId;
-            child.size = end-midId;
-        }
-        else
-        {
-            child.leaf = 0;
-            createTree(childId, midId, end, level+1, targetCellSize, targetMaxDepth);
+            const unsigned int childId =
+                    createTree(arenas, arenaId, childHeapId,
+                               childStart[c], childEnd[c], childBox[c],
+                               level+1, targetCellSize, targetMaxDepth, tasks);
+            arena[nodeId].childArena[c] = arenaId;
+            arena[nodeId].childId[c] = childId;
         }
     }
+    return nodeId;
 }
 } //namespace gr
-
-
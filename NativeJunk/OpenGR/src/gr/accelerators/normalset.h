@@ -51,6 +51,8 @@
 
 #include <vector>
 #include <array>
+#include <cstdint>
+#include <utility>
 #include <cmath> //log2
 
 namespace gr{
@@ -63,6 +65,13 @@ namespace gr{
 
   Loops over dimensions used to compute index values are unrolled at compile
   time.
+
+  Only the occupied (position, normal) cells are stored, in a compressed
+  layout: the elements are first collected as (cell key, id) couples, then
+  sorted by key on the first query, so that the memory footprint grows with
+  the number of elements and not with the volume of the grid. The storage is
+  kept by reset, so that a set reused for several queries does not allocate
+  once it reached its working size.
  */
 template <
   class Point,      //! <\brief Type of point to work with
@@ -71,9 +80,6 @@ template <
   typename _Scalar   //! <\brief Scalar type
   >
 struct IndexedNormalSet{
-  typedef std::array< std::vector<unsigned int>,
-                      Utils::POW(_ngSize, dim)> AngularGrid;
-
   enum MOVE_DIR { POSITIVE, NEGATIVE };
   using Scalar    = _Scalar;
   using NeiIdsBox = typename gr::Utils::OneRingNeighborhood::NeighborhoodType<dim>::type;
@@ -86,11 +92,24 @@ struct IndexedNormalSet{
 #endif
 
 private:
+  /// Number of normal cells in each euclidean cell
+  static constexpr uint64_t _nbNormalCells = Utils::POW(uint64_t(_ngSize), dim);
+
   const Scalar _nepsilon;
-  std::vector<AngularGrid*> _grid;
   Scalar _epsilon;
   int _egSize;    //! <\brief Size of the euclidean grid for each dimension
 
+  /// Elements added since the last build, as (cell key, id)
+  std::vector< std::pair<uint64_t, unsigned int> > _entries;
+  /// Sorted keys of the occupied cells, key = posId * _nbNormalCells + normalId
+  std::vector<uint64_t> _keys;
+  /// The ids of cell _keys[k] are _ids[_offsets[k]] to _ids[_offsets[k+1]-1]
+  std::vector<unsigned int> _offsets;
+  std::vector<unsigned int> _ids;
+  /// Normal cells hit by a cone query
+  std::vector<int> _colored;
+  bool _built;
+
   /// Get the index corresponding to position p \warning Bounds are not tested
   inline int indexPos   ( const Point& p) const;
   /// Get the index corresponding to normal n   \warning Bounds are not tested
@@ -111,53 +130,42 @@ private:
   /// Get the index corresponding to normal n   \warning Bounds are not tested
   inline int indexCoordinatesNormal( const Point& nCoord) const;
 
-  //inline Point indexToPos (int id) const;
+  /// Sorts the pending elements into the compressed cells
+  inline void build();
+
+  /// Range [first, last) of the keys of the occupied cells of position pId
+  inline void cellRange(int pId, size_t& first, size_t& last);
+
+  /// Index in _keys of the cell (pId, nId) within [first, last), -1 if empty
+  inline int findCell(int pId, int nId, size_t first, size_t last) const;
+
+  /// Appends the ids of the cells k in [first, last) of _keys to nei
+  inline void appendIds(size_t first, size_t last,
+                        std::vector<unsigned int>&nei) const {
+    nei.insert( nei.end(), _ids.begin() + _offsets[first],
+                           _ids.begin() + _offsets[last] );
+  }
 
 public:
   inline IndexedNormalSet(const Scalar epsilon)
     : _nepsilon(Scalar(1.)/Scalar(_ngSize) + 0.00001),
-      _epsilon(epsilon)
+      _epsilon(epsilon),
+      _built(true)
   {
-    /// We need to check if epsilon is a power of two and correct it if needed
-    const int gridDepth = -std::log2(epsilon);
-    _egSize = std::pow(2,gridDepth);
-    _epsilon = double(1)/double(_egSize);
-
-    _grid = std::vector<AngularGrid*> (std::pow(_egSize, dim), NULL);
+    reset(epsilon);
   }
 
-  virtual inline ~IndexedNormalSet();
+  virtual inline ~IndexedNormalSet() {}
+
+  //! \brief Removes all the elements and sets the euclidean cell size,
+  //! keeping the allocated storage
+  inline void reset(const Scalar epsilon);
 
   //! \brief Add a new couple pos/normal, and its associated id
   inline bool addElement(const Point& pos,
                          const Point& normal,
                          unsigned int id);
 
-  //! \return NULL if the grid does not exist or p is out of bound
-  inline AngularGrid* angularGrid(const Point& p) {
-    const int pId = indexPos(p);
-    if (pId == -1) return NULL;
-    return _grid[pId];
-  }
-
-  //! \return the Angular Grid contained in p cell + its n*n neighb
-  inline std::vector<AngularGrid*> angularGrids(const Point&p) {
-    std::vector<AngularGrid*> buf;
-    const int pId = indexPos(p);
-    if (pId != -1) {
-        gr::Utils::OneRingNeighborhood neiFun;
-        NeiIdsBox arr;
-        neiFun.get<dim>( pId, _egSize, arr );
-        buf.reserve(arr.size());
-        for (auto& id : arr){
-            if ( id != -1 && _grid[id] != nullptr){
-                buf.push_back(_grid[id]);
-              }
-          }
-    }
-    return buf;
-  }
-
   //! Get closest points in euclidean space
   inline void getNeighbors( const Point& p,
                             std::vector<unsigned int>&nei);
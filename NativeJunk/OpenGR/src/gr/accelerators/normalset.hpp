@@ -47,16 +47,26 @@
 
 
 #include <math.h>
-#include <set>
+#include <algorithm>
 #include <Eigen/Geometry>
 #include <gr/accelerators/utils.h>
 
 namespace gr{
 
 template <class Point, int dim, int _ngSize, typename Scalar>
-IndexedNormalSet<Point, dim, _ngSize, Scalar>::~IndexedNormalSet(){
-  for(unsigned int i = 0; i != _grid.size(); i++)
-    delete(_grid[i]);
+void
+IndexedNormalSet<Point, dim, _ngSize, Scalar>::reset(const Scalar epsilon)
+{
+  /// We need to check if epsilon is a power of two and correct it if needed
+  const int gridDepth = -std::log2(epsilon);
+  _egSize = std::pow(2,gridDepth);
+  _epsilon = double(1)/double(_egSize);
+
+  _entries.clear();
+  _keys.clear();
+  _offsets.assign(1, 0);
+  _ids.clear();
+  _built = true;
 }
 
 /*!
@@ -106,6 +116,56 @@ IndexedNormalSet<Point, dim, _ngSize, Scalar>::indexCoordinatesNormal(
 }
 
 
+template <class Point, int dim, int _ngSize, typename Scalar>
+void
+IndexedNormalSet<Point, dim, _ngSize, Scalar>::build()
+{
+  // Ids are added in increasing order, so sorting the couples keeps the
+  // insertion order within each cell
+  std::sort(_entries.begin(), _entries.end());
+
+  _keys.clear();
+  _offsets.assign(1, 0);
+  _ids.resize(_entries.size());
+  for (size_t e = 0; e != _entries.size(); ++e) {
+    if (_keys.empty() || _keys.back() != _entries[e].first) {
+      if (! _keys.empty()) _offsets.push_back(static_cast<unsigned int>(e));
+      _keys.push_back(_entries[e].first);
+    }
+    _ids[e] = _entries[e].second;
+  }
+  if (! _keys.empty()) _offsets.push_back(static_cast<unsigned int>(_entries.size()));
+
+  _entries.clear();
+  _built = true;
+}
+
+
+template <class Point, int dim, int _ngSize, typename Scalar>
+void
+IndexedNormalSet<Point, dim, _ngSize, Scalar>::cellRange(
+  int pId, size_t& first, size_t& last)
+{
+  if (! _built) build();
+
+  const uint64_t begin = uint64_t(pId) * _nbNormalCells;
+  first = std::lower_bound(_keys.begin(), _keys.end(), begin) - _keys.begin();
+  last  = std::lower_bound(_keys.begin() + first, _keys.end(),
+                           begin + _nbNormalCells) - _keys.begin();
+}
+
+
+template <class Point, int dim, int _ngSize, typename Scalar>
+int
+IndexedNormalSet<Point, dim, _ngSize, Scalar>::findCell(
+  int pId, int nId, size_t first, size_t last) const
+{
+  const uint64_t key = uint64_t(pId) * _nbNormalCells + uint64_t(nId);
+  const auto it = std::lower_bound(_keys.begin() + first, _keys.begin() + last, key);
+  return (it != _keys.begin() + last && *it == key) ? int(it - _keys.begin()) : -1;
+}
+
+
 template <class Point, int dim, int _ngSize, typename Scalar>
 bool
 IndexedNormalSet<Point, dim, _ngSize, Scalar>::addElement(
@@ -120,19 +180,14 @@ IndexedNormalSet<Point, dim, _ngSize, Scalar>::addElement(
   if (nId == -1) return false;
 
   gr::Utils::OneRingNeighborhood neiFun;
-  using neiArray = typename gr::Utils::OneRingNeighborhood::NeighborhoodType<dim>::type;
-  neiArray arr;
+  NeiIdsBox arr;
   neiFun.get<dim>( pId, _egSize, arr );
 
   for (auto& gid : arr){
-    if (gid != -1) {
-      if (_grid[gid] == NULL) _grid[gid] = new AngularGrid;
-        (_grid[gid])->at(nId).push_back(id);
-      }
+    if (gid != -1)
+      _entries.emplace_back(uint64_t(gid) * _nbNormalCells + uint64_t(nId), id);
   }
-//  if (_grid[pId] == NULL) _grid[pId] = new AngularGrid;
-//  (_grid[pId])->at(nId).push_back(id);
-
+  _built = false;
 
   return true;
 }
@@ -144,14 +199,12 @@ IndexedNormalSet<Point, dim, _ngSize, Scalar>::getNeighbors(
   const Point& p,
   std::vector<unsigned int>&nei)
 {
-  AngularGrid* grid = angularGrid(p);
-  if ( grid == NULL ) return;
+  const int pId = indexPos(p);
+  if ( pId == -1 ) return;
 
-  for(typename AngularGrid::const_iterator it = grid->cbegin();
-      it != grid->cend(); it++){
-    const std::vector<unsigned int>& lnei = *it;
-    nei.insert( nei.end(), lnei.begin(), lnei.end() );
-  }
+  size_t first, last;
+  cellRange(pId, first, last);
+  appendIds(first, last, nei);
 }
 
 
@@ -162,11 +215,13 @@ IndexedNormalSet<Point, dim, _ngSize, Scalar>::getNeighbors(
   const Point& n,
   std::vector<unsigned int>&nei)
 {
-  AngularGrid* grid = angularGrid(p);
-  if ( grid == NULL ) return;
+  const int pId = indexPos(p);
+  if ( pId == -1 ) return;
 
-  const std::vector<unsigned int>& lnei = grid->at(indexNormal(n));
-  nei.insert( nei.end(), lnei.begin(), lnei.end() );
+  size_t first, last;
+  cellRange(pId, first, last);
+  const int k = findCell(pId, indexNormal(n), first, last);
+  if ( k != -1 ) appendIds(k, k+1, nei);
 }
 
 
@@ -179,27 +234,12 @@ IndexedNormalSet<Point, dim, _ngSize, Scalar>::getNeighbors(
   std::vector<unsigned int>&nei,
   bool tryReverse)
 {
-  // FIXME_REFACTORING
- //F    for(const auto&lnei : (*grid))
- //F      nei.insert( nei.end(), lnei.begin(), lnei.end() );
- //F    }
- //F  return;
-
-  AngularGrid* grid = angularGrid(p);
-  if ( grid == NULL ) return;
-  {
-  // END_FIXME_REFACTORING
-
-    ////////////// TESTS
-//    gr::Utils::OneRingNeighborhood neiFun;
-//    static const int dddim = 3;
-//    using neiArray = typename gr::Utils::OneRingNeighborhood::NeighborhoodType<dddim>::type;
-//    neiArray arr;
-//    neiFun.get<dddim>( 3, 4, arr );
-//    for (const auto&e : arr) std::cout << e << " ";
-//    std::cout << "\n";
-
-    ////////////// TESTS END
+  const int pId = indexPos(p);
+  if ( pId == -1 ) return;
+
+  size_t first, last;
+  cellRange(pId, first, last);
+  if ( first == last ) return;
 
   const Scalar alpha          = std::acos(cosAlpha);
   const Scalar perimeter      = Scalar(2) * M_PI * std::atan(alpha);
@@ -211,10 +251,7 @@ IndexedNormalSet<Point, dim, _ngSize, Scalar>::getNeighbors(
   Eigen::Quaternion<Scalar> q;
   q.setFromTwoVectors(Point(0.,0.,1.), n);
 
-  std::set<unsigned int> colored;
-//  for (AngularGrid* grid: angularGrids(p)) {//_grid){
-//  for (AngularGrid* grid: _grid){
-//    if (grid == NULL) continue;
+  _colored.clear();
 
   // Do the rendering independently of the content
   for(unsigned int a = 0; a != nbSample; a++){
@@ -222,27 +259,25 @@ IndexedNormalSet<Point, dim, _ngSize, Scalar>::getNeighbors(
     const Point dir = ( q * Point(sinAlpha*std::cos(theta),
                               sinAlpha*std::sin(theta),
                               cosAlpha ) ).normalized();
-    int id = indexNormal( dir );
-    if(grid->at(id).size() != 0){
-      colored.insert(id);
+    int k = findCell( pId, indexNormal( dir ), first, last );
+    if( k != -1 ){
+      _colored.push_back(k);
     }
 
     if (tryReverse){
-      id = indexNormal( -dir );
-      if(grid->at(id).size() != 0){
-        colored.insert(id);
+      k = findCell( pId, indexNormal( -dir ), first, last );
+      if( k != -1 ){
+        _colored.push_back(k);
       }
     }
   }
 
-  for( std::set<unsigned int>::const_iterator it = colored.cbegin();
-       it != colored.cend(); it++){
-    const std::vector<unsigned int>& lnei = grid->at(*it);
-    nei.insert( nei.end(), lnei.begin(), lnei.end() );
-  }
-    } //F
+  // Cells are sorted by key, hence by normal id within the euclidean cell
+  std::sort(_colored.begin(), _colored.end());
+  _colored.erase(std::unique(_colored.begin(), _colored.end()), _colored.end());
+
+  for (const int k : _colored)
+    appendIds(k, k+1, nei);
 }
 
 } // namespace Super4CS
-
-
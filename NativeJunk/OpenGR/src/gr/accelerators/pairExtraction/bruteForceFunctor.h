@@ -66,6 +66,10 @@ struct BruteForceFunctor{
   typedef _Scalar Scalar;
   enum { dim = _dim };
 
+  //! Nothing to precompute, see PairDistanceIndexFunctor
+  template <class PointContainer>
+  inline void initialize(const PointContainer& /*Q*/) {}
+
   template <class PrimitiveContainer,
             class PointContainer,
             class ProcessingFunctor> //!< Process the extracted pairs
@@ -0,0 +1,256 @@
+// Copyright 2020 Nicolas Mellado
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// -------------------------------------------------------------------------- //
+//
+// This file is part of the OpenGR library
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "gr/utils/scheduler.h"
+
+namespace gr{
+
+/*!
+  \brief Distances of all the pairs of a point set, sorted and bucketed.
+
+  The pairs are stored by increasing distance as a structure of arrays
+  (distance, first, second), and a CSR table gives the first pair of each
+  bucket of distances, so that the pairs at a given distance, up to epsilon,
+  are found by a direct lookup followed by a linear scan of the answer.
+
+  Building the index is quadratic in the number of points, so it pays off
+  when the same point set is queried for many distances, e.g. the sampled Q
+  explored by Super4PCS for many bases. Point indices are stored on _Index,
+  which bounds the number of points.
+  */
+template <typename _Scalar, typename _Index = uint16_t>
+class PairDistanceIndex
+{
+public:
+    typedef _Scalar Scalar;
+    typedef _Index  Index;
+
+    PairDistanceIndex() = default;
+
+    template <class PointContainer>
+    explicit PairDistanceIndex(const PointContainer& points) { build(points); }
+
+    //! Computes and sorts the distances of all the pairs of points
+    template <class PointContainer>
+    void build(const PointContainer& points);
+
+    inline size_t nbPoints() const { return mNbPoints; }
+    inline size_t size() const { return mDistances.size(); }
+
+    /*!
+     * \brief Calls f(i, j), with i > j, for each pair of points whose
+     * distance is in [distance-epsilon, distance+epsilon]
+     */
+    template <typename Functor>
+    inline void forEachPair(Scalar distance, Scalar epsilon, Functor f) const;
+
+private:
+    inline size_t bucketOf(Scalar d) const {
+        return (std::min)(mBucketStart.size() - 2,
+                          size_t((std::max)(d, Scalar(0)) * mInvBucketWidth));
+    }
+
+    size_t mNbPoints = 0;
+    std::vector<Scalar> mDistances;
+    std::vector<Index>  mFirst, mSecond;
+    //! First pair of each bucket of distances, CSR layout
+    std::vector<uint32_t> mBucketStart;
+    Scalar mInvBucketWidth = Scalar(1);
+};
+
+
+/*!
+  The distances are computed row by row in parallel, then sorted by a
+  counting sort over the buckets followed by a sort of each bucket. With
+  about four pairs per bucket, the overall cost stays close to linear in the
+  number of pairs. The distances in pair id order are released before the
+  points of the pairs are derived from their ids, to bound the peak memory.
+  */
+template <typename Scalar, typename Index>
+template <class PointContainer>
+void
+PairDistanceIndex<Scalar, Index>::build(const PointContainer& points)
+{
+    // Pair ids are stored on 32 bits, which also bounds the number of points
+    const size_t n = points.size();
+    if (n > size_t(std::numeric_limits<Index>::max()) + 1 || n > (size_t(1) << 16))
+        throw std::length_error("PairDistanceIndex: too many points");
+
+    mNbPoints = n;
+    const size_t nbPairs = n < 2 ? 0 : n * (n - 1) / 2;
+
+    // Pairs (i, j), j < i, of row i start at i * (i - 1) / 2
+    std::vector<Scalar> distances (nbPairs);
+    Utils::parallel_for(size_t(1), n, [&](size_t i){
+        Scalar* row = distances.data() + i * (i - 1) / 2;
+        for (size_t j = 0; j < i; ++j)
+            row[j] = (points[i] - points[j]).norm();
+    }, size_t(16));
+
+    const Scalar maxDistance = distances.empty() ?
+                Scalar(0) :
+                *std::max_element(distances.begin(), distances.end());
+    const size_t nbBuckets = (std::max)(size_t(1), nbPairs / 4);
+    mInvBucketWidth = maxDistance > Scalar(0) ?
+                Scalar(nbBuckets) / maxDistance :
+                Scalar(1);
+    mBucketStart.assign(nbBuckets + 2, 0);
+
+    // Counting sort by bucket, keeping the pair id
+    for (const Scalar d : distances)
+        mBucketStart[bucketOf(d) + 1]++;
+    for (size_t b = 0; b + 1 < mBucketStart.size(); ++b)
+        mBucketStart[b + 1] += mBucketStart[b];
+
+    std::vector<uint32_t> order (nbPairs);
+    {
+        std::vector<uint32_t> cursor (mBucketStart.begin(), mBucketStart.end() - 1);
+        for (size_t p = 0; p < nbPairs; ++p)
+            order[cursor[bucketOf(distances[p])]++] = uint32_t(p);
+    }
+    for (size_t b = 0; b + 1 < mBucketStart.size(); ++b)
+        std::sort(order.begin() + mBucketStart[b], order.begin() + mBucketStart[b + 1],
+                  [&distances](uint32_t a, uint32_t c){ return distances[a] < distances[c]; });
+
+    mDistances.resize(nbPairs);
+    for (size_t k = 0; k < nbPairs; ++k)
+        mDistances[k] = distances[order[k]];
+    std::vector<Scalar>().swap(distances);
+
+    // Pair p belongs to the last row i starting at or before it
+    const auto rowOf = [](size_t p) {
+        size_t i = size_t((1. + std::sqrt(1. + 8. * double(p))) / 2.);
+        while (i * (i - 1) / 2 > p) --i;
+        while ((i + 1) * i / 2 <= p) ++i;
+        return i;
+    };
+    mFirst.resize(nbPairs);
+    mSecond.resize(nbPairs);
+    Utils::parallel_for(size_t(0), nbPairs, [&](size_t k){
+        const size_t p = order[k];
+        const size_t i = rowOf(p);
+        mFirst [k] = Index(i);
+        mSecond[k] = Index(p - i * (i - 1) / 2);
+    }, size_t(4096));
+}
+
+template <typename Scalar, typename Index>
+template <typename Functor>
+void
+PairDistanceIndex<Scalar, Index>::forEachPair(Scalar distance,
+                                              Scalar epsilon,
+                                              Functor f) const
+{
+    if (mDistances.empty()) return;
+
+    const Scalar lo = distance - epsilon;
+    const Scalar hi = distance + epsilon;
+
+    size_t k = mBucketStart[bucketOf(lo)];
+    const size_t end = mDistances.size();
+    while (k < end && mDistances[k] < lo) ++k;
+    for (; k < end && mDistances[k] <= hi; ++k)
+        f(int(mFirst[k]), int(mSecond[k]));
+}
+
+
+//! \brief Extract pairs of points by a lookup in the sorted pair distances
+/*!
+ * The index is built once by initialize, for the points later given to
+ * process, and shared by the copies of the functor. The primitives only
+ * provide the pair distance, all of them having the same radius.
+ *
+ * \see IntersectionFunctor, BruteForceFunctor, PairDistanceIndex
+ */
+template <class _Primitive, class _Point, int _dim, typename _Scalar>
+struct PairDistanceIndexFunctor{
+  typedef _Point Point;
+  typedef _Primitive Primitive;
+  typedef _Scalar Scalar;
+  typedef PairDistanceIndex<_Scalar> IndexType;
+  enum { dim = _dim };
+
+  template <class PointContainer>
+  inline void initialize(const PointContainer& Q) {
+    _index = std::make_shared<const IndexType>(Q);
+  }
+
+  template <class PrimitiveContainer,
+            class PointContainer,
+            class ProcessingFunctor> //!< Process the extracted pairs
+  inline
+  void
+  process(
+    const PrimitiveContainer& M, //!< Input primitives, sharing the same radius
+    const PointContainer    & Q, //!< Input point set, indexed by initialize
+    Scalar &epsilon,              //!< Tolerance on the pair distance
+    unsigned int /*minNodeSize*/,
+    ProcessingFunctor& functor
+  ) const {
+    if (M.empty())
+      return;
+    processDistance(M.front().radius(), Q, epsilon, functor);
+  }
+
+  //! Same as process, for a pair distance given directly, so that the
+  //! caller does not need to set up the primitives
+  template <class PointContainer,
+            class ProcessingFunctor>
+  inline
+  void
+  processDistance(
+    Scalar distance,              //!< Pair distance
+    const PointContainer    & Q,  //!< Input point set, indexed by initialize
+    Scalar &epsilon,              //!< Tolerance on the pair distance
+    ProcessingFunctor& functor
+  ) const {
+    if (! _index || _index->nbPoints() != Q.size())
+      return;
+
+    _index->forEachPair(distance, epsilon, [&functor](int i, int j){
+      functor.process(i, j);
+    });
+  }
+
+private:
+  std::shared_ptr<const IndexType> _index;
+};
+
+//! True for the pair extraction engines which only need the pair distance,
+//! given to processDistance, instead of the radius of each primitive
+template <class PairExtractionEngine>
+struct IsDistanceOnlyExtraction : std::false_type {};
+
+template <class _Primitive, class _Point, int _dim, typename _Scalar>
+struct IsDistanceOnlyExtraction<PairDistanceIndexFunctor<_Primitive, _Point, _dim, _Scalar> >
+    : std::true_type {};
+
+} // namespace gr
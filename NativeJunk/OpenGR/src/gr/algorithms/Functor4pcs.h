@@ -37,10 +37,18 @@ namespace gr {
                         ,myBase_3D_(base_3D_)
                         ,myOptions_ (options) {}
 
+        /// Creates a functor bound to another base
+        inline Functor4PCS(const Functor4PCS& other, BaseCoordinates& base_3D_)
+                        :Functor4PCS(other.mySampled_Q_3D_, base_3D_, other.myOptions_) {}
+
         /// Initializes the data structures and needed values before the match
         /// computation.
         inline void Initialize() {}
 
+        /// Same as Initialize, for a Q prepared beforehand
+        template <typename Cloud>
+        inline void Initialize(const Cloud& /*preparedQ*/) {}
+
         /// Finds congruent candidates in the set Q, given the invariants and threshold distances.
         /// Returns true if a non empty set can be found, false otherwise.
         /// @param invariant1 [in] The first invariant corresponding to the set P_pairs
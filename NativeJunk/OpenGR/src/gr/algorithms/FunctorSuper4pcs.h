@@ -5,8 +5,10 @@
 #pragma once
 
 #include <vector>
+#include <memory>
 #include "gr/utils/shared.h"
 #include "gr/algorithms/pairCreationFunctor.h"
+#include "gr/accelerators/pairExtraction/pairDistanceIndex.h"
 
 #ifdef SUPER4PCS_USE_CHEALPIX
 #include "gr/accelerators/normalHealSet.h"
@@ -26,8 +28,12 @@ namespace gr {
     /// \see Match4pcsBase
     /// \tparam PairFilterFunctor filters pairs of points during the exploration.
     ///         Must implement PairFilterConcept
-    template <typename PointType, typename PointFilterFunctor, typename Options>
-    struct FunctorSuper4PCS {
+    /// \tparam PairExtractionFunctor extracts the pairs of Q at a given
+    ///         distance: IntersectionFunctor, BruteForceFunctor or
+    ///         PairDistanceIndexFunctor.
+    template <typename PointType, typename PointFilterFunctor, typename Options,
+              template <class, class, int, typename> class PairExtractionFunctor>
+    struct BasicFunctorSuper4PCS {
     public :
         using BaseCoordinates = typename Traits4pcs<PointType>::Coordinates;
         using Scalar      = typename PointType::Scalar;
@@ -35,27 +41,100 @@ namespace gr {
         using VectorType  = typename PointType::VectorType;
         using OptionType  = Options;
         using PairCreationFunctorType = PairCreationFunctor<PointType, Scalar, PointFilterFunctor, OptionType>;
+        using PairExtractionType = PairExtractionFunctor
+                    <typename PairCreationFunctorType::Primitive,
+                     typename PairCreationFunctorType::Point, 3, Scalar>;
+#ifdef SUPER4PCS_USE_CHEALPIX
+        using IndexedNormalSet3D = gr::IndexedNormalHealSet;
+#else
+        using IndexedNormalSet3D = gr::IndexedNormalSet
+                < typename PairCreationFunctorType::Point, //! \brief Point type used internally
+                  3,       //! \brief Nb dimension
+                  7,       //! \brief Nb cells/dim normal
+                  Scalar>; //! \brief Scalar type
+#endif
 
 
     private :
+        /// Runs the pair extraction on the primitives, set to the radius
+        /// pair_distance
+        inline void extractPairs(Scalar pair_distance, Scalar& eps,
+                                 std::false_type /*distanceOnly*/) const {
+            pcfunctor_.setRadius(pair_distance);
+            extraction_.process(pcfunctor_.primitives,
+                                 pcfunctor_.points,
+                                 eps,
+                                 50,
+                                 pcfunctor_);
+        }
+
+        /// Same, for the engines which only need the pair distance: the
+        /// primitives are left untouched
+        inline void extractPairs(Scalar pair_distance, Scalar& eps,
+                                 std::true_type /*distanceOnly*/) const {
+            extraction_.processDistance(pcfunctor_.getNormalizedDistance(pair_distance),
+                                        pcfunctor_.points,
+                                        eps,
+                                        pcfunctor_);
+        }
+
+        /// State derived from the samples of Q, see Initialize(const Cloud&)
+        struct SharedState {
+            typename PairCreationFunctorType::UnitContent content;
+            PairExtractionType extraction;
+        };
+
         std::vector<PointType> &mySampled_Q_3D_;
         BaseCoordinates &myBase_3D_;
 
         mutable PairCreationFunctorType pcfunctor_;
+        mutable PairExtractionType extraction_;
+#ifndef SUPER4PCS_USE_CHEALPIX
+        /// Reset for each base, so that its storage is reused
+        mutable IndexedNormalSet3D nset_ {Scalar(1)};
+#endif
+        /// Buffers of FindCongruentQuadrilaterals, reused for each base
+        mutable std::vector< std::pair<unsigned int, unsigned int> > comb_;
+        mutable std::vector<unsigned int> combStart_, combOrder_, nei_;
 
 
     public :
-        inline FunctorSuper4PCS (std::vector<PointType> &sampled_Q_3D_,
+        inline BasicFunctorSuper4PCS (std::vector<PointType> &sampled_Q_3D_,
                                BaseCoordinates& base_3D_,
                                const OptionType& options)
                                 :mySampled_Q_3D_(sampled_Q_3D_)
                                 ,myBase_3D_(base_3D_)
                                 ,pcfunctor_ (options,mySampled_Q_3D_){}
 
+        /// Creates a functor bound to another base, sharing the data
+        /// initialized by other.
+        inline BasicFunctorSuper4PCS (const BasicFunctorSuper4PCS& other,
+                                      BaseCoordinates& base_3D_)
+                                :mySampled_Q_3D_(other.mySampled_Q_3D_)
+                                ,myBase_3D_(base_3D_)
+                                ,pcfunctor_ (other.pcfunctor_)
+                                ,extraction_(other.extraction_){}
+
         /// Initializes the data structures and needed values before the match
         /// computation.
         inline void Initialize() {
             pcfunctor_.synch3DContent();
+            extraction_.initialize(pcfunctor_.points);
+        }
+
+        /// Same as Initialize, for a Q prepared beforehand: the normalized
+        /// samples and the pair extraction index are computed by the first
+        /// registration of the cloud as Q, and shared with the next ones.
+        template <typename Cloud>
+        inline void Initialize(const Cloud& preparedQ) {
+            const auto state = preparedQ.template derived<SharedState>(
+                        mySampled_Q_3D_.size(), [this] {
+                Initialize();
+                return std::make_shared<const SharedState>(
+                            SharedState { pcfunctor_.unitContent(), extraction_ });
+            });
+            pcfunctor_.synch3DContent(state->content);
+            extraction_ = state->extraction;
         }
 
 
@@ -85,25 +164,12 @@ namespace gr {
             pcfunctor_.pair_distance         = pair_distance;
             pcfunctor_.pair_distance_epsilon = pair_distance_epsilon;
             pcfunctor_.pair_normals_angle    = pair_normals_angle;
-            pcfunctor_.setRadius(pair_distance);
             pcfunctor_.setBase(base_point1, base_point2, myBase_3D_);
 
-#ifdef MULTISCALE
-            BruteForceFunctor
-  <typename PairCreationFunctorType::Primitive, typename PairCreationFunctorType::Point, 3, Scalar> interFunctor;
-#else
-            IntersectionFunctor
-                    <typename PairCreationFunctorType::Primitive,
-                     typename PairCreationFunctorType::Point, 3, Scalar> interFunctor;
-#endif
-
             Scalar eps = pcfunctor_.getNormalizedEpsilon(pair_distance_epsilon);
 
-            interFunctor.process(pcfunctor_.primitives,
-                                 pcfunctor_.points,
-                                 eps,
-                                 50,
-                                 pcfunctor_);
+            extractPairs(pair_distance, eps,
+                         IsDistanceOnlyExtraction<PairExtractionType>());
         }
 
         /// Finds congruent candidates in the set Q, given the invariants and threshold
@@ -130,18 +196,6 @@ namespace gr {
 
             typedef typename PairCreationFunctorType::Point Point;
 
-#ifdef SUPER4PCS_USE_CHEALPIX
-            typedef gr::IndexedNormalHealSet IndexedNormalSet3D;
-#else
-            typedef  gr::IndexedNormalSet
-                    < Point,   //! \brief Point type used internally
-                            3,       //! \brief Nb dimension
-                            7,       //! \brief Nb cells/dim normal
-                            Scalar>  //! \brief Scalar type
-                    IndexedNormalSet3D;
-#endif
-
-
             if (quadrilaterals == nullptr) return false;
 
             quadrilaterals->clear();
@@ -154,7 +208,12 @@ namespace gr {
             // 1. Datastructure construction
             const Scalar eps = pcfunctor_.getNormalizedEpsilon(distance_threshold2);
 
+#ifdef SUPER4PCS_USE_CHEALPIX
             IndexedNormalSet3D nset (eps);
+#else
+            IndexedNormalSet3D& nset = nset_;
+            nset.reset(eps);
+#endif
 
             for (size_t i = 0; i <  First_pairs.size(); ++i) {
                 const Point& p1 = pcfunctor_.points[First_pairs[i].first];
@@ -165,9 +224,11 @@ namespace gr {
             }
 
 
-            std::set< std::pair<unsigned int, unsigned int > > comb;
+            // Matching couples (id, i), produced by increasing i
+            std::vector< std::pair<unsigned int, unsigned int> >& comb = comb_;
+            comb.clear();
 
-            std::vector<unsigned int> nei;
+            std::vector<unsigned int>& nei = nei_;
             // 2. Query time
             for (unsigned int i = 0; i < Second_pairs.size(); ++i) {
                 const Point& p1 = pcfunctor_.points[Second_pairs[i].first];
@@ -198,23 +259,53 @@ namespace gr {
 
                     // use also distance_threshold2 for inv 1 and 2 in 4PCS
                     if ((queryQ-invPoint).squaredNorm() <= distance_threshold2){
-                        comb.emplace(id, i);
+                        comb.emplace_back(id, i);
                     }
                 }
             }
 
-            for (std::set< std::pair<unsigned int, unsigned int>>::const_iterator it = comb.cbegin();
-                    it != comb.cend(); it++) {
-                const unsigned int & id = (*it).first;
-                const unsigned int & i  = (*it).second;
-
-                quadrilaterals->push_back( {First_pairs[id].first, First_pairs[id].second,
-                                             Second_pairs[i].first,  Second_pairs[i].second });
+            // 3. Output, ordered by (id, i): couples are bucketed by id with a
+            // counting sort, which keeps them sorted by i within each bucket
+            std::vector<unsigned int>& start = combStart_;
+            std::vector<unsigned int>& order = combOrder_;
+            start.assign(First_pairs.size() + 1, 0);
+            for (const auto& c : comb) ++start[c.first + 1];
+            for (size_t id = 0; id != First_pairs.size(); ++id) start[id + 1] += start[id];
+            order.resize(comb.size());
+            for (const auto& c : comb) order[start[c.first]++] = c.second;
+
+            quadrilaterals->reserve(comb.size());
+            unsigned int k = 0;
+            for (size_t id = 0; id != First_pairs.size(); ++id) {
+                const unsigned int end = start[id];
+                for (unsigned int first = k; k != end; ++k) {
+                    const unsigned int i = order[k];
+                    if (k != first && order[k - 1] == i) continue; // duplicate
+                    quadrilaterals->push_back( {First_pairs[id].first, First_pairs[id].second,
+                                                 Second_pairs[i].first,  Second_pairs[i].second });
+                }
             }
 
             return quadrilaterals->size() != 0;
         }
 
     };
+
+    /// Super4PCS, extracting pairs by rasterizing spheres over an octree
+    template <typename PointType, typename PointFilterFunctor, typename Options>
+    using FunctorSuper4PCS = BasicFunctorSuper4PCS<PointType, PointFilterFunctor, Options,
+#ifdef MULTISCALE
+                                                   BruteForceFunctor
+#else
+                                                   IntersectionFunctor
+#endif
+                                                   >;
+
+    /// Super4PCS, extracting pairs from the sorted distances of all the pairs
+    /// of Q, computed once per registration. Faster for small sample sizes,
+    /// limited to 65536 samples.
+    template <typename PointType, typename PointFilterFunctor, typename Options>
+    using FunctorSuper4PCSPairIndex =
+        BasicFunctorSuper4PCS<PointType, PointFilterFunctor, Options, PairDistanceIndexFunctor>;
 }
 
@@ -105,41 +105,44 @@ struct PairFilterConcept {
 
                 if (first_norm_distance > norm_threshold) return res;
             }
-            // Verify restriction on the rotation angle, translation and colors.
+            // Verify restriction on the rotation angle, translation and colors,
+            // for each order of the pair: res.second matches p with b0 and q
+            // with b1, res.first matches q with b0 and p with b1.
+            res.first = true;
+            res.second = true;
             if (options.max_color_distance > 0) {
                 const bool use_rgb = (p.rgb()[0] >= 0 && q.rgb()[0] >= 0 &&
                                       b0.rgb()[0] >= 0 &&
                                       b1.rgb()[0] >= 0);
-                bool color_good = (p.rgb() - b0.rgb()).norm() <
-                                  options.max_color_distance &&
-                                  (q.rgb() - b1.rgb()).norm() <
-                                  options.max_color_distance;
-
-                if (use_rgb && ! color_good) return res;
+                if (use_rgb) {
+                    res.second = res.second &&
+                                 (p.rgb() - b0.rgb()).norm() < options.max_color_distance &&
+                                 (q.rgb() - b1.rgb()).norm() < options.max_color_distance;
+                    res.first  = res.first &&
+                                 (q.rgb() - b0.rgb()).norm() < options.max_color_distance &&
+                                 (p.rgb() - b1.rgb()).norm() < options.max_color_distance;
+                }
             }
 
             if (options.max_translation_distance > 0) {
-                const bool dist_good = (p.pos() - b0.pos()).norm() <
-                                       options.max_translation_distance &&
-                                       (q.pos() - b1.pos()).norm() <
-                                       options.max_translation_distance;
-                if (! dist_good) return res;
+                res.second = res.second &&
+                             (p.pos() - b0.pos()).norm() < options.max_translation_distance &&
+                             (q.pos() - b1.pos()).norm() < options.max_translation_distance;
+                res.first  = res.first &&
+                             (q.pos() - b0.pos()).norm() < options.max_translation_distance &&
+                             (p.pos() - b1.pos()).norm() < options.max_translation_distance;
             }
 
             // need cleaning here
             if (options.max_angle > 0){
                 VectorType segment2 = (q.pos() - p.pos()).normalized();
-                if (std::acos(segment1.dot(segment2)) <= options.max_angle * M_PI / 180.0) {
-                    res.second = true;
+                if (! (std::acos(segment1.dot(segment2)) <= options.max_angle * M_PI / 180.0)) {
+                    res.second = false;
                 }
 
-                if (std::acos(segment1.dot(- segment2)) <= options.max_angle * M_PI / 180.0) {
-                    // Add ordered pair.
-                    res.first = true;
+                if (! (std::acos(segment1.dot(- segment2)) <= options.max_angle * M_PI / 180.0)) {
+                    res.first = false;
                 }
-            }else {
-                res.first = true;
-                res.second = true;
             }
             return res;
         }
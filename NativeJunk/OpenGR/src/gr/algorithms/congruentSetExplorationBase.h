@@ -44,10 +44,11 @@
 #pragma once
 
 #include <vector>
-
-#ifdef OpenGR_USE_OPENMP
-#include <omp.h>
-#endif
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
 
 #include "gr/utils/shared.h"
 #include "gr/algorithms/matchBase.h"
@@ -74,6 +75,46 @@ public:
     }
     inline Scalar getTerminateThreshold() const { return terminate_threshold; }
     inline Scalar getOverlapEstimation()  const { return overlap_estimation; }
+
+    /// Number of threads exploring RANSAC bases concurrently. Each thread owns
+    /// its random generator and pair extraction state, and they share the best
+    /// LCP found so far. Values lower than 2 keep the sequential exploration.
+    int nb_exploration_threads = 1;
+
+    /// Pose prior: guess of the transformation bringing Q onto P, and bounds
+    /// on its correction. When both bounds are non negative, the candidate
+    /// transformations must rotate Q by less than pose_prior_max_angle
+    /// (degrees) relative to the guess, and move the centroid of Q less than
+    /// pose_prior_max_translation away from where the guess brings it. The
+    /// bases are then drawn where P overlaps Q under the guess, and their
+    /// pairs are only searched around their position predicted by the guess.
+    Eigen::Matrix<Scalar, 4, 4> pose_prior = Eigen::Matrix<Scalar, 4, 4>::Identity();
+    Scalar pose_prior_max_angle = -1;
+    Scalar pose_prior_max_translation = -1;
+
+    /// Re-estimates the number of trials each time the best LCP improves,
+    /// taking the LCP as the inlier ratio of the RANSAC bound, so that a good
+    /// alignment found early ends the exploration. The number of trials
+    /// estimated from the overlap remains an upper bound.
+    bool adaptive_trials = false;
+
+    /// Estimates the overlap before the exploration, as the fraction of the
+    /// samples of Q moved by pose_prior (the identity by default, for sets
+    /// roughly aligned beforehand) that fall next to a voxel occupied by P.
+    /// The estimate replaces the overlap estimation of the options for the
+    /// current registration when it is larger, the options being unchanged.
+    bool estimate_overlap = false;
+
+    /// Size of the random subset of Q scoring the candidate transformations
+    /// of a congruent set before their full verification, 0 to verify them
+    /// all. The candidates are then verified by decreasing subset score, and
+    /// skipped when their subset score is too low for their LCP to exceed the
+    /// best LCP, see CongruentSetExplorationBase::isSubsetScorePromising.
+    int verification_subset_size = 0;
+
+    inline bool hasPosePrior() const {
+        return pose_prior_max_angle >= 0 && pose_prior_max_translation >= 0;
+    }
 private:
     /// Threshold on the value of the target function (LCP, see the paper).
     /// It is used to terminate the process once we reached this value.
@@ -111,6 +152,13 @@ public:
     using VectorType = typename MatchBaseType::VectorType;
     using MatrixType = typename MatchBaseType::MatrixType;
     static constexpr Scalar kLargeNumber = 1e9;
+    /// Probability to miss a base made of inliers after the trials
+    static constexpr Scalar kSmallError = 0.00001;
+    static constexpr int kMinNumberOfTrials = 4;
+    /// Size of the voxels used to estimate the overlap, relative to delta
+    static constexpr Scalar kOverlapVoxelFactor = 4;
+    /// Margin, in standard deviations, of the test of the subset scores
+    static constexpr Scalar kSubsetScoreMargin = 3;
     static constexpr Scalar distance_factor = 2.0;
 
     using LogLevel = typename MatchBaseType::LogLevel;
@@ -122,6 +170,14 @@ public:
 
 #endif
 
+#ifdef OPENGR_USE_HASH_GRID
+    /// Fixed-radius hash grid on P, with cells of size delta
+    using VerificationAccelerator = gr::HashGrid<Scalar>;
+#else
+    /// Reuse the KdTree of MatchBase
+    using VerificationAccelerator = gr::KdTree<Scalar>;
+#endif
+
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
 
@@ -148,6 +204,55 @@ public:
                                  const Sampler<_PointType>& sampler,
                                  TransformVisitor& v);
 
+    /// Prepares the registration of Q onto P without exploring any base, so
+    /// that the exploration can then be run in slices with Perform_N_steps.
+    /// ComputeTransformation is equivalent to PrepareTransformation followed by
+    /// Perform_N_steps(getNumberOfTrials(), ...).
+    /// @return false if no exploration is needed (empty input sets, or the
+    /// initial transformation already realizes the best possible LCP).
+    template <typename InputRange1,
+              typename InputRange2,
+              template<typename> class Sampler>
+    bool PrepareTransformation(const InputRange1& P,
+                               const InputRange2& Q,
+                               const Sampler<_PointType>& sampler);
+
+    /// Prepares the registration of Q onto P from clouds sampled and indexed
+    /// beforehand, see PrepareTransformation and PreparedCloud.
+    bool PrepareTransformation(const PreparedCloud<_PointType>& P,
+                               const PreparedCloud<_PointType>& Q);
+
+    /// Computes the registration of Q onto P from clouds sampled and indexed
+    /// beforehand, see ComputeTransformation and PreparedCloud.
+    Scalar ComputeTransformation(const PreparedCloud<_PointType>& P,
+                                 const PreparedCloud<_PointType>& Q,
+                                 Eigen::Ref<MatrixType> transformation,
+                                 TransformVisitor& v);
+
+    /// Performs n RANSAC iterations, each one of them containing base selection,
+    /// finding congruent sets and verification. Returns true if the process can be
+    /// terminated (the target LCP was obtained or the maximum number of trials has
+    /// been reached), false otherwise.
+    bool Perform_N_steps(int n,
+                         Eigen::Ref<MatrixType> transformation,
+                         TransformVisitor& v);
+
+    /// Same as above, but stops before the n iterations are performed as soon
+    /// as \p interrupt returns true. \p interrupt is checked before each
+    /// iteration by all the exploration threads, so it must be thread safe.
+    /// The interrupted iterations are left to the next calls.
+    bool Perform_N_steps(int n,
+                         Eigen::Ref<MatrixType> transformation,
+                         TransformVisitor& v,
+                         const std::function<bool()>& interrupt);
+
+    /// Number of RANSAC iterations estimated by PrepareTransformation
+    inline int getNumberOfTrials() const { return number_of_trials_; }
+    /// Number of RANSAC iterations performed so far
+    inline int getCurrentTrial() const { return current_trial_; }
+    /// Best LCP found so far
+    inline Scalar getBestLCP() const { return best_LCP_; }
+
     /// Tries to compute an inital base from P
     /// @param [out] base The base, if found. Initial value is not used. Modified as
     /// the computed base if the return value is true.
@@ -155,13 +260,48 @@ public:
     virtual bool initBase (CongruentBaseType &base) = 0;
 
 protected:
+    /// Candidate transformation of a congruent quad, with its subset score,
+    /// see TryCongruentSet
+    struct Candidate {
+        MatrixType transform;
+        VectorType centroid2;
+        Scalar score;
+        int index;
+    };
+    using CandidateVector = std::vector<Candidate, Eigen::aligned_allocator<Candidate> >;
+
+    /// State owned by a single thread when several bases are explored
+    /// concurrently (see CongruentSetExplorationOptions::nb_exploration_threads).
+    /// Derived classes extend it with their own base selection and pair
+    /// extraction state.
+    struct ExplorationContext {
+        virtual ~ExplorationContext() {}
+        /// Random generator used to select the bases explored by this thread
+        std::mt19937 randomGenerator;
+        /// Congruent set of the current base, reused from one base to the next
+        Set congruent_set;
+        /// Candidates of the current base, reused from one base to the next
+        CandidateVector candidates;
+    };
+
     /// Maximum base diameter. It is computed automatically from the diameter of
     /// P and the estimated overlap and used to limit the distance between the
     /// points in the base in P so that the probability to have all points in
     /// the base as inliers is increased.
     Scalar max_base_diameter_ {Scalar( -1 )};
-    /// Number of trials. Every trial picks random base from P.
-    int number_of_trials_;
+    /// Overlap estimation and terminate threshold of the current registration:
+    /// the ones of the options, raised by estimate_overlap.
+    Scalar overlap_estimation_ {Scalar( 0 )};
+    Scalar terminate_threshold_ {Scalar( 1 )};
+    /// Guess of the pose prior in the centered frames of P and Q, see
+    /// CongruentSetExplorationOptions::pose_prior
+    Eigen::Matrix<Scalar, 3, 3> prior_rotation_ {Eigen::Matrix<Scalar, 3, 3>::Identity()};
+    VectorType prior_translation_ {VectorType::Zero()};
+    /// Length of the chord of pose_prior_max_angle on the unit circle
+    Scalar prior_chord_ {Scalar( 0 )};
+    /// Number of trials. Every trial picks random base from P. Lowered during
+    /// the exploration with CongruentSetExplorationOptions::adaptive_trials.
+    std::atomic<int> number_of_trials_;
     /// The points in the base (indices to P). It is being updated in every
     /// RANSAC iteration.
     CongruentBaseType base_;
@@ -171,15 +311,33 @@ protected:
     CongruentBaseType current_congruent_;
     /// The 3D points of the base.
     Coordinates base_3D_;
+    /// Structure of arrays copy of sampled_Q_3D_, used to verify the
+    /// candidate transformations by blocks of points.
+    Utils::BatchedPointSet<Scalar> batched_Q_3D_;
+    /// Random subset of sampled_Q_3D_ scoring the candidate transformations
+    /// before their verification, see verification_subset_size.
+    Utils::BatchedPointSet<Scalar> subset_Q_3D_;
+#ifdef OPENGR_USE_HASH_GRID
+    /// Hash grid used to compute the LCP, built on sampled P.
+    VerificationAccelerator hash_grid_;
+#endif
     /// The best LCP (Largest Common Point) fraction so far.
-    Scalar best_LCP_;
+    std::atomic<Scalar> best_LCP_;
     /// Current trial.
     int current_trial_;
-
-#ifdef OpenGR_USE_OPENMP
-    /// number of threads used to verify the congruent set
-    const int omp_nthread_congruent_;
-#endif
+    /// States of the exploration threads, built by initExploration when
+    /// nb_exploration_threads > 1 and kept for all the calls of Perform_N_steps.
+    /// Empty when the derived class does not provide exploration contexts.
+    std::vector<std::unique_ptr<ExplorationContext>> exploration_contexts_;
+    /// Candidates of the base explored by the calling thread, reused from one
+    /// base to the next, see ExplorationContext::candidates
+    CandidateVector candidates_;
+    /// Protects the best solution (base_, current_congruent_, transform_ and
+    /// centroids) and the visitor when congruent sets are verified concurrently.
+    std::mutex best_mutex_;
+
+    /// Number of congruent quads verified by a task of TryCongruentSet
+    static constexpr int kCongruentGrain = 8;
 
 #ifdef TEST_GLOBAL_TIMINGS
 
@@ -192,22 +350,57 @@ protected:
 #endif
 
 protected :
-    /// Performs n RANSAC iterations, each one of them containing base selection,
-    /// finding congruent sets and verification. Returns true if the process can be
-    /// terminated (the target LCP was obtained or the maximum number of trials has
-    /// been reached), false otherwise.
-    bool Perform_N_steps(int n,
-                         Eigen::Ref<MatrixType> transformation,
-                         TransformVisitor& v);
+    /// Resets the exploration state, before MatchBase::init
+    void resetExploration();
+    /// Builds the verification structures, estimates the number of trials and
+    /// computes the initial LCP, after MatchBase::init. Returns false if no
+    /// exploration is needed.
+    bool initExploration();
+    /// Fraction of the samples of Q overlapping P under the guess of the pose
+    /// prior, see CongruentSetExplorationOptions::estimate_overlap
+    Scalar estimateOverlap() const;
+    /// Lowers the number of trials to the number needed to draw a base of
+    /// inliers with probability 1 - kSmallError, when a fraction lcp of Q are
+    /// inliers. Does nothing unless adaptive_trials is set. Must be called
+    /// under best_mutex_ during the exploration.
+    void adaptNumberOfTrials(Scalar lcp);
     /// Tries one base and finds the best transformation for this base.
     /// Returns true if the achieved LCP is greater than terminate_threshold_,
     /// else otherwise.
     bool TryOneBase(TransformVisitor &v);
 
+    /// Performs the trials [first_trial, last_trial[ using the exploration
+    /// contexts, each thread exploring its own bases until \p interrupt returns
+    /// true. Returns true if the target LCP was obtained, false otherwise, and
+    /// the number of performed trials in \p nb_trials. Falls back to the
+    /// sequential exploration when there is no exploration context.
+    bool TryBasesConcurrently(int first_trial, int last_trial,
+                              Eigen::Ref<MatrixType> transformation,
+                              TransformVisitor &v,
+                              const std::function<bool()>& interrupt,
+                              int &nb_trials);
+
+    /// Largest distance between the images by the pose prior and by an accepted
+    /// transformation of a point of Q at distance \p norm from the centroid of Q
+    inline Scalar priorRadius(Scalar norm) const {
+        return MatchBaseType::options_.pose_prior_max_translation + prior_chord_ * norm;
+    }
+
+    /// Checks a transformation between the centered sets against the bounds
+    /// of the pose prior. Always true without pose prior.
+    bool isWithinPosePrior(const Eigen::Ref<const MatrixType>& mat) const;
+
+    /// One sided binomial test of a subset score against the best LCP: false
+    /// when the LCP of the candidate is very unlikely to exceed the best LCP,
+    /// as its subset score is kSubsetScoreMargin standard deviations below it.
+    bool isSubsetScorePromising(Scalar score) const;
+
     /// Loop over the set of congruent 4-points and test the compatibility with the
     /// input base.
+    /// \param candidates Buffer of the candidates, reused from one base to the next
     /// \param [out] Nb Number of quads corresponding to valid configurations
-    bool TryCongruentSet(CongruentBaseType& base, Set& set, TransformVisitor &v,size_t &nbCongruent);
+    bool TryCongruentSet(CongruentBaseType& base, Set& set, CandidateVector& candidates,
+                         TransformVisitor &v,size_t &nbCongruent);
 
     const CongruentBaseType& base3D() const { return base_3D_; }
 
@@ -217,12 +410,37 @@ protected :
     /// \param congruent_set a set of all point congruent found in Q.
     virtual bool generateCongruents (CongruentBaseType& base,Set& congruent_set) = 0;
 
+    /// Creates the state needed to explore bases from a worker thread, using
+    /// \p seed to initialize its random generator. Returns nullptr when the
+    /// algorithm does not support concurrent exploration.
+    virtual std::unique_ptr<ExplorationContext> makeExplorationContext (unsigned int /*seed*/)
+    { return nullptr; }
+
+    /// Same as generateCongruents(CongruentBaseType&, Set&), but only reads and
+    /// writes the state stored in \p context, so it can be called concurrently.
+    virtual bool generateCongruents (CongruentBaseType& /*base*/,
+                                     Set& /*congruent_set*/,
+                                     ExplorationContext& /*context*/)
+    { return false; }
+
     /// For each randomly picked base, verifies the computed transformation by
     /// computing the number of points that this transformation brings near points
     /// in Q. Returns the current LCP. R is the rotation matrix, (tx,ty,tz) is
     /// the translation vector and (cx,cy,cz) is the center of transformation.template <class MatrixDerived>
     Scalar Verify(const Eigen::Ref<const MatrixType> & mat) const;
 
+    /// Same as Verify, on the points of subset_Q_3D_ and without early exit.
+    Scalar VerifySubset(const Eigen::Ref<const MatrixType> & mat) const;
+
+    /// Accelerator used to compute the LCP
+    inline const VerificationAccelerator& verificationAccelerator() const {
+#ifdef OPENGR_USE_HASH_GRID
+        return hash_grid_;
+#else
+        return *MatchBaseType::kd_tree_;
+#endif
+    }
+
 }; /// class MatchBaseType
 } /// namespace gr
 #include "congruentSetExplorationBase.hpp"
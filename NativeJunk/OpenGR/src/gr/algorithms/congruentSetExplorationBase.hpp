@@ -2,16 +2,21 @@
 // Created by Sandra Alfaro on 24/05/18.
 //
 
+#include <algorithm>
+#include <cmath>
 #include <iterator>
+#include <limits>
+#include <numeric>
 #include <vector>
 #include <atomic>
 #include <chrono>
-
-#ifdef OpenGR_USE_OPENMP
-#include <omp.h>
-#endif
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <unordered_set>
 
 #include "gr/utils/shared.h"
+#include "gr/utils/scheduler.h"
 #include "gr/utils/sampling.h"
 #include "gr/accelerators/kdtree.h"
 #include "gr/utils/logger.h"
@@ -39,9 +44,6 @@ template <typename Traits, typename PointType, typename TransformVisitor,
     : MatchBaseType(options, logger)
     , number_of_trials_(0)
     , best_LCP_(0.0)
-    #ifdef OpenGR_USE_OPENMP
-    , omp_nthread_congruent_(1)
-    #endif
 //    , options_(options)
 {}
 
@@ -64,9 +66,6 @@ CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFu
         Eigen::Ref<typename CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::MatrixType> transformation,
         const Sampler<PointType>& sampler,
         TransformVisitor& v) {
-  const Scalar kSmallError = 0.00001;
-  const int kMinNumberOfTrials = 4;
-  const Scalar kDiameterFraction = 0.3;
 
 #ifdef TEST_GLOBAL_TIMINGS
     totalTime  = 0;
@@ -75,51 +74,274 @@ CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFu
 
   if (internal::is_range_empty(P) || internal::is_range_empty(Q)) return kLargeNumber;
 
-  // RANSAC probability and number of needed trials.
-  Scalar first_estimation =
-          std::log(kSmallError) / std::log(1.0 - pow(MatchBaseType::options_.getOverlapEstimation(),
-                                                     static_cast<Scalar>(kMinNumberOfTrials)));
-  // We use a simple heuristic to elevate the probability to a reasonable value
-  // given that we don't simply sample from P, but instead, we bound the
-  // distance between the points in the base as a fraction of the diameter.
-  number_of_trials_ =
-          static_cast<int>(first_estimation * (MatchBaseType::P_diameter_ / kDiameterFraction) /
-                           max_base_diameter_);
-  if (number_of_trials_ < kMinNumberOfTrials)
-      number_of_trials_ = kMinNumberOfTrials;
+  if (PrepareTransformation(P, Q, sampler))
+    Perform_N_steps(number_of_trials_, transformation, v);
+
+#ifdef TEST_GLOBAL_TIMINGS
+  MatchBaseType::template Log<LogLevel::Verbose>( "----------- Timings (msec) -------------" );
+  MatchBaseType::template Log<LogLevel::Verbose>( " Total computation time  : ", totalTime   );
+  MatchBaseType::template Log<LogLevel::Verbose>( " Total verify time       : ", verifyTime  );
+  MatchBaseType::template Log<LogLevel::Verbose>( "----------------------------------------" );
+#endif
 
+  return best_LCP_;
+}
+
+
+template <typename Traits, typename PointType, typename TransformVisitor,
+          typename PairFilteringFunctor,
+          template < class, class > class ... OptExts >
+typename CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::Scalar
+CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::ComputeTransformation(
+        const PreparedCloud<PointType>& P,
+        const PreparedCloud<PointType>& Q,
+        Eigen::Ref<typename CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::MatrixType> transformation,
+        TransformVisitor& v) {
+  if (P.empty() || Q.empty()) return kLargeNumber;
+
+  if (PrepareTransformation(P, Q))
+    Perform_N_steps(number_of_trials_, transformation, v);
+
+  return best_LCP_;
+}
+
+
+// Samples the input sets, builds the acceleration structures and estimates the
+// number of RANSAC iterations.
+template <typename Traits, typename PointType, typename TransformVisitor,
+          typename PairFilteringFunctor,
+          template < class, class > class ... OptExts >
+template <typename InputRange1, typename InputRange2, template<typename> class Sampler>
+bool
+CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::PrepareTransformation(
+        const InputRange1& P,
+        const InputRange2& Q,
+        const Sampler<PointType>& sampler) {
+  if (internal::is_range_empty(P) || internal::is_range_empty(Q)) return false;
+
+  resetExploration();
+  MatchBaseType::init(P, Q, sampler);
+  return initExploration();
+}
+
+
+template <typename Traits, typename PointType, typename TransformVisitor,
+          typename PairFilteringFunctor,
+          template < class, class > class ... OptExts >
+bool
+CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::PrepareTransformation(
+        const PreparedCloud<PointType>& P,
+        const PreparedCloud<PointType>& Q) {
+  if (P.empty() || Q.empty()) return false;
+
+  resetExploration();
+  MatchBaseType::init(P, Q);
+  return initExploration();
+}
+
+
+template <typename Traits, typename PointType, typename TransformVisitor,
+          typename PairFilteringFunctor,
+          template < class, class > class ... OptExts >
+void
+CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::resetExploration() {
   MatchBaseType::template Log<LogLevel::Verbose>( "norm_max_dist: ", MatchBaseType::options_.delta );
   current_trial_ = 0;
   best_LCP_ = 0.0;
+  exploration_contexts_.clear();
 
   for (int i = 0; i < Traits::size(); ++i) {
       base_[i] = 0;
       current_congruent_[i] = 0;
   }
+}
 
-  MatchBaseType::init(P, Q, sampler);
+
+template <typename Traits, typename PointType, typename TransformVisitor,
+          typename PairFilteringFunctor,
+          template < class, class > class ... OptExts >
+bool
+CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::initExploration() {
+  batched_Q_3D_.set(MatchBaseType::sampled_Q_3D_);
+  {
+    const size_t subset_size = size_t((std::max)(MatchBaseType::options_.verification_subset_size, 0));
+    std::vector<PosMutablePoint> subset;
+    if (subset_size != 0 && subset_size < MatchBaseType::sampled_Q_3D_.size()) {
+      std::vector<int> indices (MatchBaseType::sampled_Q_3D_.size());
+      std::iota( std::begin(indices), std::end(indices), 0 );
+      std::shuffle(indices.begin(), indices.end(), MatchBaseType::randomGenerator_);
+      for (size_t i = 0; i != subset_size; ++i)
+        subset.push_back(MatchBaseType::sampled_Q_3D_[indices[i]]);
+    }
+    subset_Q_3D_.set(subset);
+  }
+#ifdef OPENGR_USE_HASH_GRID
+  hash_grid_ = VerificationAccelerator( MatchBaseType::options_.delta,
+                                        MatchBaseType::sampled_P_3D_->size() );
+  for (const auto& p : *MatchBaseType::sampled_P_3D_)
+      hash_grid_.add(p.pos());
+  hash_grid_.finalize();
+#endif
 
   // Normalize the delta (See the paper) and the maximum base distance.
   // delta = P_mean_distance_ * delta;
-  max_base_diameter_ = MatchBaseType::P_diameter_ * MatchBaseType::options_.getOverlapEstimation();
+  // Guess between the centered sets: q -> R (q + cQ) + t - cP
+  const MatrixType& guess = MatchBaseType::options_.pose_prior;
+  prior_rotation_    = guess.template topLeftCorner<3,3>();
+  prior_translation_ = prior_rotation_ * MatchBaseType::centroid_Q_ +
+                       guess.template topRightCorner<3,1>() - MatchBaseType::centroid_P_;
+
+  overlap_estimation_  = MatchBaseType::options_.getOverlapEstimation();
+  terminate_threshold_ = MatchBaseType::options_.getTerminateThreshold();
+  if (MatchBaseType::options_.estimate_overlap) {
+    const Scalar overlap = estimateOverlap();
+    MatchBaseType::template Log<LogLevel::Verbose>( "Estimated overlap: ", overlap );
+    if (overlap > overlap_estimation_) {
+      overlap_estimation_  = overlap;
+      terminate_threshold_ = (std::max)(overlap, terminate_threshold_);
+    }
+  }
+
+  max_base_diameter_ = MatchBaseType::P_diameter_ * overlap_estimation_;
+
+  // RANSAC probability and number of needed trials, estimated once P_diameter_
+  // and max_base_diameter_ are known.
+  {
+    const Scalar kDiameterFraction = 0.3;
+    Scalar first_estimation =
+            std::log(kSmallError) / std::log(1.0 - pow(overlap_estimation_,
+                                                       static_cast<Scalar>(kMinNumberOfTrials)));
+    // We use a simple heuristic to elevate the probability to a reasonable value
+    // given that we don't simply sample from P, but instead, we bound the
+    // distance between the points in the base as a fraction of the diameter.
+    const Scalar trials = max_base_diameter_ > Scalar(0) ?
+            first_estimation * (MatchBaseType::P_diameter_ / kDiameterFraction) / max_base_diameter_ :
+            Scalar(0);
+    number_of_trials_ = trials < Scalar(kMinNumberOfTrials) ? kMinNumberOfTrials :
+                        trials > Scalar((std::numeric_limits<int>::max)()) ? (std::numeric_limits<int>::max)() :
+                        static_cast<int>(trials);
+  }
+
+  MatchBaseType::base_candidates_.clear();
+  if (MatchBaseType::options_.hasPosePrior()) {
+    static const Scalar pi = std::acos(Scalar(-1));
+    const Scalar angle = (std::min)(MatchBaseType::options_.pose_prior_max_angle, Scalar(180));
+    prior_chord_ = Scalar(2) * std::sin(angle * pi / Scalar(360));
+
+    // Bases are drawn among the samples of P that can be reached by the
+    // samples of Q moved by an accepted transformation
+    std::vector<char> reached (MatchBaseType::sampled_P_3D_->size(), 0);
+    typename KdTree<Scalar>::template RangeQuery<> query;
+    for (const auto& q : MatchBaseType::sampled_Q_3D_) {
+      const Scalar radius = priorRadius(q.pos().norm()) + MatchBaseType::options_.delta;
+      query.queryPoint = prior_rotation_ * q.pos() + prior_translation_;
+      query.sqdist     = radius * radius;
+      MatchBaseType::kd_tree_->doQueryDistProcessIndices(query, [&reached](int i) { reached[i] = 1; });
+    }
+    for (size_t i = 0; i != reached.size(); ++i)
+      if (reached[i]) MatchBaseType::base_candidates_.push_back(int(i));
+    if (MatchBaseType::base_candidates_.size() == reached.size())
+      MatchBaseType::base_candidates_.clear();
+
+    // The guess is the initial solution, see getGlobalTransform
+    MatchBaseType::transform_ = MatrixType::Identity();
+    MatchBaseType::transform_.template topLeftCorner<3,3>()  = prior_rotation_;
+    MatchBaseType::transform_.template topRightCorner<3,1>() = prior_translation_;
+    MatchBaseType::qcentroid1_ = prior_translation_;
+    MatchBaseType::qcentroid2_ = VectorType::Zero();
+  }
+
+  // Each context gets its own random stream, seeded from the matcher generator
+  // to keep runs reproducible for a given seed and number of threads.
+  if (MatchBaseType::options_.nb_exploration_threads > 1) {
+    for (int t = 0; t < MatchBaseType::options_.nb_exploration_threads; ++t) {
+      std::unique_ptr<ExplorationContext> context =
+          makeExplorationContext(MatchBaseType::randomGenerator_());
+      if (context == nullptr) {
+        exploration_contexts_.clear();
+        break;
+      }
+      exploration_contexts_.push_back(std::move(context));
+    }
+  }
 
   best_LCP_ = Verify(MatchBaseType::transform_);
-  MatchBaseType::template Log<LogLevel::Verbose>( "Initial LCP: ", best_LCP_ );
+  MatchBaseType::template Log<LogLevel::Verbose>( "Initial LCP: ", best_LCP_.load() );
+  adaptNumberOfTrials(best_LCP_);
 
-  if (best_LCP_ != Scalar(1.))
-    Perform_N_steps(number_of_trials_, transformation, v);
+  return best_LCP_ != Scalar(1.);
+}
 
-#ifdef TEST_GLOBAL_TIMINGS
-  MatchBaseType::template Log<LogLevel::Verbose>( "----------- Timings (msec) -------------" );
-  MatchBaseType::template Log<LogLevel::Verbose>( " Total computation time  : ", totalTime   );
-  MatchBaseType::template Log<LogLevel::Verbose>( " Total verify time       : ", verifyTime  );
-  MatchBaseType::template Log<LogLevel::Verbose>( "----------------------------------------" );
-#endif
 
-  return best_LCP_;
+
+template <typename Traits, typename PointType, typename TransformVisitor,
+          typename PairFilteringFunctor,
+          template < class, class > class ... OptExts >
+typename CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::Scalar
+CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::estimateOverlap() const {
+  const auto& P = *MatchBaseType::sampled_P_3D_;
+  const auto& Q = MatchBaseType::sampled_Q_3D_;
+  if (P.empty() || Q.empty()) return Scalar(0);
+
+  // Voxel coordinates, on 21 bits per axis
+  const Scalar voxel = kOverlapVoxelFactor * MatchBaseType::options_.delta;
+  auto cell = [voxel](Scalar v) {
+    return (std::min)((std::max)(int64_t(std::floor(v / voxel)) + (int64_t(1) << 20), int64_t(1)),
+                      (int64_t(1) << 21) - 2);
+  };
+  auto key = [](int64_t x, int64_t y, int64_t z) {
+    return uint64_t(x) | uint64_t(y) << 21 | uint64_t(z) << 42;
+  };
+
+  std::unordered_set<uint64_t> occupied;
+  occupied.reserve(P.size());
+  for (const auto& p : P)
+    occupied.insert(key(cell(p.pos()(0)), cell(p.pos()(1)), cell(p.pos()(2))));
+
+  // A sample of Q overlaps P when P occupies its voxel or a neighbour
+  size_t overlapping = 0;
+  for (const auto& q : Q) {
+    const VectorType x = prior_rotation_ * q.pos() + prior_translation_;
+    const int64_t cx = cell(x(0)), cy = cell(x(1)), cz = cell(x(2));
+    bool found = false;
+    for (int64_t dz = -1; dz <= 1 && ! found; ++dz)
+      for (int64_t dy = -1; dy <= 1 && ! found; ++dy)
+        for (int64_t dx = -1; dx <= 1 && ! found; ++dx)
+          found = occupied.count(key(cx + dx, cy + dy, cz + dz)) != 0;
+    if (found) ++overlapping;
+  }
+  return Scalar(overlapping) / Scalar(Q.size());
 }
 
 
+template <typename Traits, typename PointType, typename TransformVisitor,
+          typename PairFilteringFunctor,
+          template < class, class > class ... OptExts >
+void
+CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::adaptNumberOfTrials(Scalar lcp) {
+  if (! MatchBaseType::options_.adaptive_trials || ! (lcp > Scalar(0))) return;
+
+  // Probability that a random base is made of inliers only
+  const Scalar inliers = std::pow((std::min)(lcp, Scalar(1)), Scalar(Traits::size()));
+  const Scalar needed  = inliers >= Scalar(1) ? Scalar(0)
+                                              : std::log(kSmallError) / std::log1p(-inliers);
+  if (needed < Scalar(number_of_trials_)) {
+    number_of_trials_ = (std::max)(kMinNumberOfTrials, static_cast<int>(std::ceil(needed)));
+    MatchBaseType::template Log<LogLevel::Verbose>( "Number of trials: ", number_of_trials_.load() );
+  }
+}
+
+
+template <typename Traits, typename PointType, typename TransformVisitor,
+          typename PairFilteringFunctor,
+          template < class, class > class ... OptExts >
+bool
+CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::Perform_N_steps(
+        int n,
+        Eigen::Ref<typename CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::MatrixType> transformation,
+        TransformVisitor &v) {
+  return Perform_N_steps(n, transformation, v, std::function<bool()>());
+}
 
 // Performs N RANSAC iterations and compute the best transformation. Also,
 // transforms the set Q by this optimal transformation.
@@ -130,7 +352,8 @@ bool
 CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::Perform_N_steps(
         int n,
         Eigen::Ref<typename CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::MatrixType> transformation,
-        TransformVisitor &v) {
+        TransformVisitor &v,
+        const std::function<bool()>& interrupt) {
   using std::chrono::system_clock;
 
 #ifdef TEST_GLOBAL_TIMINGS
@@ -151,27 +374,35 @@ CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFu
   v(0, best_LCP_, transformation);
 
   bool ok = false;
-  std::chrono::time_point<system_clock> t0 = system_clock::now(), end;
-  for (int i = current_trial_; i < current_trial_ + n; ++i) {
-    ok = TryOneBase(v);
-
-    Scalar fraction_try  = Scalar(i) / Scalar(number_of_trials_);
-    Scalar fraction_time =
-        std::chrono::duration_cast<std::chrono::seconds>
-        (system_clock::now() - t0).count() /
-                          MatchBaseType::options_.max_time_seconds;
-    Scalar fraction = (std::max)(fraction_time, fraction_try);
-
-    if (v.needsGlobalTransformation()) {
-      getGlobalTransform(transformation);
-    } else {
-      transformation = MatchBaseType::transform_;
+  int nb_trials = 0;
+  if (! exploration_contexts_.empty()) {
+    ok = TryBasesConcurrently(current_trial_, current_trial_ + n,
+                              transformation, v, interrupt, nb_trials);
+  } else {
+    std::chrono::time_point<system_clock> t0 = system_clock::now(), end;
+    for (int i = current_trial_; i < current_trial_ + n; ++i) {
+      if (interrupt && interrupt()) break;
+      ok = TryOneBase(v);
+      ++nb_trials;
+
+      Scalar fraction_try  = Scalar(i) / Scalar(number_of_trials_);
+      Scalar fraction_time =
+          std::chrono::duration_cast<std::chrono::milliseconds>
+          (system_clock::now() - t0).count() /
+                            (Scalar(1000) * MatchBaseType::options_.max_time_seconds);
+      Scalar fraction = (std::max)(fraction_time, fraction_try);
+
+      if (v.needsGlobalTransformation()) {
+        getGlobalTransform(transformation);
+      } else {
+        transformation = MatchBaseType::transform_;
+      }
+
+      v(fraction, best_LCP_, transformation);
+
+      // ok means that we already have the desired LCP.
+      if (ok || i > number_of_trials_ || fraction >= 0.99 || best_LCP_ == 1.0) break;
     }
-
-    v(fraction, best_LCP_, transformation);
-
-    // ok means that we already have the desired LCP.
-    if (ok || i > number_of_trials_ || fraction >= 0.99 || best_LCP_ == 1.0) break;
   }
 
   // Need to force global transformation update at the end of the process
@@ -179,16 +410,109 @@ CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFu
   if (! v.needsGlobalTransformation())
     getGlobalTransform(transformation);
 
-  current_trial_ += n;
+  current_trial_ += nb_trials;
 #ifdef TEST_GLOBAL_TIMINGS
     totalTime += Scalar(t.elapsed().count()) / Scalar(CLOCKS_PER_SEC);
 #endif
 
-  return ok || current_trial_ >= number_of_trials_;
+  return ok || current_trial_ >= number_of_trials_ || best_LCP_ == Scalar(1.);
 }
 
 
 
+// Performs a range of RANSAC iterations using several threads. Each thread
+// picks the next trial index, selects its own base and explores the
+// corresponding congruent set. The best solution is shared by all threads, so
+// the early termination of the verification stays effective.
+template <typename Traits, typename PointType, typename TransformVisitor,
+          typename PairFilteringFunctor,
+          template < class, class > class ... OptExts >
+bool
+CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::TryBasesConcurrently(
+        int first_trial,
+        int last_trial,
+        Eigen::Ref<typename CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::MatrixType> transformation,
+        TransformVisitor &v,
+        const std::function<bool()>& interrupt,
+        int &nb_trials) {
+  using std::chrono::system_clock;
+
+  auto getGlobalTransform = [this](Eigen::Ref<MatrixType> transformation){
+    Eigen::Matrix<Scalar, 3, 3> rot, scale;
+    Eigen::Transform<Scalar, 3, Eigen::Affine> (MatchBaseType::transform_).computeRotationScaling(&rot, &scale);
+    transformation = MatchBaseType::transform_;
+    transformation.col(3) = (MatchBaseType::qcentroid1_ + MatchBaseType::centroid_P_ -
+            ( rot * scale * (MatchBaseType::qcentroid2_ + MatchBaseType::centroid_Q_))).homogeneous();
+  };
+
+  std::atomic<int>  next_trial (first_trial);
+  std::atomic<int>  done  (0);
+  std::atomic<bool> stop  (false);
+  std::atomic<bool> found (false);
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  const std::chrono::time_point<system_clock> t0 = system_clock::now();
+
+  // Each thread explores bases with its context until the trials are
+  // exhausted, the target is reached or the exploration is interrupted
+  auto explore = [&, this](ExplorationContext* context) {
+    try {
+      CongruentBaseType base;
+      for (int i = next_trial++; i < last_trial && !stop; i = next_trial++) {
+        if (interrupt && interrupt()) {
+          stop = true;
+          break;
+        }
+        bool match = false;
+        size_t nb = 0;
+        context->congruent_set.clear();
+        if (generateCongruents(base, context->congruent_set, *context))
+          match = TryCongruentSet(base, context->congruent_set, context->candidates, v, nb);
+        ++done;
+
+        Scalar fraction_try  = Scalar(i) / Scalar(number_of_trials_);
+        Scalar fraction_time =
+            std::chrono::duration_cast<std::chrono::milliseconds>
+            (system_clock::now() - t0).count() /
+                              (Scalar(1000) * MatchBaseType::options_.max_time_seconds);
+        Scalar fraction = (std::max)(fraction_time, fraction_try);
+
+        {
+          std::lock_guard<std::mutex> lock (best_mutex_);
+          if (v.needsGlobalTransformation()) {
+            getGlobalTransform(transformation);
+          } else {
+            transformation = MatchBaseType::transform_;
+          }
+          v(fraction, best_LCP_, transformation);
+        }
+
+        if (match) found = true;
+        if (match || i > number_of_trials_ || fraction >= 0.99 || best_LCP_ == 1.0)
+          stop = true;
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock (error_mutex);
+      if (! error) error = std::current_exception();
+      stop = true;
+    }
+  };
+
+  // The calling thread processes the first context
+  Utils::TaskGroup workers;
+  for (size_t t = 1; t < exploration_contexts_.size(); ++t) {
+    ExplorationContext* context = exploration_contexts_[t].get();
+    workers.run([&explore, context]{ explore(context); });
+  }
+  explore(exploration_contexts_[0].get());
+  workers.wait();
+
+  nb_trials = done;
+  if (error) std::rethrow_exception(error);
+
+  return found;
+}
+
 template <typename Traits, typename PointType, typename TransformVisitor,
           typename PairFilteringFunctor,
           template < class, class > class ... OptExts >
@@ -201,7 +525,7 @@ bool CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilter
 
         size_t nb = 0;
 
-        bool match = TryCongruentSet(base,congruent_quads,v,nb);
+        bool match = TryCongruentSet(base,congruent_quads,candidates_,v,nb);
 
         //if (nb != 0)
         //  MatchBaseType::Log<LogLevel::Verbose>( "Congruent quads: (", nb, ")    " );
@@ -215,6 +539,7 @@ template <typename Traits, typename PointType, typename TransformVisitor,
 bool CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::TryCongruentSet(
         typename CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::CongruentBaseType& base,
         typename CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::Set& set,
+        typename CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::CandidateVector& candidates,
         TransformVisitor &v,
         size_t &nbCongruent) {
 //    static const Scalar pi = std::acos(-1);
@@ -223,7 +548,7 @@ bool CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilter
     Coordinates references;
 //    std::cout << "Process congruent set for base: \n";
     for (int i = 0; i!= Traits::size(); ++i) {
-        references[i] = &MatchBaseType::sampled_P_3D_[base[i]];
+        references[i] = &(*MatchBaseType::sampled_P_3D_)[base[i]];
 //        std::cout << "[" << base[i] << "]: " << references[i].pos().transpose() << "\n";
     }
     const Coordinates& ref = references;
@@ -238,14 +563,76 @@ bool CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilter
 
     std::atomic<size_t> nbCongruentAto(0);
 
-    Coordinates congruent_candidate;
-    bool found = false;
-#ifdef OpenGR_USE_OPENMP
-#pragma omp parallel for num_threads(omp_nthread_congruent_)
-#endif
-    for (int i = 0; i < int(set.size()); ++i) {
-      if (found) continue;
+    std::atomic<bool> found (false);
+
+    // Verifies a candidate against the whole Q, and retains it if it is the best
+    auto verifyCandidate = [&](const Candidate& candidate) {
+        const MatrixType& transform = candidate.transform;
+        const VectorType& centroid2 = candidate.centroid2;
+        const auto& congruent_ids = set[candidate.index];
+
+        // Verify the rest of the points in Q against P.
+        Scalar lcp = Verify(transform);
+
+        // transformation has been computed between the two point clouds centered
+        // at the origin, we need to recompute the translation to apply it to the original clouds
+        {
+          std::lock_guard<std::mutex> lock (best_mutex_);
+          auto getGlobalTransform =
+              [this, transform, centroid1, centroid2]
+              (Eigen::Ref<MatrixType> transformation){
+              Eigen::Matrix<Scalar, 3, 3> rot, scale;
+              Eigen::Transform<Scalar, 3, Eigen::Affine> (transform).computeRotationScaling(&rot, &scale);
+              transformation = transform;
+              transformation.col(3) = (centroid1 + MatchBaseType::centroid_P_ -
+                                       ( rot * scale * (centroid2 + MatchBaseType::centroid_Q_))).homogeneous();
+            };
+
+          if (v.needsGlobalTransformation())
+            {
+              Eigen::Matrix<Scalar, 4, 4> transformation = transform;
+              getGlobalTransform(transformation);
+              v(-1, lcp, transformation);
+            }
+          else
+            v(-1, lcp, transform);
+
+          if (lcp > best_LCP_) {
+              // Retain the best LCP and transformation.
+              for (int j = 0; j!= Traits::size(); ++j)
+                base_[j] = base[j];
+
+
+              for (int j = 0; j!= Traits::size(); ++j)
+                current_congruent_[j] = congruent_ids[j];
+
+              best_LCP_                   = lcp;
+              MatchBaseType::transform_   = transform;
+              MatchBaseType::qcentroid1_  = centroid1;
+              MatchBaseType::qcentroid2_  = centroid2;
+              adaptNumberOfTrials(lcp);
+            }
+
+        }
+        // Terminate if we have the desired LCP already.
+        if (lcp > terminate_threshold_){
+            found = true;
+          }
+    };
+
+    // With a verification subset, the candidates are first gathered with
+    // their subset score, then verified by decreasing score
+    const bool cascaded = subset_Q_3D_.size() != 0;
+    candidates.clear();
+    if (cascaded)
+        candidates.resize(set.size());
+    for (auto& candidate : candidates)
+        candidate.index = -1;
+
+    Utils::parallel_for(0, int(set.size()), [&](int i) {
+      if (found) return;
         const auto& congruent_ids = set[i];
+        Coordinates congruent_candidate;
         for (int j = 0; j!= Traits::size(); ++j)
             congruent_candidate[j] = &MatchBaseType::sampled_Q_3D_[congruent_ids[j]];
 
@@ -287,7 +674,8 @@ bool CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilter
         if (ok && rms >= Scalar(0.)) {
 
             // We give more tolerant in computing the best rigid transformation.
-            if (rms < distance_factor * MatchBaseType::options_.delta) {
+            if (rms < distance_factor * MatchBaseType::options_.delta &&
+                isWithinPosePrior(transform)) {
 
 //                std::cout << "congruent candidate: [";
 //                for (int j = 0; j!= Traits::size(); ++j)
@@ -296,62 +684,13 @@ bool CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilter
 
                 nbCongruentAto++;
                 // The transformation is computed from the point-clouds centered inn [0,0,0]
-
-                // Verify the rest of the points in Q against P.
-                Scalar lcp = Verify(transform);
-//                std::cout << " " << lcp << " - Angle: ";
-
-                // compute angle between pairs of points: for debug only
-//                Scalar angle = (congruent_candidate[1].pos() - congruent_candidate[0].pos()).normalized().dot(
-//                      (congruent_candidate[3].pos() - congruent_candidate[2].pos()).normalized());
-//                std::cout << std::acos(angle)*Scalar(180)/pi << " (error: "
-//                          << (std::acos(targetAngle) - std::acos(angle))*Scalar(180)/pi << ")\n";
-
-                // transformation has been computed between the two point clouds centered
-                // at the origin, we need to recompute the translation to apply it to the original clouds
-#ifdef OpenGR_USE_OPENMP
-#pragma omp critical
-#endif
-                {
-                  auto getGlobalTransform =
-                      [this, transform, centroid1, centroid2]
-                      (Eigen::Ref<MatrixType> transformation){
-                      Eigen::Matrix<Scalar, 3, 3> rot, scale;
-                      Eigen::Transform<Scalar, 3, Eigen::Affine> (transform).computeRotationScaling(&rot, &scale);
-                      transformation = transform;
-                      transformation.col(3) = (centroid1 + MatchBaseType::centroid_P_ -
-                                               ( rot * scale * (centroid2 + MatchBaseType::centroid_Q_))).homogeneous();
-                    };
-
-                  if (v.needsGlobalTransformation())
-                    {
-                      Eigen::Matrix<Scalar, 4, 4> transformation = transform;
-                      getGlobalTransform(transformation);
-                      v(-1, lcp, transformation);
-                    }
-                  else
-                    v(-1, lcp, transform);
-
-                  if (lcp > best_LCP_) {
-                      // Retain the best LCP and transformation.
-                      for (int j = 0; j!= Traits::size(); ++j)
-                        base_[j] = base[j];
-
-
-                      for (int j = 0; j!= Traits::size(); ++j)
-                        current_congruent_[j] = congruent_ids[j];
-
-                      best_LCP_                   = lcp;
-                      MatchBaseType::transform_   = transform;
-                      MatchBaseType::qcentroid1_  = centroid1;
-                      MatchBaseType::qcentroid2_  = centroid2;
-                    }
-
+                Candidate candidate { transform, centroid2, Scalar(0), i };
+                if (cascaded) {
+                    candidate.score = VerifySubset(transform);
+                    candidates[i] = candidate;
                 }
-                // Terminate if we have the desired LCP already.
-                if (lcp > MatchBaseType::options_.getTerminateThreshold()){
-                    found = true;
-                  }
+                else
+                    verifyCandidate(candidate);
             }
           } else {
 
@@ -360,14 +699,65 @@ bool CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilter
 //                std::cout << congruent_ids[j] << " ";
 //            std::cout << "]\n";
           }
+    }, kCongruentGrain);
+
+    if (cascaded) {
+        // The best candidates come first, so that they raise the best LCP and
+        // tighten the early exit of Verify for the next ones
+        candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                                        [](const Candidate& c) { return c.index < 0; }),
+                         candidates.end());
+        std::sort(candidates.begin(), candidates.end(),
+                  [](const Candidate& a, const Candidate& b) {
+            return a.score > b.score || (a.score == b.score && a.index < b.index);
+        });
+
+        Utils::parallel_for(0, int(candidates.size()), [&](int i) {
+            if (found || ! isSubsetScorePromising(candidates[i].score)) return;
+            verifyCandidate(candidates[i]);
+        }, kCongruentGrain);
     }
 
     nbCongruent = nbCongruentAto;
 
     // If we reached here we do not have yet the desired LCP.
-    return best_LCP_ > MatchBaseType::options_.getTerminateThreshold() /*false*/;
+    return best_LCP_ > terminate_threshold_ /*false*/;
+}
+
+
+template <typename Traits, typename PointType, typename TransformVisitor,
+          typename PairFilteringFunctor,
+          template < class, class > class ... OptExts >
+bool
+CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::isWithinPosePrior(
+        const Eigen::Ref<const typename CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::MatrixType> &mat) const {
+    if (! MatchBaseType::options_.hasPosePrior()) return true;
+
+    static const Scalar pi = std::acos(Scalar(-1));
+    const Scalar angle = (std::min)(MatchBaseType::options_.pose_prior_max_angle, Scalar(180));
+
+    // Angle of the correction rotation, from its trace
+    const Eigen::Matrix<Scalar, 3, 3> rotation = mat.template topLeftCorner<3,3>();
+    const Scalar cos = Scalar(0.5) * ((rotation * prior_rotation_.transpose()).trace() - Scalar(1));
+    if (cos < std::cos(angle * pi / Scalar(180))) return false;
+
+    // Motion of the centroid of Q, at the origin of the centered frame
+    return (mat.template topRightCorner<3,1>() - prior_translation_).norm() <=
+           MatchBaseType::options_.pose_prior_max_translation;
 }
 
+template <typename Traits, typename PointType, typename TransformVisitor,
+          typename PairFilteringFunctor,
+          template < class, class > class ... OptExts >
+bool
+CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::isSubsetScorePromising(Scalar score) const {
+    // Normal approximation of the binomial distribution of the subset score
+    // of a candidate whose LCP is the best LCP
+    const Scalar n    = Scalar(subset_Q_3D_.size());
+    const Scalar best = best_LCP_;
+    const Scalar sd   = std::sqrt(best * (Scalar(1) - best) / n);
+    return score >= best - kSubsetScoreMargin * sd;
+}
 
 // Verify a given transformation by computing the number of points in P at
 // distance at most (normalized) delta from some point in Q. In the paper
@@ -386,7 +776,7 @@ CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFu
 
     RegistrationMetric metric;
     metric.epsilon_ = MatchBaseType::options_.delta;
-    Scalar score = metric( MatchBaseType::kd_tree_, MatchBaseType::sampled_Q_3D_, mat, best_LCP_ );
+    Scalar score = metric( verificationAccelerator(), batched_Q_3D_, mat, best_LCP_ );
 
 #ifdef TEST_GLOBAL_TIMINGS
     verifyTime += Scalar(t_verify.elapsed().count()) / Scalar(CLOCKS_PER_SEC);
@@ -395,4 +785,15 @@ CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFu
     return score;
 }
 
+template <typename Traits, typename PointType, typename TransformVisitor,
+          typename PairFilteringFunctor,
+          template < class, class > class ... OptExts >
+typename CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::Scalar
+CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::VerifySubset(
+        const Eigen::Ref<const typename CongruentSetExplorationBase<Traits, PointType, TransformVisitor, PairFilteringFunctor, OptExts ...>::MatrixType> &mat) const {
+    RegistrationMetric metric;
+    metric.epsilon_ = MatchBaseType::options_.delta;
+    return metric( verificationAccelerator(), subset_Q_3D_, mat );
+}
+
 }
@@ -97,9 +97,9 @@ namespace gr {
         if (!MatchBaseType::SelectRandomTriangle(MatchBaseType::max_base_diameter_, base[0], base[1], base[2]))
             return false;
 
-        MatchBaseType::base_3D_ [0] = &MatchBaseType::sampled_P_3D_[base[0]];
-        MatchBaseType::base_3D_ [1] = &MatchBaseType::sampled_P_3D_[base[1]];
-        MatchBaseType::base_3D_ [2] = &MatchBaseType::sampled_P_3D_[base[2]];
+        MatchBaseType::base_3D_ [0] = &(*MatchBaseType::sampled_P_3D_)[base[0]];
+        MatchBaseType::base_3D_ [1] = &(*MatchBaseType::sampled_P_3D_)[base[1]];
+        MatchBaseType::base_3D_ [2] = &(*MatchBaseType::sampled_P_3D_)[base[2]];
 
         return true;
     }
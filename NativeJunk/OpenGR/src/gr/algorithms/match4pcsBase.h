@@ -50,9 +50,32 @@ namespace gr {
         using Coordinates       = typename MatchBaseType::Coordinates;
         using OptionsType       = typename MatchBaseType::OptionsType;
         using Functor           = _Functor<PosMutablePoint, PairFilteringFunctor, OptionsType>;
+        using PairsVector       = typename MatchBaseType::PairsVector;
 
     protected:
         Functor fun_;
+        /// KdTree on sampled Q, used to extract the pairs under a pose prior
+        KdTree<Scalar> prior_Q_tree_;
+        /// Largest distance between a sample of Q and its centroid
+        Scalar prior_Q_radius_ {Scalar( 0 )};
+
+        /// Base selection and pair extraction state of a thread exploring
+        /// bases concurrently with the others.
+        struct ExplorationContext : public MatchBaseType::ExplorationContext {
+            /// The 3D points of the base explored by this thread
+            Coordinates base_3D;
+            /// Functor bound to base_3D, sharing the pair extraction data
+            /// initialized by the matcher
+            Functor fun;
+            /// Pairs extracted for the current base, reused between bases
+            PairsVector pairs1, pairs2;
+
+            inline ExplorationContext(Match4pcsBase& matcher, unsigned int seed)
+                : base_3D(),
+                  fun(matcher.fun_, base_3D) {
+                this->randomGenerator.seed(seed);
+            }
+        };
 
     public:
 
@@ -70,6 +93,11 @@ namespace gr {
         inline bool TryQuadrilateral(Scalar &invariant1, Scalar &invariant2,
                                      int &id1, int &id2, int &id3, int &id4);
 
+        /// Same as above, but reorders \p base_3D instead of base_3D_.
+        inline bool TryQuadrilateral(Scalar &invariant1, Scalar &invariant2,
+                                     int &id1, int &id2, int &id3, int &id4,
+                                     Coordinates& base_3D) const;
+
         /// Selects a random triangle in the set P (then we add another point to keep the
         /// base as planar as possible). We apply a simple heuristic that works in most
         /// practical cases. The idea is to accept maximum distance, computed by the
@@ -80,6 +108,12 @@ namespace gr {
         inline bool SelectQuadrilateral(Scalar &invariant1, Scalar &invariant2,
                                         int& base1, int& base2, int& base3, int& base4);
 
+        /// Same as above, but stores the base in \p base_3D and draws the random
+        /// samples from \p rng, so it can be called concurrently.
+        inline bool SelectQuadrilateral(Scalar &invariant1, Scalar &invariant2,
+                                        int& base1, int& base2, int& base3, int& base4,
+                                        Coordinates& base_3D, std::mt19937& rng) const;
+
         /// Initializes the data structures and needed values before the match
         /// computation.
         /// This method is called once the internal state of the Base class as been
@@ -101,6 +135,28 @@ namespace gr {
     protected:
         virtual bool initBase(CongruentBaseType &base, Scalar& invariant1, Scalar& invariant2);
 
+        std::unique_ptr<typename MatchBaseType::ExplorationContext>
+        makeExplorationContext (unsigned int seed) override;
+
+        bool generateCongruents (CongruentBaseType& base, Set& congruent_quads,
+                                 typename MatchBaseType::ExplorationContext& context) override;
+
+        /// Extracts the pairs matching the base stored in \p base_3D and finds
+        /// the corresponding congruent quadrilaterals.
+        bool generateCongruents (const Coordinates& base_3D,
+                                 Scalar invariant1, Scalar invariant2,
+                                 const Functor& fun,
+                                 PairsVector& pairs1, PairsVector& pairs2,
+                                 Set& congruent_quads) const;
+
+        /// Extracts the pairs of Q matching the pair (b0, b1) of the base under
+        /// the pose prior: the points of a pair are searched in the kd-tree of Q,
+        /// around the positions the guess brings onto b0 and b1.
+        void ExtractPriorPairs(const PosMutablePoint& b0, const PosMutablePoint& b1,
+                               Scalar pair_distance, Scalar pair_normals_angle,
+                               Scalar pair_distance_epsilon,
+                               PairsVector& pairs) const;
+
     private:
         static inline Scalar distSegmentToSegment( const VectorType& p1, const VectorType& p2,
                                                    const VectorType& q1, const VectorType& q2,
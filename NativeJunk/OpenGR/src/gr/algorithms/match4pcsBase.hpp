@@ -54,6 +54,20 @@ namespace gr {
         typename PointType::Scalar &invariant1,
         typename PointType::Scalar &invariant2,
         int &id1, int &id2, int &id3, int &id4) {
+        return TryQuadrilateral(invariant1, invariant2, id1, id2, id3, id4,
+                                MatchBaseType::base_3D_);
+    }
+
+    template <template <typename, typename, typename> class _Functor,
+              typename PointType,
+              typename TransformVisitor,
+              typename PairFilteringFunctor,
+              template < class, class > class PFO>
+    bool Match4pcsBase<_Functor, PointType, TransformVisitor, PairFilteringFunctor, PFO>::TryQuadrilateral(
+        typename PointType::Scalar &invariant1,
+        typename PointType::Scalar &invariant2,
+        int &id1, int &id2, int &id3, int &id4,
+        Coordinates& base_3D) const {
 
         Scalar min_distance = (std::numeric_limits<Scalar>::max)();
         int best1, best2, best3, best4;
@@ -70,8 +84,8 @@ namespace gr {
                 // Compute the closest points on both segments, the corresponding
                 // invariants and the distance between the closest points.
                 Scalar segment_distance = distSegmentToSegment(
-                        MatchBaseType::base_3D_[i]->pos(), MatchBaseType::base_3D_[j]->pos(),
-                        MatchBaseType::base_3D_[k]->pos(), MatchBaseType::base_3D_[l]->pos(),
+                        base_3D[i]->pos(), base_3D[j]->pos(),
+                        base_3D[k]->pos(), base_3D[l]->pos(),
                         local_invariant1, local_invariant2);
                 // Retail the smallest distance and the best order so far.
                 if (segment_distance < min_distance) {
@@ -88,11 +102,11 @@ namespace gr {
 
         if(best1 < 0 || best2 < 0 || best3 < 0 || best4 < 0 ) return false;
 
-        Coordinates tmp = MatchBaseType::base_3D_;
-        MatchBaseType::base_3D_[0] = tmp[best1];
-        MatchBaseType::base_3D_[1] = tmp[best2];
-        MatchBaseType::base_3D_[2] = tmp[best3];
-        MatchBaseType::base_3D_[3] = tmp[best4];
+        Coordinates tmp = base_3D;
+        base_3D[0] = tmp[best1];
+        base_3D[1] = tmp[best2];
+        base_3D[2] = tmp[best3];
+        base_3D[3] = tmp[best4];
 
         CongruentBaseType tmpId = {id1, id2, id3, id4};
         id1 = tmpId[best1];
@@ -112,6 +126,20 @@ namespace gr {
         Scalar &invariant1,
         Scalar &invariant2,
         int& base1, int& base2, int& base3, int& base4)  {
+        return SelectQuadrilateral(invariant1, invariant2, base1, base2, base3, base4,
+                                   MatchBaseType::base_3D_, MatchBaseType::randomGenerator_);
+    }
+
+    template <template <typename, typename, typename> class _Functor,
+              typename PointType,
+              typename TransformVisitor,
+              typename PairFilteringFunctor,
+              template < class, class > class PFO>
+    bool Match4pcsBase<_Functor, PointType, TransformVisitor, PairFilteringFunctor, PFO>::SelectQuadrilateral(
+        Scalar &invariant1,
+        Scalar &invariant2,
+        int& base1, int& base2, int& base3, int& base4,
+        Coordinates& base_3D, std::mt19937& rng) const {
 
         const Scalar kBaseTooSmall (0.2);
         int current_trial = 0;
@@ -119,13 +147,13 @@ namespace gr {
         // Try fix number of times.
         while (current_trial < MatchBaseType::kNumberOfDiameterTrials) {
             // Select a triangle if possible. otherwise fail.
-            if (!MatchBaseType::SelectRandomTriangle(MatchBaseType::max_base_diameter_, base1, base2, base3)){
+            if (!MatchBaseType::SelectRandomTriangle(MatchBaseType::max_base_diameter_, base1, base2, base3, rng)){
                 return false;
             }
 
-            const auto& b0 = *(MatchBaseType::base_3D_[0] = &MatchBaseType::sampled_P_3D_[base1]);
-            const auto& b1 = *(MatchBaseType::base_3D_[1] = &MatchBaseType::sampled_P_3D_[base2]);
-            const auto& b2 = *(MatchBaseType::base_3D_[2] = &MatchBaseType::sampled_P_3D_[base3]);
+            const auto& b0 = *(base_3D[0] = &(*MatchBaseType::sampled_P_3D_)[base1]);
+            const auto& b1 = *(base_3D[1] = &(*MatchBaseType::sampled_P_3D_)[base2]);
+            const auto& b2 = *(base_3D[2] = &(*MatchBaseType::sampled_P_3D_)[base3]);
 
             // The 4th point will be a one that is close to be planar to the other 3
             // while still not too close to them.
@@ -154,8 +182,12 @@ namespace gr {
                 Scalar best_distance = (std::numeric_limits<Scalar>::max)();
                 // Go over all points in P.
                 const Scalar too_small = std::pow(MatchBaseType::max_base_diameter_ * kBaseTooSmall, 2);
-                for (unsigned int i = 0; i < MatchBaseType::sampled_P_3D_.size(); ++i) {
-                    const auto &p = MatchBaseType::sampled_P_3D_[i];
+                const auto& candidates = MatchBaseType::base_candidates_;
+                const size_t nb_candidates = candidates.empty() ? MatchBaseType::sampled_P_3D_->size()
+                                                                : candidates.size();
+                for (size_t c = 0; c < nb_candidates; ++c) {
+                    const int i = candidates.empty() ? int(c) : candidates[c];
+                    const auto &p = (*MatchBaseType::sampled_P_3D_)[i];
                     if ((p.pos() - b0.pos()).squaredNorm() >= too_small &&
                         (p.pos() - b1.pos()).squaredNorm() >= too_small &&
                         (p.pos() - b2.pos()).squaredNorm() >= too_small) {
@@ -165,14 +197,14 @@ namespace gr {
                         // Search for the most planar.
                         if (distance < best_distance) {
                             best_distance = distance;
-                            base4 = int(i);
+                            base4 = i;
                         }
                     }
                 }
                 // If we have a good one we can quit.
                 if (base4 != -1) {
-                    MatchBaseType::base_3D_[3] = &MatchBaseType::sampled_P_3D_[base4];
-                    if(TryQuadrilateral(invariant1, invariant2, base1, base2, base3, base4))
+                    base_3D[3] = &(*MatchBaseType::sampled_P_3D_)[base4];
+                    if(TryQuadrilateral(invariant1, invariant2, base1, base2, base3, base4, base_3D))
                         return true;
                 }
             }
@@ -190,7 +222,68 @@ namespace gr {
               template < class, class > class PFO>
     // Initialize all internal data structures and data members.
     void Match4pcsBase<_Functor, PointType, TransformVisitor, PairFilteringFunctor, PFO>::Initialize() {
-        fun_.Initialize();
+        if (MatchBaseType::prepared_Q_ != nullptr)
+            fun_.Initialize(*MatchBaseType::prepared_Q_);
+        else
+            fun_.Initialize();
+
+        if (MatchBaseType::options_.hasPosePrior()) {
+            const auto& Q = MatchBaseType::sampled_Q_3D_;
+            prior_Q_tree_ = KdTree<Scalar>(Q.size());
+            prior_Q_radius_ = 0;
+            for (const auto& q : Q) {
+                prior_Q_tree_.add(q.pos());
+                prior_Q_radius_ = (std::max)(prior_Q_radius_, q.pos().norm());
+            }
+            prior_Q_tree_.finalize();
+        }
+    }
+
+    template <template <typename, typename, typename> class _Functor,
+              typename PointType,
+              typename TransformVisitor,
+              typename PairFilteringFunctor,
+              template < class, class > class PFO>
+    void Match4pcsBase<_Functor, PointType, TransformVisitor, PairFilteringFunctor, PFO>::ExtractPriorPairs(
+        const PosMutablePoint& b0, const PosMutablePoint& b1,
+        Scalar pair_distance, Scalar pair_normals_angle,
+        Scalar pair_distance_epsilon,
+        PairsVector& pairs) const {
+        const auto& Q = MatchBaseType::sampled_Q_3D_;
+
+        // Samples of Q that an accepted transformation can bring close to b,
+        // at distance of the position the guess brings onto b bounded by the
+        // motion of each sample relative to the guess
+        auto reaching = [&, this](const VectorType& b, std::vector<int>& ids) {
+            const VectorType center = MatchBaseType::prior_rotation_.transpose() *
+                                      (b - MatchBaseType::prior_translation_);
+            const Scalar radius = MatchBaseType::priorRadius(prior_Q_radius_) + pair_distance_epsilon;
+            typename KdTree<Scalar>::template RangeQuery<> query;
+            query.queryPoint = center;
+            query.sqdist     = radius * radius;
+            prior_Q_tree_.doQueryDistProcessIndices(query, [&](int i) {
+                if ((Q[i].pos() - center).norm() <=
+                    MatchBaseType::priorRadius(Q[i].pos().norm()) + pair_distance_epsilon)
+                    ids.push_back(i);
+            });
+        };
+
+        std::vector<int> first, second;
+        reaching(b0.pos(), first);
+        reaching(b1.pos(), second);
+
+        pairs.clear();
+        PairFilteringFunctor filter;
+        for (int i : first) {
+            for (int j : second) {
+                if (i == j) continue;
+                const Scalar distance = (Q[j].pos() - Q[i].pos()).norm();
+                if (std::abs(distance - pair_distance) > pair_distance_epsilon) continue;
+                // The second order of the filter matches its first point with b0
+                if (filter(Q[i], Q[j], pair_normals_angle, b0, b1, MatchBaseType::options_).second)
+                    pairs.emplace_back(i, j);
+            }
+        }
     }
 
 
@@ -207,23 +300,63 @@ namespace gr {
         if(!initBase(base, invariant1, invariant2)) return false;
 
 //        std::cout << "Found a new base !" << std::endl;
-        const auto& b0 = *MatchBaseType::base_3D_[0];
-        const auto& b1 = *MatchBaseType::base_3D_[1];
-        const auto& b2 = *MatchBaseType::base_3D_[2];
-        const auto& b3 = *MatchBaseType::base_3D_[3];
+        std::vector<std::pair<int, int>> pairs1, pairs2;
+
+        return generateCongruents(MatchBaseType::base_3D_, invariant1, invariant2,
+                                  fun_, pairs1, pairs2, congruent_quads);
+    }
+
+    template <template <typename, typename, typename> class _Functor,
+              typename PointType,
+              typename TransformVisitor,
+              typename PairFilteringFunctor,
+              template < class, class > class PFO>
+    bool Match4pcsBase<_Functor, PointType, TransformVisitor, PairFilteringFunctor, PFO>::generateCongruents (
+        CongruentBaseType &base, Set& congruent_quads,
+        typename MatchBaseType::ExplorationContext& context) {
+        ExplorationContext& ctx = static_cast<ExplorationContext&>(context);
+        Scalar invariant1, invariant2;
+
+        if (!SelectQuadrilateral(invariant1, invariant2, base[0], base[1], base[2], base[3],
+                                 ctx.base_3D, ctx.randomGenerator))
+            return false;
+
+        return generateCongruents(ctx.base_3D, invariant1, invariant2,
+                                  ctx.fun, ctx.pairs1, ctx.pairs2, congruent_quads);
+    }
+
+    template <template <typename, typename, typename> class _Functor,
+              typename PointType,
+              typename TransformVisitor,
+              typename PairFilteringFunctor,
+              template < class, class > class PFO>
+    bool Match4pcsBase<_Functor, PointType, TransformVisitor, PairFilteringFunctor, PFO>::generateCongruents (
+        const Coordinates& base_3D,
+        Scalar invariant1, Scalar invariant2,
+        const Functor& fun,
+        PairsVector& pairs1, PairsVector& pairs2,
+        Set& congruent_quads) const {
+        const auto& b0 = *base_3D[0];
+        const auto& b1 = *base_3D[1];
+        const auto& b2 = *base_3D[2];
+        const auto& b3 = *base_3D[3];
 
         // Computes distance between pairs.
         const Scalar distance1 = (b0.pos()- b1.pos()).norm();
         const Scalar distance2 = (b2.pos()- b3.pos()).norm();
 
-        std::vector<std::pair<int, int>> pairs1, pairs2;
-
         // Compute normal angles.
         const Scalar normal_angle1 = (b0.normal() - b1.normal()).norm();
         const Scalar normal_angle2 = (b2.normal() - b3.normal()).norm();
 
-        fun_.ExtractPairs(distance1, normal_angle1, MatchBaseType::distance_factor * MatchBaseType::options_.delta, 0, 1, &pairs1);
-        fun_.ExtractPairs(distance2, normal_angle2, MatchBaseType::distance_factor * MatchBaseType::options_.delta, 2, 3, &pairs2);
+        const Scalar pair_distance_epsilon = MatchBaseType::distance_factor * MatchBaseType::options_.delta;
+        if (MatchBaseType::options_.hasPosePrior()) {
+            ExtractPriorPairs(b0, b1, distance1, normal_angle1, pair_distance_epsilon, pairs1);
+            ExtractPriorPairs(b2, b3, distance2, normal_angle2, pair_distance_epsilon, pairs2);
+        } else {
+            fun.ExtractPairs(distance1, normal_angle1, pair_distance_epsilon, 0, 1, &pairs1);
+            fun.ExtractPairs(distance2, normal_angle2, pair_distance_epsilon, 2, 3, &pairs2);
+        }
 
 
 //        std::cout << "Pair set 1 has " << pairs1.size() << " elements" << std::endl;
@@ -235,7 +368,7 @@ namespace gr {
             return false;
         }
 
-        if (!fun_.FindCongruentQuadrilaterals(invariant1, invariant2,
+        if (!fun.FindCongruentQuadrilaterals(invariant1, invariant2,
                                          MatchBaseType::distance_factor * MatchBaseType::options_.delta,
                                          MatchBaseType::distance_factor * MatchBaseType::options_.delta,
                                          pairs1,
@@ -247,6 +380,17 @@ namespace gr {
         return true;
     }
 
+    template <template <typename, typename, typename> class _Functor,
+              typename PointType,
+              typename TransformVisitor,
+              typename PairFilteringFunctor,
+              template < class, class > class PFO>
+    std::unique_ptr<typename Match4pcsBase<_Functor, PointType, TransformVisitor, PairFilteringFunctor, PFO>::MatchBaseType::ExplorationContext>
+    Match4pcsBase<_Functor, PointType, TransformVisitor, PairFilteringFunctor, PFO>::makeExplorationContext (unsigned int seed) {
+        return std::unique_ptr<typename MatchBaseType::ExplorationContext>(
+                    new ExplorationContext(*this, seed));
+    }
+
     template <template <typename, typename, typename> class _Functor,
               typename PointType,
               typename TransformVisitor,
@@ -276,10 +420,10 @@ namespace gr {
             base[2] = 1;
             base[3] = 4;
 
-            MatchBaseType::base_3D_[0] = &MatchBaseType::sampled_P_3D_ [base[0]];
-            MatchBaseType::base_3D_[1] = &MatchBaseType::sampled_P_3D_ [base[1]];
-            MatchBaseType::base_3D_[2] = &MatchBaseType::sampled_P_3D_ [base[2]];
-            MatchBaseType::base_3D_[3] = &MatchBaseType::sampled_P_3D_ [base[3]];
+            MatchBaseType::base_3D_[0] = &(*MatchBaseType::sampled_P_3D_)[base[0]];
+            MatchBaseType::base_3D_[1] = &(*MatchBaseType::sampled_P_3D_)[base[1]];
+            MatchBaseType::base_3D_[2] = &(*MatchBaseType::sampled_P_3D_)[base[2]];
+            MatchBaseType::base_3D_[3] = &(*MatchBaseType::sampled_P_3D_)[base[3]];
             TryQuadrilateral(invariant1, invariant2, base[0], base[1], base[2], base[3]);
 
             first_time = false;
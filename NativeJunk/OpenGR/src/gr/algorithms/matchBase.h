@@ -43,6 +43,7 @@
 
 #pragma once
 
+#include <memory>
 #include <vector>
 
 #ifdef OpenGR_USE_OPENMP
@@ -52,6 +53,7 @@
 #include "gr/utils/shared.h"
 #include "gr/utils/sampling.h"
 #include "gr/accelerators/kdtree.h"
+#include "gr/algorithms/preparedCloud.h"
 #include "gr/utils/logger.h"
 #include "gr/utils/crtp.h"
 
@@ -110,24 +112,8 @@ public:
 
     using OptionsType = gr::Utils::CRTP < OptExts ... , Options >;
 
-    /// A convenience class used to wrap (any) PointType to allow mutation of position
-    /// of point samples for internal computations.
-    struct PosMutablePoint : public PointType
-    {
-        using VectorType = typename PointType::VectorType;
-
-        private:
-            VectorType posCopy;
-
-        public:
-            template<typename ExternalType>
-            PosMutablePoint(const ExternalType& i)
-                : PointType(i), posCopy(PointType(i).pos()) { }
-
-            inline VectorType & pos() { return posCopy; }
-
-            inline VectorType pos() const { return posCopy; }
-    };
+    /// Samples of the input sets, see gr::PosMutablePoint
+    using PosMutablePoint = gr::PosMutablePoint<PointType>;
 
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
@@ -137,7 +123,7 @@ public:
 
     /// Read access to the sampled clouds used for the registration
     const std::vector<PosMutablePoint>& getFirstSampled() const {
-        return sampled_P_3D_;
+        return *sampled_P_3D_;
     }
 
     /// Read access to the sampled clouds used for the registration
@@ -190,8 +176,8 @@ protected:
     Scalar P_mean_distance_ {Scalar( 0 )};
     /// The transformation matrix by wich we transform Q to P
     Eigen::Matrix<Scalar, 4, 4> transform_ {Eigen::Matrix<Scalar, 4, 4>::Identity()};
-    /// Sampled P (3D coordinates).
-    std::vector<PosMutablePoint> sampled_P_3D_;
+    /// Sampled P (3D coordinates), shared with the PreparedCloud it comes from.
+    std::shared_ptr<const std::vector<PosMutablePoint>> sampled_P_3D_ {std::make_shared<const std::vector<PosMutablePoint>>()};
     /// Sampled Q (3D coordinates).
     std::vector<PosMutablePoint> sampled_Q_3D_;
     /// The centroid of P.
@@ -200,8 +186,15 @@ protected:
     VectorType centroid_Q_ {VectorType::Zero()};
     VectorType qcentroid1_ {VectorType::Zero()};
     VectorType qcentroid2_ {VectorType::Zero()};
-    /// KdTree used to compute the LCP
-    KdTree<Scalar> kd_tree_;
+    /// KdTree on sampled P used to compute the LCP, shared likewise
+    std::shared_ptr<const KdTree<Scalar>> kd_tree_ {std::make_shared<const KdTree<Scalar>>()};
+    /// Prepared Q while init calls Initialize, nullptr otherwise, so that the
+    /// derived classes can share the state they derive from it, see
+    /// PreparedCloud::derived
+    const PreparedCloud<PointType>* prepared_Q_ {nullptr};
+    /// Indices of the samples of P the bases are drawn from, all the samples
+    /// when empty
+    std::vector<int> base_candidates_;
     std::mt19937 randomGenerator_;
     const Utils::Logger &logger_;
 
@@ -231,6 +224,12 @@ protected :
     /// \param max_base_diameter Maximum size allowed between two points of the base
     bool SelectRandomTriangle(Scalar max_base_diameter, int& base1, int& base2, int& base3);
 
+    /// Same as above, but draws the random samples from \p rng instead of the
+    /// generator owned by the matcher. Used when several bases are selected
+    /// concurrently.
+    bool SelectRandomTriangle(Scalar max_base_diameter, int& base1, int& base2, int& base3,
+                              std::mt19937& rng) const;
+
     /// Computes the best rigid transformation between three corresponding pairs.
     /// The transformation is characterized by rotation matrix, translation vector
     /// and a center about which we rotate. The set of pairs is potentially being
@@ -266,10 +265,19 @@ protected :
               const InputRange2& Q,
               const Sampler<PointType>& sampler);
 
+    /// Initializes the internal state of the Base class from clouds sampled
+    /// and indexed beforehand
+    /// @param P The first input set.
+    /// @param Q The second input set.
+    void init(const PreparedCloud<PointType>& P,
+              const PreparedCloud<PointType>& Q);
+
 private:
 
     void initKdTree();
 
+    void initDiameter();
+
 }; /// class MatchBase
 } /// namespace gr
 #include "matchBase.hpp"
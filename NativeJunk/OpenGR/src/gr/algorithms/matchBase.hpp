@@ -40,21 +40,23 @@ template <typename PointType, typename TransformVisitor, template < class, class
 typename MATCH_BASE_TYPE::Scalar
 MATCH_BASE_TYPE::MeanDistance() const {
     const Scalar kDiameterFraction = 0.2;
-    using RangeQuery = typename gr::KdTree<Scalar>::template RangeQuery<>;
 
     int number_of_samples = 0;
     Scalar distance = 0.0;
+    const std::vector<PosMutablePoint>& P = *sampled_P_3D_;
 
-    for (size_t i = 0; i < sampled_P_3D_.size(); ++i) {
+    // Closest other sample of each sample, queried by packets
+    std::vector<typename gr::KdTree<Scalar>::Index> closest (P.size());
+    kd_tree_->doQueryBatch(P.size(), P_diameter_ * kDiameterFraction,
+                           [&P](size_t i) { return P[i].pos().template cast<Scalar>().eval(); },
+                           [&closest](size_t i, int id, Scalar) { closest[i] = id; },
+                           true);
 
-        RangeQuery query;
-        query.sqdist = P_diameter_ * kDiameterFraction;
-        query.queryPoint = sampled_P_3D_[i].pos().template cast<Scalar>();
-
-        auto resId = kd_tree_.doQueryRestrictedClosestIndex(query , i).first;
+    for (size_t i = 0; i < P.size(); ++i) {
+        const auto resId = closest[i];
 
         if (resId != gr::KdTree<Scalar>::invalidIndex()) {
-            distance += (sampled_P_3D_[i].pos() - sampled_P_3D_[resId].pos()).norm();
+            distance += (P[i].pos() - P[resId].pos()).norm();
             number_of_samples++;
         }
     }
@@ -65,27 +67,39 @@ MATCH_BASE_TYPE::MeanDistance() const {
 template <typename PointType, typename TransformVisitor, template < class, class > class ... OptExts>
 bool
 MATCH_BASE_TYPE::SelectRandomTriangle(Scalar max_base_diameter, int &base1, int &base2, int &base3) {
-    int number_of_points = sampled_P_3D_.size();
+    return SelectRandomTriangle(max_base_diameter, base1, base2, base3, randomGenerator_);
+}
+
+template <typename PointType, typename TransformVisitor, template < class, class > class ... OptExts>
+bool
+MATCH_BASE_TYPE::SelectRandomTriangle(Scalar max_base_diameter, int &base1, int &base2, int &base3,
+                                      std::mt19937& rng) const {
+    const std::vector<PosMutablePoint>& P = *sampled_P_3D_;
+    const int number_of_points = base_candidates_.empty() ? int(P.size())
+                                                          : int(base_candidates_.size());
+    const auto pick = [this, &rng, number_of_points]() {
+        const int i = rng() % number_of_points;
+        return base_candidates_.empty() ? i : base_candidates_[i];
+    };
     base1 = base2 = base3 = -1;
 
     // Pick the first point at random.
-    int first_point = randomGenerator_() % number_of_points;
+    int first_point = pick();
 
     const Scalar sq_max_base_diameter_ = max_base_diameter*max_base_diameter;
-    std::cout << "sq_max_base_diameter_: " << sq_max_base_diameter_ << std::endl;
 
     // Try fixed number of times retaining the best other two.
     Scalar best_wide = 0.0;
     for (int i = 0; i < kNumberOfDiameterTrials; ++i) {
         // Pick and compute
-        const int second_point = randomGenerator_() % number_of_points;
-        const int third_point = randomGenerator_() % number_of_points;
+        const int second_point = pick();
+        const int third_point = pick();
         const VectorType u =
-                sampled_P_3D_[second_point].pos() -
-                sampled_P_3D_[first_point].pos();
+                P[second_point].pos() -
+                P[first_point].pos();
         const VectorType w =
-                sampled_P_3D_[third_point].pos() -
-                sampled_P_3D_[first_point].pos();
+                P[third_point].pos() -
+                P[first_point].pos();
         // We try to have wide triangles but still not too large.
         Scalar how_wide = (u.cross(w)).norm();
         if (how_wide > best_wide &&
@@ -103,15 +117,16 @@ MATCH_BASE_TYPE::SelectRandomTriangle(Scalar max_base_diameter, int &base1, int
 template <typename PointType, typename TransformVisitor, template < class, class > class ... OptExts>
 void
 MATCH_BASE_TYPE::initKdTree(){
-    size_t number_of_points = sampled_P_3D_.size();
+    size_t number_of_points = sampled_P_3D_->size();
 
     // Build the kdtree.
-    kd_tree_ = gr::KdTree<Scalar>(number_of_points);
+    auto kd_tree = std::make_shared<gr::KdTree<Scalar>>(number_of_points);
 
     for (size_t i = 0; i < number_of_points; ++i) {
-        kd_tree_.add(sampled_P_3D_[i].pos());
+        kd_tree->add((*sampled_P_3D_)[i].pos());
     }
-    kd_tree_.finalize();
+    kd_tree->finalize();
+    kd_tree_ = std::move(kd_tree);
 }
 
 
@@ -265,21 +280,19 @@ void MATCH_BASE_TYPE::init(const InputRange1& P,
     centroid_P_ = VectorType::Zero();
     centroid_Q_ = VectorType::Zero();
 
-    sampled_P_3D_.clear();
+    std::vector<PosMutablePoint> sampled_P_3D;
     sampled_Q_3D_.clear();
 
     // prepare P
     if (P.size() > options_.sample_size){
-        std::vector<typename InputRange1::value_type > sampled_P_3D;
-
-        sampler(P, options_, sampled_P_3D_);
+        sampler(P, options_, sampled_P_3D);
     }
     else
     {
         Log<LogLevel::ErrorReport>( "(P) More samples requested than available: use whole cloud" );
 
         // copy all the points
-        std::copy(P.begin(), P.end(), std::back_inserter(sampled_P_3D_));
+        std::copy(P.begin(), P.end(), std::back_inserter(sampled_P_3D));
     }
 
     // prepare Q
@@ -316,12 +329,55 @@ void MATCH_BASE_TYPE::init(const InputRange1& P,
         centroid /= Scalar(container.size());
         for(auto& p : container) p.pos() -= centroid;
     };
-    centerPoints(sampled_P_3D_, centroid_P_);
+    centerPoints(sampled_P_3D, centroid_P_);
     centerPoints(sampled_Q_3D_, centroid_Q_);
+    sampled_P_3D_ = std::make_shared<const std::vector<PosMutablePoint>>(std::move(sampled_P_3D));
 
 
     initKdTree();
 
+    initDiameter();
+
+    // Mean distance and a bit more... We increase the estimation to allow for
+    // noise, wrong estimation and non-uniform sampling.
+    P_mean_distance_ = MeanDistance();
+
+    transform_ = Eigen::Matrix<Scalar, 4, 4>::Identity();
+
+    // call Virtual handler
+    Initialize();
+}
+
+template <typename PointType, typename TransformVisitor, template < class, class > class ... OptExts>
+void MATCH_BASE_TYPE::init(const PreparedCloud<PointType>& P,
+                           const PreparedCloud<PointType>& Q) {
+
+    // Samples are already centered, shuffled and indexed. The samples of P
+    // and their KdTree are shared with the prepared cloud, the random subset
+    // of Q is copied.
+    centroid_P_ = P.centroid;
+    centroid_Q_ = Q.centroid;
+
+    sampled_P_3D_ = P.samples;
+    kd_tree_      = P.kd_tree;
+
+    const size_t nbSamples = (std::min)(Q.samples->size(), options_.sample_size);
+    sampled_Q_3D_.assign(Q.samples->begin(), Q.samples->begin() + nbSamples);
+
+    initDiameter();
+
+    P_mean_distance_ = MeanDistance();
+
+    transform_ = Eigen::Matrix<Scalar, 4, 4>::Identity();
+
+    // call Virtual handler
+    prepared_Q_ = &Q;
+    Initialize();
+    prepared_Q_ = nullptr;
+}
+
+template <typename PointType, typename TransformVisitor, template < class, class > class ... OptExts>
+void MATCH_BASE_TYPE::initDiameter() {
     // Compute the diameter of P approximately (randomly). This is far from being
     // Guaranteed close to the diameter but gives good results for most common
     // objects if they are densely sampled.
@@ -335,15 +391,6 @@ void MATCH_BASE_TYPE::init(const InputRange1& P,
             P_diameter_ = l;
         }
     }
-
-    // Mean distance and a bit more... We increase the estimation to allow for
-    // noise, wrong estimation and non-uniform sampling.
-    P_mean_distance_ = MeanDistance();
-
-    transform_ = Eigen::Matrix<Scalar, 4, 4>::Identity();
-
-    // call Virtual handler
-    Initialize();
 }
 
 } // namespace gr
@@ -117,6 +117,33 @@ public:
     }
   }
 
+  /// Samples of Q normalized in the unit box by synch3DContent
+  struct UnitContent {
+    std::vector<Point> points;
+    Point gcenter;
+    Scalar ratio;
+  };
+
+  inline UnitContent unitContent() const {
+    return UnitContent { points, _gcenter, _ratio };
+  }
+
+  /// Same as synch3DContent, from the content normalized by another functor
+  /// for the same samples
+  inline void synch3DContent(const UnitContent& content){
+    points   = content.points;
+    _gcenter = content.gcenter;
+    _ratio   = content.ratio;
+
+    primitives.clear();
+    ids.clear();
+    primitives.reserve(points.size());
+    for (unsigned int i = 0; i < points.size(); ++i) {
+      primitives.emplace_back(points[i], Scalar(1.));
+      ids.push_back(i);
+    }
+  }
+
   inline void setRadius(Scalar radius) {
     const Scalar nRadius = radius/_ratio;
     for(typename std::vector< Primitive >::iterator it = primitives.begin();
@@ -124,6 +151,10 @@ public:
       (*it).radius() = nRadius;
   }
 
+  inline Scalar getNormalizedDistance(Scalar distance) const {
+    return distance/_ratio;
+  }
+
   inline Scalar getNormalizedEpsilon(Scalar eps){
     return eps/_ratio;
   }
@@ -0,0 +1,143 @@
+// Copyright 2020 Nicolas Mellado
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// -------------------------------------------------------------------------- //
+//
+// This file is part of the OpenGR library
+//
+
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric> // std::iota
+#include <random>
+#include <typeindex>
+#include <utility>
+#include <vector>
+
+#include "gr/accelerators/kdtree.h"
+
+namespace gr {
+
+/// A convenience class used to wrap (any) PointType to allow mutation of position
+/// of point samples for internal computations.
+template <typename PointType>
+struct PosMutablePoint : public PointType
+{
+    using VectorType = typename PointType::VectorType;
+
+    private:
+        VectorType posCopy;
+
+    public:
+        template<typename ExternalType>
+        PosMutablePoint(const ExternalType& i)
+            : PointType(i), posCopy(PointType(i).pos()) { }
+
+        inline VectorType & pos() { return posCopy; }
+
+        inline VectorType pos() const { return posCopy; }
+};
+
+/// \brief Point cloud sampled and indexed once, to be registered several times.
+///
+/// A prepared cloud can be used either as P or as Q by MatchBase::init, so
+/// that the sampling of a cloud, its centering and the construction of its
+/// KdTree are computed once per cloud instead of once per registration.
+/// The samples and the KdTree are shared with the matchers using the cloud as
+/// P, which can outlive it.
+/// The options used to prepare the cloud (delta, sample_size and randomSeed)
+/// must match the ones of the matcher.
+template <typename PointType>
+struct PreparedCloud {
+    using Scalar     = typename PointType::Scalar;
+    using VectorType = typename PointType::VectorType;
+    using SampleType = PosMutablePoint<PointType>;
+
+    /// Uniform samples of the input cloud, centered on their centroid, in
+    /// random order, so that the first sample_size ones are a random subset
+    /// (used when the cloud is Q).
+    std::shared_ptr<const std::vector<SampleType>> samples;
+    /// Centroid of the input samples
+    VectorType centroid {VectorType::Zero()};
+    /// KdTree on the samples (used when the cloud is P).
+    std::shared_ptr<const KdTree<Scalar>> kd_tree;
+
+    inline bool empty() const { return ! samples || samples->empty(); }
+
+    /// Samples and indexes the input cloud
+    /// @param points The input set.
+    /// @param options Options of the matcher, providing delta, sample_size and
+    /// randomSeed.
+    /// @param sampler The sampler used to sample the input set.
+    template <typename InputRange, typename Options, template<typename> class Sampler>
+    void prepare(const InputRange& points,
+                 const Options& options,
+                 const Sampler<PointType>& sampler) {
+        std::vector<PointType> uniform;
+        if (points.size() > options.sample_size)
+            sampler(points, options, uniform);
+        else
+            std::copy(points.begin(), points.end(), std::back_inserter(uniform));
+
+        std::mt19937 randomGenerator (options.randomSeed);
+        std::shuffle(uniform.begin(), uniform.end(), randomGenerator);
+
+        centroid = VectorType::Zero();
+        for(const auto& p : uniform) centroid += p.pos();
+        if (! uniform.empty())
+            centroid /= Scalar(uniform.size());
+
+        auto centered = std::make_shared<std::vector<SampleType>>();
+        centered->reserve(uniform.size());
+        for(const auto& p : uniform) {
+            centered->emplace_back(p);
+            centered->back().pos() -= centroid;
+        }
+
+        auto tree = std::make_shared<KdTree<Scalar>>();
+        if (! centered->empty()) {
+            *tree = KdTree<Scalar>(centered->size());
+            for(const auto& p : *centered) tree->add(p.pos());
+            tree->finalize();
+        }
+
+        samples = std::move(centered);
+        kd_tree = std::move(tree);
+
+        std::lock_guard<std::mutex> lock (*derived_mutex_);
+        derived_.clear();
+    }
+
+    /// Returns the state of type T derived from the n first samples by the
+    /// matchers using the cloud as Q, built by \p make for the first of them
+    /// and shared with the next ones. Can be called concurrently.
+    template <typename T, typename Make>
+    std::shared_ptr<const T> derived(size_t n, const Make& make) const {
+        std::lock_guard<std::mutex> lock (*derived_mutex_);
+        std::shared_ptr<const void>& slot = derived_[std::make_pair(std::type_index(typeid(T)), n)];
+        if (! slot)
+            slot = std::shared_ptr<const T>(make());
+        return std::static_pointer_cast<const T>(slot);
+    }
+
+private:
+    mutable std::map<std::pair<std::type_index, size_t>, std::shared_ptr<const void>> derived_;
+    std::shared_ptr<std::mutex> derived_mutex_ {std::make_shared<std::mutex>()};
+};
+
+} // namespace gr
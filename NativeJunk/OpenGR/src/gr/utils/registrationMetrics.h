@@ -22,11 +22,90 @@
 #pragma once
 
 #include "gr/accelerators/kdtree.h"
+#include "gr/accelerators/hashgrid.h"
 #include <Eigen/Core> // Eigen::Ref
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
 namespace gr{
 namespace Utils{
 
+/// \brief Structure of arrays copy of a point set, used to verify candidate
+/// transformations by blocks of points.
+///
+/// Points are reordered along a Morton curve, so that consecutive points, and
+/// thus the points of a block, are spatially coherent. The order of the points
+/// is irrelevant to the registration metrics.
+template <typename Scalar>
+struct BatchedPointSet {
+    using ArrayType = Eigen::Array<Scalar, Eigen::Dynamic, 1>;
+
+    ArrayType x, y, z;
+
+    inline size_t size() const { return size_t(x.size()); }
+
+    template <typename Range>
+    inline void set(const Range& points) {
+        const size_t n = points.size();
+        x.resize(n); y.resize(n); z.resize(n);
+        if (n == 0) return;
+
+        Eigen::Matrix<Scalar, 3, 1> bmin = points[0].pos(), bmax = points[0].pos();
+        for (size_t i = 1; i < n; ++i) {
+            bmin = bmin.cwiseMin(points[i].pos());
+            bmax = bmax.cwiseMax(points[i].pos());
+        }
+        const Scalar extent = (bmax - bmin).maxCoeff();
+        const Scalar scale  = extent > Scalar(0) ? Scalar(1023) / extent : Scalar(0);
+
+        // spread the 10 lower bits of v so that they can be interleaved
+        auto spread = [](uint32_t v) {
+            v = (v | (v << 16)) & 0x030000FF;
+            v = (v | (v <<  8)) & 0x0300F00F;
+            v = (v | (v <<  4)) & 0x030C30C3;
+            v = (v | (v <<  2)) & 0x09249249;
+            return v;
+        };
+
+        std::vector<std::pair<uint32_t, size_t>> keys (n);
+        for (size_t i = 0; i < n; ++i) {
+            const Eigen::Matrix<Scalar, 3, 1> c = (points[i].pos() - bmin) * scale;
+            keys[i] = std::make_pair( spread(uint32_t(c.x())) |
+                                      (spread(uint32_t(c.y())) << 1) |
+                                      (spread(uint32_t(c.z())) << 2), i );
+        }
+        std::sort(keys.begin(), keys.end());
+
+        for (size_t i = 0; i < n; ++i) {
+            const auto& p = points[keys[i].second].pos();
+            x(i) = p.x(); y(i) = p.y(); z(i) = p.z();
+        }
+    }
+};
+
+namespace internal {
+/// Transform the block [first, first+query.count) of target with the affine
+/// part of mat, and store it in the query packet
+template <typename Scalar, typename Packet>
+inline void transformBlock( const BatchedPointSet<Scalar>& target,
+                            size_t first,
+                            const Eigen::Ref<const Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>>& mat,
+                            Packet& query)
+{
+    const int n = query.count;
+    const auto x = target.x.segment(first, n);
+    const auto y = target.y.segment(first, n);
+    const auto z = target.z.segment(first, n);
+    query.x.head(n) = mat(0,0) * x + mat(0,1) * y + mat(0,2) * z + mat(0,3);
+    query.y.head(n) = mat(1,0) * x + mat(1,1) * y + mat(1,2) * z + mat(1,3);
+    query.z.head(n) = mat(2,0) * x + mat(2,1) * y + mat(2,2) * z + mat(2,3);
+}
+} // namespace internal
+
 /// \brief Implementation of the Largest Common PointSet metric
 ///
 template <typename Scalar>
@@ -34,13 +113,13 @@ struct LCPMetric {
     /// Support size of the LCP
     Scalar epsilon_ = (std::numeric_limits<Scalar>::max)();
 
-    template <typename Range>
-    inline Scalar operator()( const gr::KdTree<Scalar> & ref,
+    template <typename Accelerator, typename Range>
+    inline Scalar operator()( const Accelerator & ref,
                               const Range& target,
                               const Eigen::Ref<const Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>>& mat,
                               Scalar terminate_value = Scalar( 0 ))
     {
-        using RangeQuery = typename gr::KdTree<Scalar>::template RangeQuery<>;
+        using RangeQuery = typename Accelerator::template RangeQuery<>;
 
         std::atomic_uint good_points(0);
 
@@ -55,7 +134,7 @@ struct LCPMetric {
             query.queryPoint = (mat * target[i].pos().homogeneous()).template head<3>();
             query.sqdist     = sq_eps;
 
-            if ( ref.doQueryRestrictedClosestIndex( query ).first != gr::KdTree<Scalar>::invalidIndex() ) {
+            if ( ref.doQueryRestrictedClosestIndex( query ).first != Accelerator::invalidIndex() ) {
                 good_points++;
             }
 
@@ -64,6 +143,39 @@ struct LCPMetric {
         }
         return Scalar(good_points) / Scalar(number_of_points);
     }
+
+    /// Batched evaluation: points are transformed and queried by packets
+    template <typename Accelerator>
+    inline Scalar operator()( const Accelerator & ref,
+                              const BatchedPointSet<Scalar>& target,
+                              const Eigen::Ref<const Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>>& mat,
+                              Scalar terminate_value = Scalar( 0 ))
+    {
+        using PacketQuery = typename Accelerator::template PacketRangeQuery<>;
+
+        size_t good_points = 0;
+
+        const size_t number_of_points = target.size();
+        const size_t terminate_int_value = terminate_value * number_of_points;
+
+        PacketQuery query;
+        typename PacketQuery::IndexPacket  ids;
+        typename PacketQuery::ScalarPacket sqdists;
+        query.sqdist = epsilon_*epsilon_;
+
+        for (size_t i = 0; i < number_of_points; i += PacketQuery::PacketSize) {
+            query.count = int((std::min)(size_t(PacketQuery::PacketSize), number_of_points - i));
+            internal::transformBlock(target, i, mat, query);
+
+            // Any point within the support is enough to count as good
+            ref.doQueryRestrictedClosestIndexPacket( query, ids, sqdists, true );
+            good_points += (ids.head(query.count) != Accelerator::invalidIndex()).count();
+
+            // We can terminate if there is no longer chance to get better than terminate_value
+            if (number_of_points - i - query.count + good_points < terminate_int_value) { break; }
+        }
+        return Scalar(good_points) / Scalar(number_of_points);
+    }
 };
 
 /// \brief Implementation of a weighted variant of the Largest Common PointSet metric.
@@ -73,13 +185,13 @@ struct WeightedLCPMetric {
     /// Support size of the LCP
     Scalar epsilon_ = (std::numeric_limits<Scalar>::max)();
 
-    template <typename Range>
-    inline Scalar operator()( const gr::KdTree<Scalar> & ref,
+    template <typename Accelerator, typename Range>
+    inline Scalar operator()( const Accelerator & ref,
                               const Range& target,
                               const Eigen::Ref<const Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>>& mat,
                               Scalar terminate_value = Scalar( 0 ))
     {
-        using RangeQuery = typename gr::KdTree<Scalar>::template RangeQuery<>;
+        using RangeQuery = typename Accelerator::template RangeQuery<>;
 
         std::atomic<Scalar> good_points(0);
 
@@ -104,7 +216,7 @@ struct WeightedLCPMetric {
 
             auto result = ref.doQueryRestrictedClosestIndex( query );
 
-            if ( result.first != gr::KdTree<Scalar>::invalidIndex() ) {
+            if ( result.first != Accelerator::invalidIndex() ) {
                 assert (result.second <= query.sqdist);
                 good_points = good_points + computeWeight(result.second, epsilon_);
             }
@@ -114,6 +226,42 @@ struct WeightedLCPMetric {
         }
         return Scalar(good_points) / Scalar(number_of_points);
     }
+
+    /// Batched evaluation: points are transformed and queried by packets
+    template <typename Accelerator>
+    inline Scalar operator()( const Accelerator & ref,
+                              const BatchedPointSet<Scalar>& target,
+                              const Eigen::Ref<const Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>>& mat,
+                              Scalar terminate_value = Scalar( 0 ))
+    {
+        using PacketQuery = typename Accelerator::template PacketRangeQuery<>;
+
+        Scalar good_points = 0;
+
+        const size_t number_of_points = target.size();
+        const size_t terminate_int_value = terminate_value * number_of_points;
+
+        PacketQuery query;
+        typename PacketQuery::IndexPacket  ids;
+        typename PacketQuery::ScalarPacket sqdists;
+        query.sqdist = epsilon_*epsilon_;
+
+        for (size_t i = 0; i < number_of_points; i += PacketQuery::PacketSize) {
+            query.count = int((std::min)(size_t(PacketQuery::PacketSize), number_of_points - i));
+            internal::transformBlock(target, i, mat, query);
+
+            ref.doQueryRestrictedClosestIndexPacket( query, ids, sqdists );
+
+            // kernel((d/eps)^4 - 1)^2, with (d/eps)^4 = (d^2/eps^2)^2
+            const auto valid = ids.head(query.count) != Accelerator::invalidIndex();
+            const auto x2 = sqdists.head(query.count) / query.sqdist;
+            good_points += valid.select((x2.square() - Scalar(1)).square(), Scalar(0)).sum();
+
+            // We can terminate if there is no longer chance to get better than terminate_value
+            if (number_of_points - i - query.count + good_points < terminate_int_value) { break; }
+        }
+        return Scalar(good_points) / Scalar(number_of_points);
+    }
 };
 
 } // namespace Utils
@@ -0,0 +1,377 @@
+// Copyright 2020 Nicolas Mellado
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// -------------------------------------------------------------------------- //
+//
+// This file is part of the OpenGR library
+//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace gr {
+namespace Utils {
+
+/*!
+  \brief Persistent pool of threads running tasks, balanced by work stealing.
+
+  Each worker owns a deque: the tasks it submits are pushed and popped at the
+  back of its own deque, so that a task and the tasks it spawns run hot in
+  cache, and an idle worker steals the oldest task at the front of the other
+  deques. Tasks submitted from other threads go to a shared deque.
+
+  Tasks are not run directly but through TaskGroup, parallel_for and
+  parallel_reduce. A thread waiting for a group runs the pending tasks of
+  that group meanwhile, and only those, so that parallel loops can be nested
+  without a wait running unrelated work, and the calling thread counts as
+  one of the threads of the pool. The loops nested in a task run on the
+  scheduler of the task by default, see local().
+  */
+class Scheduler
+{
+public:
+    using Task = std::function<void()>;
+
+    /// Creates a pool with nbWorkers threads, on top of the calling ones
+    explicit Scheduler(unsigned int nbWorkers)
+        : queues_(nbWorkers + 1)
+    {
+        for (auto& q : queues_)
+            q.reset(new Queue());
+        for (unsigned int i = 0; i < nbWorkers; ++i)
+            threads_.emplace_back([this, i]{ run(i); });
+    }
+
+    ~Scheduler() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wakeUp_.notify_all();
+        for (auto& t : threads_)
+            t.join();
+    }
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    /// Pool shared by the library, with one thread per core
+    static Scheduler& instance() {
+        static Scheduler scheduler (
+                    (std::max)(1u, std::thread::hardware_concurrency()) - 1);
+        return scheduler;
+    }
+
+    /// Scheduler of the calling thread: the one it runs a task or a parallel
+    /// loop for, instance() otherwise. Default scheduler of TaskGroup,
+    /// parallel_for and parallel_reduce.
+    static Scheduler& local() {
+        Scheduler* scheduler = current().first;
+        return scheduler != nullptr ? *scheduler : instance();
+    }
+
+    /// Makes a scheduler the one of the calling thread, see local(), until
+    /// destroyed
+    class Scope
+    {
+    public:
+        explicit Scope(Scheduler& scheduler)
+            : previous_(current())
+        {
+            if (previous_.first != &scheduler)
+                current() = std::make_pair(&scheduler, scheduler.queues_.size() - 1);
+        }
+
+        ~Scope() { current() = previous_; }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        std::pair<Scheduler*, size_t> previous_;
+    };
+
+    /// Number of threads running tasks, including the calling one
+    inline unsigned int concurrency() const {
+        return static_cast<unsigned int>(threads_.size()) + 1;
+    }
+
+    /// Queues a task, which must not throw
+    void submit(Task task) {
+        const size_t q = current().first == this ?
+                    current().second : queues_.size() - 1;
+        {
+            std::lock_guard<std::mutex> lock(queues_[q]->mutex);
+            queues_[q]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++queued_;
+        }
+        wakeUp_.notify_one();
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    /// Scheduler and queue of the calling thread. Threads which are not
+    /// workers use the shared deque.
+    static std::pair<Scheduler*, size_t>& current() {
+        static thread_local std::pair<Scheduler*, size_t> c (nullptr, 0);
+        return c;
+    }
+
+    /// Pops a task from the back of the own deque, or steals one from the
+    /// front of another deque
+    bool pop(size_t self, Task& task) {
+        if (queued_ <= 0)
+            return false;
+        for (size_t k = 0; k < queues_.size(); ++k) {
+            Queue& queue = *queues_[(self + k) % queues_.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty())
+                continue;
+            if (k == 0) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            --queued_;
+            return true;
+        }
+        return false;
+    }
+
+    void run(size_t self) {
+        current() = std::make_pair(this, self);
+        for (;;) {
+            Task task;
+            if (pop(self, task)) {
+                task();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mutex_);
+            wakeUp_.wait(lock, [this]{ return stop_ || queued_ > 0; });
+            if (stop_ && queued_ <= 0)
+                return;
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable wakeUp_;
+    /// Number of tasks waiting in the deques
+    std::atomic<long> queued_ {0};
+    bool stop_ = false;
+};
+
+/*!
+  \brief Set of tasks run on a Scheduler and waited for together.
+
+  The tasks are kept in a deque owned by the group, the scheduler only
+  receiving a ticket per task, which runs the oldest pending task of the
+  group, if any. A thread waiting for the group runs the newest ones, so
+  that it never runs the tasks of another group.
+
+  The first exception thrown by a task is rethrown by wait.
+  */
+class TaskGroup
+{
+public:
+    explicit TaskGroup(Scheduler& scheduler = Scheduler::local())
+        : scheduler_(scheduler), state_(std::make_shared<State>()) {}
+
+    ~TaskGroup() {
+        try { wait(); } catch (...) {}
+    }
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    inline Scheduler& scheduler() { return scheduler_; }
+
+    /// Runs f asynchronously
+    template <typename Functor>
+    void run(Functor&& f) {
+        const std::shared_ptr<State> state = state_;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            ++state->pending;
+            state->tasks.emplace_back([state, f = std::forward<Functor>(f)]() mutable {
+                try {
+                    f();
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    if (! state->error) state->error = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(state->mutex);
+                if (--state->pending == 0)
+                    state->changed.notify_all();
+            });
+        }
+        state->changed.notify_all();
+
+        // The ticket finds no task when the waiting thread ran them all.
+        // It keeps the state alive, the group may be gone by then.
+        scheduler_.submit([state]{
+            Scheduler::Task task;
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                if (state->tasks.empty()) return;
+                task = std::move(state->tasks.front());
+                state->tasks.pop_front();
+            }
+            task();
+        });
+    }
+
+    /// Waits for all the tasks of the group, including the ones they added to
+    /// the group, running the pending tasks of the group meanwhile.
+    void wait() {
+        for (;;) {
+            Scheduler::Task task;
+            {
+                std::unique_lock<std::mutex> lock(state_->mutex);
+                state_->changed.wait(lock, [this]{
+                    return state_->pending == 0 || ! state_->tasks.empty();
+                });
+                if (state_->tasks.empty())
+                    break;
+                task = std::move(state_->tasks.back());
+                state_->tasks.pop_back();
+            }
+            const Scheduler::Scope scope (scheduler_);
+            task();
+        }
+        std::exception_ptr error;
+        {
+            std::lock_guard<std::mutex> lock(state_->mutex);
+            std::swap(error, state_->error);
+        }
+        if (error) std::rethrow_exception(error);
+    }
+
+private:
+    /// Tasks of the group, shared with the tickets queued in the scheduler
+    struct State {
+        std::mutex mutex;
+        /// Notified when a task is added or the last one ends
+        std::condition_variable changed;
+        std::deque<Scheduler::Task> tasks;
+        /// Number of tasks queued or running
+        long pending = 0;
+        std::exception_ptr error;
+    };
+
+    Scheduler& scheduler_;
+    std::shared_ptr<State> state_;
+};
+
+namespace internal {
+/// Number of chunks used to split a range of n items, of at least grain
+/// items each. Several chunks per thread leave room for work stealing.
+inline long nbChunks(long n, long grain, const Scheduler& scheduler) {
+    const long maxChunks = 4 * long(scheduler.concurrency());
+    return (std::max)(1l, (std::min)((n + grain - 1) / grain, maxChunks));
+}
+}
+
+/*!
+  \brief Calls f(i) for i in [first, last[, in parallel.
+
+  Runs sequentially on the calling thread when the range holds at most grain
+  items, or when the scheduler has no worker.
+  */
+template <typename Index, typename Functor>
+void parallel_for(Index first, Index last, const Functor& f,
+                  Index grain = 1,
+                  Scheduler& scheduler = Scheduler::local())
+{
+    const long n = long(last) - long(first);
+    if (n <= 0) return;
+    const Scheduler::Scope scope (scheduler);
+    if (n <= long(grain) || scheduler.concurrency() == 1) {
+        for (Index i = first; i < last; ++i) f(i);
+        return;
+    }
+
+    const long chunks = internal::nbChunks(n, long((std::max)(grain, Index(1))), scheduler);
+    TaskGroup group (scheduler);
+    for (long c = 1; c < chunks; ++c) {
+        group.run([&f, first, n, chunks, c]{
+            const Index b = Index(long(first) + n * c / chunks);
+            const Index e = Index(long(first) + n * (c + 1) / chunks);
+            for (Index i = b; i < e; ++i) f(i);
+        });
+    }
+    // The calling thread takes the first chunk
+    const Index e = Index(long(first) + n / chunks);
+    for (Index i = first; i < e; ++i) f(i);
+    group.wait();
+}
+
+/*!
+  \brief Reduces the range [first, last[ in parallel.
+
+  The range is split in chunks, each chunk is reduced by
+  map(begin, end, identity) and the chunk values are combined by
+  reduce(a, b), in the order of the chunks, so that the result does not
+  depend on the scheduling.
+  */
+template <typename Index, typename T, typename MapFunctor, typename ReduceFunctor>
+T parallel_reduce(Index first, Index last, const T& identity,
+                  const MapFunctor& map, const ReduceFunctor& reduce,
+                  Index grain = 1,
+                  Scheduler& scheduler = Scheduler::local())
+{
+    const long n = long(last) - long(first);
+    if (n <= 0) return identity;
+    if (n <= long(grain) || scheduler.concurrency() == 1) {
+        const Scheduler::Scope scope (scheduler);
+        return map(first, last, identity);
+    }
+
+    const long chunks = internal::nbChunks(n, long((std::max)(grain, Index(1))), scheduler);
+    std::vector<T> values (chunks, identity);
+    parallel_for(long(0), chunks, [&](long c){
+        values[c] = map(Index(long(first) + n * c / chunks),
+                        Index(long(first) + n * (c + 1) / chunks),
+                        identity);
+    }, 1l, scheduler);
+
+    T result = values[0];
+    for (long c = 1; c < chunks; ++c)
+        result = reduce(result, values[c]);
+    return result;
+}
+
+} // namespace Utils
+} // namespace gr
@@ -10,14 +10,18 @@ namespace NativeJunk
         public static extern void SayHello();
 
         [DllImport("__Internal", EntryPoint = "IterativeClosestPoint")]
-        static extern unsafe int IterativeClosestPoint(float* set1Data, int set1NumPoints, float* set2Data, int set2NumPoints);
-        public static unsafe void IterativeClosestPoint(ReadOnlySpan<Vector3> set1, Span<Vector3> set2)
+        static extern unsafe int IterativeClosestPoint(float* set1Data, int set1NumPoints, float* set2Data, int set2NumPoints, float* outputMat);
+
+        /// <summary>
+        /// Registers set2 onto set1 by ICP. set2 is transformed in place, without copying
+        /// the points, and the returned transform is row major as for OpenGR.
+        /// </summary>
+        public static unsafe Matrix4x4 IterativeClosestPoint(ReadOnlySpan<Vector3> set1, Span<Vector3> set2)
         {
             if (Marshal.SizeOf<Matrix4x4>() != 4 * 4 * 4)
                 throw new Exception("Matrix is the wrong size!");
             if (Marshal.SizeOf<Vector3>() != 3 * 4)
                 throw new Exception("Vector3 is the wrong size!");
-            float score = 0.0f;
             int error = 0;
             Matrix4x4 myMat = Matrix4x4.Identity;
 
@@ -28,14 +32,77 @@ namespace NativeJunk
             {
                 fixed (Vector3* pset2 = set2)
                 {
-                    error = IterativeClosestPoint(&pset1->X, set1.Length, &pset2->X, set2.Length);
+                    error = IterativeClosestPoint(&pset1->X, set1.Length, &pset2->X, set2.Length, &myMat.M11);
                 }
             }
             if (error != 0)
                 throw new Exception($"OpenGR failed with code: {error}");
             Console.WriteLine($"+SET2 MEAN: " + GetMeanPoint(set2));
-            //mat = myMat;
-            //return score;
+            return myMat;
+        }
+
+        [DllImport("__Internal", EntryPoint = "IterativeClosestPointWithOptions")]
+        static extern unsafe int IterativeClosestPointWithOptions(float* set1Data, int set1NumPoints, float* set2Data, int set2NumPoints,
+                                                                  int pyramidLevels, int andersonHistory, float* outputMat);
+
+        /// <summary>
+        /// Same as IterativeClosestPoint, coarse to fine over pyramidLevels levels (1 for the
+        /// full resolution only), with Anderson acceleration over andersonHistory iterates
+        /// (0 to disable it).
+        /// </summary>
+        public static unsafe Matrix4x4 IterativeClosestPoint(ReadOnlySpan<Vector3> set1, Span<Vector3> set2,
+                                                             int pyramidLevels, int andersonHistory = 0)
+        {
+            if (Marshal.SizeOf<Matrix4x4>() != 4 * 4 * 4)
+                throw new Exception("Matrix is the wrong size!");
+            if (Marshal.SizeOf<Vector3>() != 3 * 4)
+                throw new Exception("Vector3 is the wrong size!");
+            int error = 0;
+            Matrix4x4 myMat = Matrix4x4.Identity;
+            fixed (Vector3* pset1 = set1)
+            {
+                fixed (Vector3* pset2 = set2)
+                {
+                    error = IterativeClosestPointWithOptions(&pset1->X, set1.Length, &pset2->X, set2.Length,
+                                                             pyramidLevels, andersonHistory, &myMat.M11);
+                }
+            }
+            if (error != 0)
+                throw new Exception($"OpenGR failed with code: {error}");
+            return myMat;
+        }
+
+        [DllImport("__Internal", EntryPoint = "ProjectiveIterativeClosestPoint")]
+        static extern unsafe int ProjectiveIterativeClosestPoint(float* depthData, int width, int height, float* intrinsics, float* pose, int window,
+                                                                 float* pointsData, int numPoints, float* outputMat);
+
+        /// <summary>
+        /// Registers points onto a depth image by projective ICP: correspondences are found by
+        /// projecting the points into the image instead of searching a tree. The intrinsics are
+        /// laid out as in Intrinsics.txt, scaled to the depth resolution, and unknown depths are <= 0.
+        /// The points are transformed in place, and the returned transform is row major as for OpenGR.
+        /// </summary>
+        public static unsafe Matrix4x4 ProjectiveIterativeClosestPoint(ReadOnlySpan<float> depths, int width, int height,
+                                                                       Matrix4x4 intrinsics, Matrix4x4 cameraToWorld,
+                                                                       Span<Vector3> points, int window = 2)
+        {
+            if (depths.Length < width * height)
+                throw new ArgumentException("Not enough depths for the image size", nameof(depths));
+            int error = 0;
+            Matrix4x4 myMat = Matrix4x4.Identity;
+            var k = stackalloc float[4] { intrinsics.M11, intrinsics.M22, intrinsics.M13, intrinsics.M23 };
+            var pose = Matrix4x4.Transpose(cameraToWorld);
+            fixed (float* pdepths = depths)
+            {
+                fixed (Vector3* ppoints = points)
+                {
+                    error = ProjectiveIterativeClosestPoint(pdepths, width, height, k, &pose.M11, window,
+                                                            &ppoints->X, points.Length, &myMat.M11);
+                }
+            }
+            if (error != 0)
+                throw new Exception($"OpenGR failed with code: {error}");
+            return myMat;
         }
 
         static Vector3 GetMeanPoint(ReadOnlySpan<Vector3> points)
@@ -73,5 +140,458 @@ namespace NativeJunk
             mat = myMat;
             return score;
         }
+
+        [DllImport("__Internal", EntryPoint = "OpenGRMainInterleaved")]
+        static extern unsafe int OpenGRMainInterleaved(float* set1Data, int set1NumPoints, float* set2Data, int set2NumPoints,
+                                                       int attributes, float maxNormalDegrees, float maxColorDistance,
+                                                       float* outputMat, float* outputScore);
+
+        /// <summary>
+        /// Same as OpenGR, with the normals and colors of the points pruning the candidate pairs.
+        /// Normals and colors are used when given for both sets, empty spans ignore them.
+        /// maxNormalDegrees and maxColorDistance are the pruning thresholds, &lt;= 0 to disable them.
+        /// The input sets are not modified.
+        /// </summary>
+        public static unsafe float OpenGR(ReadOnlySpan<Vector3> points1, ReadOnlySpan<Vector3> normals1, ReadOnlySpan<Vector3> colors1,
+                                          ReadOnlySpan<Vector3> points2, ReadOnlySpan<Vector3> normals2, ReadOnlySpan<Vector3> colors2,
+                                          float maxNormalDegrees, float maxColorDistance, out Matrix4x4 mat)
+        {
+            if (Marshal.SizeOf<Matrix4x4>() != 4 * 4 * 4)
+                throw new Exception("Matrix is the wrong size!");
+            var withNormals = normals1.Length == points1.Length && normals2.Length == points2.Length;
+            var withColors = colors1.Length == points1.Length && colors2.Length == points2.Length;
+            var attributes = (withNormals ? 1 : 0) | (withColors ? 2 : 0);
+            var set1 = Interleave(points1, withNormals ? normals1 : default, withColors ? colors1 : default);
+            var set2 = Interleave(points2, withNormals ? normals2 : default, withColors ? colors2 : default);
+            float score = 0.0f;
+            int error = 0;
+            Matrix4x4 myMat = Matrix4x4.Identity;
+            fixed (float* pset1 = set1)
+            {
+                fixed (float* pset2 = set2)
+                {
+                    error = OpenGRMainInterleaved(pset1, points1.Length, pset2, points2.Length,
+                                                  attributes, maxNormalDegrees, maxColorDistance, &myMat.M11, &score);
+                }
+            }
+            if (error != 0)
+                throw new Exception($"OpenGR failed with code: {error}");
+            mat = myMat;
+            return score;
+        }
+
+        /// <summary>
+        /// Interleaves the positions with the normals and colors, when they are not empty.
+        /// </summary>
+        static float[] Interleave(ReadOnlySpan<Vector3> points, ReadOnlySpan<Vector3> normals, ReadOnlySpan<Vector3> colors)
+        {
+            var stride = 3 + (normals.IsEmpty ? 0 : 3) + (colors.IsEmpty ? 0 : 3);
+            var data = new float[points.Length * stride];
+            for (var i = 0; i < points.Length; i++)
+            {
+                var o = i * stride;
+                data[o] = points[i].X; data[o + 1] = points[i].Y; data[o + 2] = points[i].Z;
+                o += 3;
+                if (!normals.IsEmpty)
+                {
+                    data[o] = normals[i].X; data[o + 1] = normals[i].Y; data[o + 2] = normals[i].Z;
+                    o += 3;
+                }
+                if (!colors.IsEmpty)
+                {
+                    data[o] = colors[i].X; data[o + 1] = colors[i].Y; data[o + 2] = colors[i].Z;
+                }
+            }
+            return data;
+        }
+
+        [DllImport("__Internal", EntryPoint = "OpenGRPrepared")]
+        static extern unsafe int OpenGRPrepared(IntPtr set1, IntPtr set2, float* outputMat, float* outputScore);
+
+        /// <summary>
+        /// Same as OpenGR for prepared clouds. set2 is not transformed.
+        /// </summary>
+        public static unsafe float OpenGR(PreparedCloud set1, PreparedCloud set2, out Matrix4x4 mat)
+        {
+            if (Marshal.SizeOf<Matrix4x4>() != 4 * 4 * 4)
+                throw new Exception("Matrix is the wrong size!");
+            float score = 0.0f;
+            Matrix4x4 myMat = Matrix4x4.Identity;
+            int error = OpenGRPrepared(set1.Handle, set2.Handle, &myMat.M11, &score);
+            if (error != 0)
+                throw new Exception($"OpenGR failed with code: {error}");
+            mat = myMat;
+            return score;
+        }
+
+        [DllImport("__Internal", EntryPoint = "OpenGRRegisterFrames")]
+        static extern unsafe int OpenGRRegisterFrames(int numFrames, IntPtr* pointsData, int* numPoints, IntPtr* normalsData, IntPtr* colorsData, float* posesData,
+                                                      int maxNeighbors, int maxMilliseconds, int numThreads,
+                                                      int maxPairs, int* outputPairs, float* outputMats, float* outputScores);
+
+        /// <summary>
+        /// Registers the frames pairwise, in parallel, in one call. Each frame is registered
+        /// with the next one and with its maxNeighbors closest frames according to the
+        /// camera to world poses. normals and colors can be null, or contain null arrays.
+        /// The returned transforms map the points of the second frame of each pair onto
+        /// the first one, and are row major as for OpenGR.
+        /// </summary>
+        public static unsafe FramePairRegistration[] RegisterFrames(Vector3[][] points, Vector3[][] normals, Vector3[][] colors, Matrix4x4[] cameraToWorld,
+                                                                    int maxNeighbors = 2, int maxMilliseconds = 0, int numThreads = 0)
+        {
+            if (Marshal.SizeOf<Matrix4x4>() != 4 * 4 * 4)
+                throw new Exception("Matrix is the wrong size!");
+            if (Marshal.SizeOf<Vector3>() != 3 * 4)
+                throw new Exception("Vector3 is the wrong size!");
+            var numFrames = points.Length;
+            if (cameraToWorld.Length != numFrames)
+                throw new ArgumentException("Expected one pose per frame", nameof(cameraToWorld));
+
+            var handles = new System.Collections.Generic.List<GCHandle>();
+            IntPtr Pin(Vector3[] data)
+            {
+                if (data == null)
+                    return IntPtr.Zero;
+                var handle = GCHandle.Alloc(data, GCHandleType.Pinned);
+                handles.Add(handle);
+                return handle.AddrOfPinnedObject();
+            }
+
+            var pointsData = new IntPtr[numFrames];
+            var normalsData = new IntPtr[numFrames];
+            var colorsData = new IntPtr[numFrames];
+            var numPoints = new int[numFrames];
+            // The native side expects column vectors
+            var poses = new Matrix4x4[numFrames];
+            var maxPairs = Math.Max(1, numFrames * (maxNeighbors + 1));
+            var pairs = new int[2 * maxPairs];
+            var mats = new Matrix4x4[maxPairs];
+            var scores = new float[maxPairs];
+            int result;
+            try
+            {
+                for (var i = 0; i < numFrames; i++)
+                {
+                    pointsData[i] = Pin(points[i]);
+                    normalsData[i] = Pin(normals?[i]);
+                    colorsData[i] = Pin(colors?[i]);
+                    numPoints[i] = points[i].Length;
+                    poses[i] = Matrix4x4.Transpose(cameraToWorld[i]);
+                }
+                fixed (IntPtr* ppoints = pointsData, pnormals = normalsData, pcolors = colorsData)
+                fixed (int* pnumPoints = numPoints, ppairs = pairs)
+                fixed (Matrix4x4* pposes = poses, pmats = mats)
+                fixed (float* pscores = scores)
+                {
+                    result = OpenGRRegisterFrames(numFrames, ppoints, pnumPoints,
+                                                  normals != null ? pnormals : null,
+                                                  colors != null ? pcolors : null,
+                                                  &pposes->M11,
+                                                  maxNeighbors, maxMilliseconds, numThreads,
+                                                  maxPairs, ppairs, &pmats->M11, pscores);
+                }
+            }
+            finally
+            {
+                foreach (var handle in handles)
+                    handle.Free();
+            }
+            if (result < 0)
+                throw new Exception($"OpenGR failed with code: {result}");
+
+            var registrations = new FramePairRegistration[result];
+            for (var p = 0; p < result; p++)
+            {
+                registrations[p] = new FramePairRegistration
+                {
+                    First = pairs[2 * p],
+                    Second = pairs[2 * p + 1],
+                    Transform = mats[p],
+                    Score = scores[p],
+                };
+            }
+            return registrations;
+        }
+    }
+
+    /// <summary>
+    /// Registration of the second frame of a pair onto the first one.
+    /// </summary>
+    public struct FramePairRegistration
+    {
+        public int First;
+        public int Second;
+        public Matrix4x4 Transform;
+        public float Score;
+    }
+
+    /// <summary>
+    /// Point set sampled and indexed once, to be registered against several
+    /// others without preprocessing it again.
+    /// </summary>
+    public class PreparedCloud : IDisposable
+    {
+        [DllImport("__Internal", EntryPoint = "OpenGRPreparedCloud_Create")]
+        static extern unsafe IntPtr Create(float* data, int numPoints);
+        [DllImport("__Internal", EntryPoint = "OpenGRPreparedCloud_Destroy")]
+        static extern void Destroy(IntPtr prepared);
+
+        internal IntPtr Handle { get; private set; }
+
+        public unsafe PreparedCloud(ReadOnlySpan<Vector3> points)
+        {
+            if (Marshal.SizeOf<Vector3>() != 3 * 4)
+                throw new Exception("Vector3 is the wrong size!");
+            fixed (Vector3* ppoints = points)
+            {
+                Handle = Create(&ppoints->X, points.Length);
+            }
+            if (Handle == IntPtr.Zero)
+                throw new Exception("OpenGR failed to prepare the point set");
+        }
+
+        public void Dispose()
+        {
+            if (Handle != IntPtr.Zero)
+            {
+                Destroy(Handle);
+                Handle = IntPtr.Zero;
+            }
+            GC.SuppressFinalize(this);
+        }
+
+        ~PreparedCloud()
+        {
+            if (Handle != IntPtr.Zero)
+                Destroy(Handle);
+        }
+    }
+
+    /// <summary>
+    /// Registration of a point set onto another one, run in time slices so that
+    /// the caller is never blocked for long. Step must be called from a single
+    /// thread, Cancel and GetBest can be called from any thread.
+    /// </summary>
+    public class SlicedRegistration : IDisposable
+    {
+        public const int Running = 0;
+        public const int Done = 1;
+        public const int Cancelled = 2;
+
+        [DllImport("__Internal", EntryPoint = "OpenGRRegistration_Create")]
+        static extern unsafe IntPtr Create(float* set1Data, int set1NumPoints, float* set2Data, int set2NumPoints, int maxMilliseconds);
+        [DllImport("__Internal", EntryPoint = "OpenGRRegistration_Step")]
+        static extern int Step(IntPtr reg, int milliseconds);
+        [DllImport("__Internal", EntryPoint = "OpenGRRegistration_GetBest")]
+        static extern unsafe int GetBest(IntPtr reg, float* outputMat, float* outputScore, float* outputProgress);
+        [DllImport("__Internal", EntryPoint = "OpenGRRegistration_Cancel")]
+        static extern void Cancel(IntPtr reg);
+        [DllImport("__Internal", EntryPoint = "OpenGRRegistration_Destroy")]
+        static extern void Destroy(IntPtr reg);
+
+        [DllImport("__Internal", EntryPoint = "OpenGRRegistration_CreatePrepared")]
+        static extern IntPtr CreatePrepared(IntPtr set1, IntPtr set2, int maxMilliseconds);
+        [DllImport("__Internal", EntryPoint = "OpenGRRegistration_SetPosePrior")]
+        static extern unsafe int SetPosePrior(IntPtr reg, float* guessMat, float maxDegrees, float maxTranslation);
+
+        IntPtr handle;
+
+        public SlicedRegistration(PreparedCloud set1, PreparedCloud set2, int maxMilliseconds = 0)
+        {
+            handle = CreatePrepared(set1.Handle, set2.Handle, maxMilliseconds);
+        }
+
+        public unsafe SlicedRegistration(ReadOnlySpan<Vector3> set1, ReadOnlySpan<Vector3> set2, int maxMilliseconds = 0)
+        {
+            if (Marshal.SizeOf<Vector3>() != 3 * 4)
+                throw new Exception("Vector3 is the wrong size!");
+            fixed (Vector3* pset1 = set1)
+            {
+                fixed (Vector3* pset2 = set2)
+                {
+                    handle = Create(&pset1->X, set1.Length, &pset2->X, set2.Length, maxMilliseconds);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Restricts the search to the transformations within maxDegrees and maxTranslation
+        /// of a guess, e.g. the relative camera poses of two frames, which makes it local.
+        /// The guess is row major, as for PointRegistration.OpenGR. Must be called before
+        /// the first Step.
+        /// </summary>
+        public unsafe void SetPosePrior(Matrix4x4 guess, float maxDegrees, float maxTranslation)
+        {
+            var result = SetPosePrior(handle, &guess.M11, maxDegrees, maxTranslation);
+            if (result < 0)
+                throw new Exception($"OpenGR failed with code: {result}");
+        }
+
+        /// <summary>
+        /// Runs the registration for about the given duration.
+        /// Returns true when the registration is over.
+        /// </summary>
+        public bool Step(int milliseconds)
+        {
+            var state = Step(handle, milliseconds);
+            if (state < 0)
+                throw new Exception($"OpenGR failed with code: {state}");
+            return state != Running;
+        }
+
+        /// <summary>
+        /// Best transformation found so far, with its score and the progress in [0, 1].
+        /// The matrix is row major, as for PointRegistration.OpenGR.
+        /// </summary>
+        public unsafe float GetBest(out Matrix4x4 mat, out float progress)
+        {
+            if (Marshal.SizeOf<Matrix4x4>() != 4 * 4 * 4)
+                throw new Exception("Matrix is the wrong size!");
+            Matrix4x4 myMat = Matrix4x4.Identity;
+            float score = 0.0f;
+            float myProgress = 0.0f;
+            GetBest(handle, &myMat.M11, &score, &myProgress);
+            mat = myMat;
+            progress = myProgress;
+            return score;
+        }
+
+        public void Cancel() => Cancel(handle);
+
+        public void Dispose()
+        {
+            if (handle != IntPtr.Zero)
+            {
+                Destroy(handle);
+                handle = IntPtr.Zero;
+            }
+            GC.SuppressFinalize(this);
+        }
+
+        ~SlicedRegistration()
+        {
+            if (handle != IntPtr.Zero)
+                Destroy(handle);
+        }
+    }
+
+    /// <summary>
+    /// Refined pose of a frame, published by a RegistrationSession.
+    /// </summary>
+    public struct SessionPose
+    {
+        public int Frame;
+        /// <summary>
+        /// World space correction to apply after the pose of the frame, row major as for OpenGR.
+        /// </summary>
+        public Matrix4x4 Correction;
+        /// <summary>
+        /// Fraction of the points of the frame overlapping the model, -1 if its registration failed.
+        /// </summary>
+        public float Score;
+        public bool IsKeyframe;
+    }
+
+    /// <summary>
+    /// Online registration of frames as they are captured. Each frame is registered in
+    /// the background against a voxel downsampled model of the keyframes registered so
+    /// far, starting from its camera pose. AddFrame and Wait can be called from any thread,
+    /// TryGetPose from a single thread at a time.
+    /// </summary>
+    public class RegistrationSession : IDisposable
+    {
+        [DllImport("__Internal", EntryPoint = "OpenGRSession_Create")]
+        static extern IntPtr Create(float voxelSize, float keyframeDistance, float keyframeDegrees, int capacity);
+        [DllImport("__Internal", EntryPoint = "OpenGRSession_AddFrame")]
+        static extern unsafe int AddFrame(IntPtr session, int frame, float* pointsData, float* normalsData, int numPoints, float* pose);
+        [DllImport("__Internal", EntryPoint = "OpenGRSession_PollPose")]
+        static extern unsafe int PollPose(IntPtr session, int* outputFrame, float* outputMat, float* outputScore, int* outputKeyframe);
+        [DllImport("__Internal", EntryPoint = "OpenGRSession_Wait")]
+        static extern int Wait(IntPtr session, int maxMilliseconds);
+        [DllImport("__Internal", EntryPoint = "OpenGRSession_Destroy")]
+        static extern void Destroy(IntPtr session);
+
+        IntPtr handle;
+
+        /// <summary>
+        /// A frame becomes a keyframe when its camera is farther than keyframeDistance or
+        /// rotated by more than keyframeDegrees from every keyframe. At most capacity poses
+        /// wait to be read by TryGetPose, the session pauses meanwhile.
+        /// </summary>
+        public RegistrationSession(float voxelSize = 0.005f, float keyframeDistance = 0.05f, float keyframeDegrees = 15.0f, int capacity = 1024)
+        {
+            handle = Create(voxelSize, keyframeDistance, keyframeDegrees, capacity);
+            if (handle == IntPtr.Zero)
+                throw new ArgumentException("Invalid registration session parameters");
+        }
+
+        /// <summary>
+        /// Queues a frame, given in world space according to its camera to world pose
+        /// (as read from Transform.txt). normals can be empty, for all the frames or none.
+        /// </summary>
+        public unsafe void AddFrame(int frame, ReadOnlySpan<Vector3> points, ReadOnlySpan<Vector3> normals, Matrix4x4 cameraToWorld)
+        {
+            if (Marshal.SizeOf<Vector3>() != 3 * 4)
+                throw new Exception("Vector3 is the wrong size!");
+            if (normals.Length != 0 && normals.Length != points.Length)
+                throw new ArgumentException("Expected one normal per point", nameof(normals));
+            // The native side expects column vectors
+            var pose = Matrix4x4.Transpose(cameraToWorld);
+            int error;
+            fixed (Vector3* ppoints = points, pnormals = normals)
+            {
+                error = AddFrame(handle, frame, &ppoints->X, normals.Length != 0 ? &pnormals->X : null, points.Length, &pose.M11);
+            }
+            if (error != 0)
+                throw new Exception($"OpenGR failed with code: {error}");
+        }
+
+        /// <summary>
+        /// Reads the next refined pose, in the order the frames were added, without blocking.
+        /// </summary>
+        public unsafe bool TryGetPose(out SessionPose pose)
+        {
+            if (Marshal.SizeOf<Matrix4x4>() != 4 * 4 * 4)
+                throw new Exception("Matrix is the wrong size!");
+            int frame = 0, keyframe = 0;
+            float score = 0.0f;
+            Matrix4x4 myMat = Matrix4x4.Identity;
+            var popped = PollPose(handle, &frame, &myMat.M11, &score, &keyframe) != 0;
+            pose = new SessionPose
+            {
+                Frame = frame,
+                Correction = myMat,
+                Score = score,
+                IsKeyframe = keyframe != 0,
+            };
+            return popped;
+        }
+
+        /// <summary>
+        /// Waits for the added frames to be registered. Returns true when they all are.
+        /// </summary>
+        public bool Wait(int maxMilliseconds)
+        {
+            var remaining = Wait(handle, maxMilliseconds);
+            if (remaining < 0)
+                throw new Exception($"OpenGR failed with code: {remaining}");
+            return remaining == 0;
+        }
+
+        public void Dispose()
+        {
+            if (handle != IntPtr.Zero)
+            {
+                Destroy(handle);
+                handle = IntPtr.Zero;
+            }
+            GC.SuppressFinalize(this);
+        }
+
+        ~RegistrationSession()
+        {
+            if (handle != IntPtr.Zero)
+                Destroy(handle);
+        }
     }
 }